@@ -0,0 +1,76 @@
+/*
+ * bl_stub.h
+ *
+ *  RAM loader stub ABI, shared by the bootloader and the stubs it runs.
+ *  Only depends on stdint.h so stubs can be built without the HAL.
+ */
+
+#ifndef INC_BL_STUB_H_
+#define INC_BL_STUB_H_
+
+/*******************************************************************************
+ *  HEARDER FILE INCLUDES
+ ********************************************************************************/
+#include<stdint.h>
+/*******************************************************************************
+ *  MACRO DEFINITION
+ ******************************************************************************/
+#define BL_STUB_MAGIC          0x42545342U   /*"BSTB" little endian*/
+#define BL_STUB_ABI_VERSION    1U
+#define BL_STUB_ARGS           4
+#define BL_STUB_RESULTS        4
+
+/*BL_EXEC_STUB reply status, set by the bootloader before the stub runs*/
+#define BL_STUB_OK             0x00
+#define BL_STUB_BAD_ADDRESS    0x04   /*stub image not entirely in writable SRAM, same code as BL_INVALID_ADDRESS*/
+#define BL_STUB_BAD_HEADER     0x07   /*magic, ABI version or entry offset wrong*/
+
+/*******************************************************************************
+ *  TYPE DEFINITION
+ ******************************************************************************/
+/*First bytes of every stub image. Stubs are linked at address 0 and must be position
+ *independent (no writable globals, no absolute addresses), entry is then the offset of
+ *the entry function with the thumb bit set*/
+typedef struct
+{
+	uint32_t magic;                 /*BL_STUB_MAGIC*/
+	uint32_t abi_version;           /*BL_STUB_ABI_VERSION the stub was built against*/
+	uint32_t entry;                 /*offset of the bl_stub_entry_t from the image start*/
+	uint32_t image_len;             /*bytes of the image including this header*/
+} bl_stub_header_t;
+
+/*Bootloader services a stub may call, all of them run from SRAM or are safe while the
+ *flash is idle. The table lives in SRAM so it can be read while the flash is busy*/
+typedef struct
+{
+	uint32_t abi_version;
+	uint32_t sysclk_hz;
+	uint8_t  (*flash_erase_sector)(uint32_t sector);
+	uint8_t  (*flash_program)(uint32_t mem_address, uint8_t *pBuffer, uint32_t len);
+	uint8_t  (*flash_compare)(uint32_t mem_address, uint8_t *pBuffer, uint32_t len);
+	uint8_t  (*flash_get_sector)(uint32_t address);
+	uint32_t (*flash_digest)(uint32_t base, uint32_t len);
+} bl_stub_api_t;
+
+/*Arguments from the BL_EXEC_STUB request in, results for the reply out*/
+typedef struct
+{
+	uint32_t arg[BL_STUB_ARGS];
+	uint32_t result[BL_STUB_RESULTS];
+} bl_stub_params_t;
+
+/*A stub is called like a normal AAPCS function on the bootloader stack and hands control
+ *back by returning. The return value is reported to the host as stub_status*/
+typedef uint32_t (*bl_stub_entry_t)(const bl_stub_api_t *api, bl_stub_params_t *params);
+
+/*BL_EXEC_STUB reply (little endian, field order is the wire format)*/
+typedef struct
+{
+	uint8_t  status;                /*BL_STUB_* set by the bootloader*/
+	uint8_t  reserved[3];
+	uint32_t stub_status;           /*return value of the stub*/
+	uint32_t cycles;                /*DWT cycles the stub ran for*/
+	uint32_t result[BL_STUB_RESULTS];
+} bl_stub_result_t;
+
+#endif /* INC_BL_STUB_H_ */
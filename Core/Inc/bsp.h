@@ -12,6 +12,7 @@
  *  HEARDER FILE INCLUDES
  ********************************************************************************/
 #include"main.h"
+#include"bl_stub.h"
 /*******************************************************************************
  *  MACRO DEFINITION
  ******************************************************************************/
@@ -40,10 +41,30 @@
 #define BL_OTP_READ				0x5B
 /*This command is used disable all sector read/write protection*/
 #define BL_DIS_R_W_PROTECT				0x5C
+/*This command is used to read the bootloader performance counters (optionally clearing them)*/
+#define BL_GET_STATS				0x5D
+/*This command is used to open a write session over a range of the user flash*/
+#define BL_SESSION_BEGIN			0x5E
+/*This command is used to close the write session once all queued data is programmed*/
+#define BL_SESSION_END				0x5F
+//This command is used to program a slice staged in the SRAM work buffer to the flash
+#define BL_COMMIT					0x60
+//This command is used to run a RAM loader stub (see bl_stub.h) and return its results
+#define BL_EXEC_STUB				0x61
+//This command is used to measure flash, CRC, SRAM and UART performance on the target
+#define BL_BENCH					0x62
+//This command is used to open a streamed write: raw (optionally Reed-Solomon coded) image data follows, checked every block
+#define BL_STREAM					0x63
+//This command is used to read the BL_STREAM progress journal kept in the backup SRAM
+#define BL_JOURNAL					0x65
+//This command is used to address the bootloaders sharing one bus: enumeration, addressed requests, addresses, status and digests
+#define BL_NODE						0x66
 
 /* ACK and NACK bytes*/
 #define BL_ACK   0XA5
 #define BL_NACK  0X7F
+/*Framed reply: [BL_REPLY][len][payload][crc32], sent once the command is done*/
+#define BL_REPLY 0XA6
 
 /*CRC*/
 #define VERIFY_CRC_FAIL    1
@@ -53,6 +74,147 @@
 #define ADDR_INVALID 0x01
 
 #define INVALID_SECTOR 0x04
+/*MEM_WRITE status for a range outside the writable memories (same code as INVALID_SECTOR)*/
+#define BL_INVALID_ADDRESS 0x04
+
+/*MEM_WRITE target classes, see bootloader_mem_class*/
+#define BL_MEM_INVALID         0x00
+#define BL_MEM_FLASH           0x01
+#define BL_MEM_SRAM            0x02
+#define BL_MEM_BKPSRAM         0x03
+
+/*BL_GET_STATS flags*/
+#define BL_STATS_CLEAR 0x01
+
+/*BL_SESSION_BEGIN flags*/
+#define BL_SESSION_LAZY_ERASE  0x01   /*erase a sector only when the first write touches it, no erase ahead*/
+#define BL_SESSION_COMPARE     0x02   /*compare with the flash first: skip equal words, program 1->0 changes in place,
+                                        erase only when a 0->1 change is needed*/
+#define BL_SESSION_RESUME      0x04   /*BL_STREAM only: continue the image the journal records, base is where it resumes*/
+#define BL_SESSION_JOURNAL     0x80   /*internal, set by BL_STREAM: programmed blocks are recorded in the journal*/
+
+/*Session MEM_WRITE replies and BL_STREAM checkpoints carry a 16-bit credit: the frames (blocks)
+ *the host may send beyond the one just answered without overrunning the receive ring, even when
+ *the session queue fills up and the device stops reading it. Replies without a credit leave the
+ *host at what the ring alone holds*/
+#define BL_CREDIT_MAX          0xFFFF
+
+/*Session status reported instead of HAL_OK when a sector programmed in place had to be erased,
+ *followed by the 4 byte address the host must resend from. BL_COMMIT reports it when a sector
+ *holding earlier commits had to be erased, with the address in bl_commit_result_t.crc*/
+#define BL_SESSION_RESTART     0x05
+
+/*BL_COMMIT status when the staged data does not match the CRC sent with the command*/
+#define BL_COMMIT_BAD_CRC      0x06
+
+/*BL_STREAM checkpoint status when a block failed its CRC or was cut short, the offset that
+ *follows is the last good checkpoint the host must resend from*/
+#define BL_STREAM_ROLLBACK     0x08
+
+/*BL_STREAM status when BL_SESSION_RESUME does not match the journal (other image, range or
+ *a resume point past the verified data), BL_JOURNAL status when there is no journal*/
+#define BL_JOURNAL_MISMATCH    0x09
+#define BL_JOURNAL_EMPTY       0x0A
+
+/*bootloader_flash_compare results*/
+#define BL_FLASH_EQUAL         0x00
+#define BL_FLASH_PROGRAMMABLE  0x01
+#define BL_FLASH_NEEDS_ERASE   0x02
+
+/*SRAM work area shared by the bootloader features that need a large buffer*/
+#define BL_WORK_BUFFER_LEN     (96*1024)
+#define BL_SESSION_SLOT_LEN    128
+#define BL_SECTOR_NONE         0xFF
+
+/*BL_GET_HELP feature bits*/
+#define BL_FEATURE_SESSION     0x01   /*BL_SESSION_BEGIN/END with background erase*/
+#define BL_FEATURE_LAZY_ERASE  0x02   /*BL_SESSION_LAZY_ERASE*/
+#define BL_FEATURE_COMPARE     0x04   /*BL_SESSION_COMPARE*/
+#define BL_FEATURE_STATS       0x08   /*BL_GET_STATS*/
+#define BL_FEATURE_STAGING     0x10   /*MEM_WRITE to the work buffer followed by BL_COMMIT*/
+#define BL_FEATURE_STUBS       0x20   /*BL_EXEC_STUB, ABI version in bl_stub.h*/
+#define BL_FEATURE_BENCH       0x40   /*BL_BENCH*/
+#define BL_FEATURE_STREAM      0x80   /*BL_STREAM*/
+#define BL_FEATURE_CREDITS     0x100  /*receive credits in session MEM_WRITE and BL_STREAM replies*/
+#define BL_FEATURE_FEC         0x200  /*Reed-Solomon coded BL_STREAM blocks*/
+#define BL_FEATURE_JOURNAL     0x400  /*BL_JOURNAL and BL_SESSION_RESUME*/
+#define BL_FEATURE_BUS         0x800  /*BL_NODE, several bootloaders on one multi-drop (RS-485) line*/
+
+/*BL_GET_HELP CRC mode bits*/
+#define BL_CRC_MODE_BYTE_WORD  0x01   /*every frame byte fed to the CRC peripheral as one 32-bit word*/
+
+/*Largest command frame, length byte included*/
+#define BL_RX_LEN              200
+
+/*UART receive ring filled by the C_UART interrupt (must be a power of two)*/
+#define BL_RX_RING_LEN         512
+/*Number of vector table entries copied to SRAM (16 system + 97 IRQs, rounded up for VTOR alignment)*/
+#define BL_VECTOR_TABLE_WORDS  128
+/*Reply frame buffer: BL_REPLY, length, up to 255 payload bytes and the CRC*/
+#define BL_TX_FRAME_LEN        264
+
+/*BL_BENCH workload sizes, reported back in bl_bench_t so the host never hardcodes them*/
+#define BL_BENCH_PROGRAM_LEN   1024          /*bytes programmed a word at a time*/
+#define BL_BENCH_BYTE_LEN      64            /*bytes programmed with one call each*/
+#define BL_BENCH_CRC_LEN       4096
+#define BL_BENCH_COPY_LEN      (32*1024)
+#define BL_BENCH_PING_LEN      8             /*bytes the host echoes for the UART round trip*/
+#define BL_BENCH_PING_TIMEOUT_MS 100
+
+/*BL_STREAM limits: block is the data between two CRC checkpoints*/
+#define BL_STREAM_BLOCK_MIN    16
+#define BL_STREAM_BLOCK_MAX    4096
+#define BL_STREAM_GAP_MS       50            /*line idle this long ends a block early, and ends the resync*/
+#define BL_STREAM_TIMEOUT_MS   1000          /*no block started this long aborts the stream*/
+
+/*BL_STREAM forward error correction: with parity bytes set in the header, the block and its CRC
+ *are sent as Reed-Solomon codewords over GF(2^8) (polynomial 0x11D, first root alpha^0) of up to
+ *255 - parity data bytes, each followed by its parity bytes. A codeword is repaired when at
+ *most parity/2 of its bytes are wrong, the block CRC is checked after decoding*/
+#define BL_FEC_POLY            0x11D
+#define BL_FEC_CODEWORD_LEN    255
+#define BL_FEC_PARITY_MIN      2
+#define BL_FEC_PARITY_MAX      32
+/*bytes a block of block_len data bytes takes on the line, CRC and parity included*/
+#define BL_STREAM_WIRE_LEN(block_len, parity) \
+	((block_len) + 4 + (parity) * (((block_len) + 4 + BL_FEC_CODEWORD_LEN - (parity) - 1) / (BL_FEC_CODEWORD_LEN - (parity))))
+
+/*BL_STREAM progress journal at the top of the backup SRAM: it survives a reset, a lost host and,
+ *with VBAT supplied, a power cut. The image is journaled in blocks of BL_JOURNAL_BLOCK_LEN bytes*/
+#define BL_JOURNAL_MAGIC       0x4C4E524AU   /*"JRNL" little endian*/
+#define BL_JOURNAL_BLOCK_LEN   2048
+#define BL_JOURNAL_BLOCKS      (FLASH_SIZE / BL_JOURNAL_BLOCK_LEN)
+#define BL_JOURNAL_REPLY_CRCS  48            /*block CRCs per BL_JOURNAL reply*/
+
+/*BL_NODE operations, the byte after the command code. On a bus every request travels inside
+ *BL_NODE_FOR: [len][BL_NODE][BL_NODE_FOR][address][request frame][crc32]. A node keeps the point
+ *to point behaviour until its first BL_NODE frame, from then on it ignores requests that are not
+ *addressed to it and answers only the ones addressed to it alone. Group and broadcast requests
+ *are never answered, and a lost frame can not leave two nodes talking at once*/
+#define BL_NODE_FOR            0x01   /*address and a whole request frame for the nodes it addresses*/
+#define BL_NODE_GROUP          0x02   /*32 byte mask, bit n makes the node with address n a member of BL_NODE_TO_GROUP*/
+#define BL_NODE_ASSIGN         0x03   /*12 byte UID and an address: the node with that UID takes it and answers*/
+#define BL_NODE_STATUS         0x04   /*request inside BL_NODE_FOR, bl_node_status_t*/
+#define BL_NODE_DIGEST         0x05   /*request inside BL_NODE_FOR: base, block length and count, the
+                                        bootloader_flash_digest of every block*/
+#define BL_NODE_ENUM           0x06   /*slot count, seed, slot length in byte times, flags, first address and a
+                                        64 bit mask: the nodes that answered in a slot of the round before set
+                                        in the mask take the addresses from first address on, in slot order.
+                                        The seed goes up by one every round, the mask is for seed - 1 alone.
+                                        Every node still without an address then answers its 12 byte UID in a
+                                        slot picked from its UID and the seed, counted from the request end*/
+#define BL_NODE_ENUM_RESET     0x01   /*BL_NODE_ENUM flag, forget the address first*/
+#define BL_NODE_ENUM_SLOTS_MAX 64
+#define BL_NODE_UNASSIGNED     0x00
+#define BL_NODE_TO_GROUP       0xFE   /*BL_NODE_FOR address of the group members*/
+#define BL_NODE_BROADCAST      0xFF   /*BL_NODE_FOR address of every node*/
+#define BL_NODE_FOR_LEN        8      /*bytes BL_NODE_FOR adds around a request*/
+#define BL_NODE_GROUP_LEN      32
+#define BL_NODE_DIGESTS_MAX    48            /*block digests per BL_NODE_DIGEST reply*/
+/*Line idle this long ends a frame cut short, a node that lost the frame sync (noise, stream data
+ *for another node) finds it again this way. The host leaves twice this before it addresses
+ *another node and every few broadcast frames*/
+#define BL_NODE_GAP_MS         5
 
 /*Some Start and End addresses of different memories of STM32F446xx MCU */
 /*Change this according to your MCU */
@@ -67,6 +229,170 @@
 /*******************************************************************************
  *  STRUCTURES, ENUMS and TYPEDEFS
  *****************************************************************************/
+/*Performance counters kept in RAM and returned by BL_GET_STATS (little endian, field order is the wire format)*/
+typedef struct
+{
+	uint32_t frames_rx;             /*command frames received*/
+	uint32_t bytes_programmed;      /*payload bytes written by execute_mem_write*/
+	uint32_t crc_failures;          /*frames rejected by bootloader_verify_crc*/
+	uint32_t nacks_sent;
+	uint32_t uart_overrun_errors;
+	uint32_t uart_framing_errors;
+	uint32_t sysclk_hz;             /*cycle counters below are in units of this clock*/
+	uint32_t session_ms;            /*time since the counters were last cleared*/
+	uint64_t cycles_rx;             /*from first byte of a frame to the end of it*/
+	uint64_t cycles_crc;
+	uint64_t cycles_flash_program;
+	uint64_t cycles_flash_erase;
+	uint64_t cycles_log;
+	uint32_t sector_erases;         /*sector erase operations (a mass erase counts every sector)*/
+	uint32_t words_skipped;         /*words not programmed because the flash already held them*/
+	uint32_t bytes_copied;          /*payload bytes written to SRAM/BKPSRAM by execute_mem_write*/
+	uint32_t cycles_ram_copy;
+	uint32_t fec_codewords;         /*BL_STREAM codewords repaired*/
+	uint32_t fec_corrected;         /*bytes repaired by bootloader_fec_decode*/
+	uint32_t fec_failures;          /*codewords with more errors than the parity corrects*/
+	uint32_t cycles_fec;
+} bl_stats_t;
+
+/*BL_GET_HELP reply, followed by the supported command codes (little endian, field order is the wire format)*/
+typedef struct
+{
+	uint8_t  version;
+	uint8_t  crc_modes;             /*BL_CRC_MODE_* bits*/
+	uint8_t  sector_count;
+	uint8_t  command_count;         /*command codes following this structure*/
+	uint16_t max_frame_len;         /*largest request frame, length byte included*/
+	uint16_t rx_ring_len;           /*bytes the host may have in flight*/
+	uint32_t features;              /*BL_FEATURE_* bits*/
+	uint32_t baud_rate;
+	uint32_t work_buffer_addr;
+	uint32_t work_buffer_len;
+	uint32_t sector_base[FLASH_SECTOR_TOTAL + 1];   /*sector start addresses, the last entry is the end of the flash*/
+} bl_help_t;
+
+/*BL_GET_CID reply (little endian, field order is the wire format)*/
+typedef struct
+{
+	uint32_t idcode;                /*DBGMCU->IDCODE, device and revision ID*/
+	uint32_t uid[3];                /*96-bit unique device ID*/
+	uint32_t digest_len;            /*bytes covered by digest, 0 when the requested range was not valid*/
+	uint32_t digest;                /*CRC of the requested flash range, fed to the CRC unit one word at a time*/
+} bl_cid_t;
+
+/*BL_COMMIT reply (little endian, field order is the wire format)*/
+typedef struct
+{
+	uint8_t  status;                /*HAL status, BL_COMMIT_BAD_CRC, INVALID_SECTOR or BL_SESSION_RESTART*/
+	uint8_t  sectors_erased;
+	uint16_t reserved;
+	uint32_t crc;                   /*digest of the programmed flash range, 0 when nothing was programmed,
+	                                 *the address to resend from with BL_SESSION_RESTART*/
+	uint32_t cycles;                /*DWT cycles spent erasing, programming and verifying*/
+} bl_commit_result_t;
+
+/*BL_BENCH result table (little endian, field order is the wire format). A cycle count of 0
+ *means the measurement was skipped*/
+typedef struct
+{
+	uint32_t sysclk_hz;
+	uint8_t  scratch_sector;        /*sector erased and programmed, BL_SECTOR_NONE skips the flash tests*/
+	uint8_t  status;                /*HAL status of the flash tests, HAL_BUSY while a write session is open*/
+	uint16_t ping_len;
+	uint32_t erase_cycles;          /*one erase of the scratch sector*/
+	uint32_t program_word_cycles;   /*program_len bytes, one word per program operation*/
+	uint32_t program_byte_cycles;   /*byte_len bytes, one bootloader_flash_program call each*/
+	uint32_t crc_byte_cycles;       /*crc_len bytes fed one byte per word, as frames are checked*/
+	uint32_t crc_word_cycles;       /*crc_len bytes fed as words, as flash is digested*/
+	uint32_t memcpy_cycles;         /*copy_len bytes SRAM to SRAM*/
+	uint32_t uart_rtt_cycles;       /*first ping byte sent until the last echo byte received*/
+	uint32_t program_len;
+	uint32_t byte_len;
+	uint32_t crc_len;
+	uint32_t copy_len;
+} bl_bench_t;
+
+/*One queued MEM_WRITE chunk waiting for its sector to be erased*/
+typedef struct
+{
+	uint32_t address;
+	uint32_t len;
+	uint8_t  data[BL_SESSION_SLOT_LEN];
+} bl_session_slot_t;
+
+/*Write session state, the slot queue lives in the SRAM work buffer*/
+typedef struct
+{
+	uint8_t  active;
+	uint8_t  flags;                 /*BL_SESSION_BEGIN flags*/
+	uint8_t  status;                /*sticky, first erase/program error of the session*/
+	uint8_t  erase_sector;          /*sector erasing in the background or BL_SECTOR_NONE*/
+	uint8_t  first_sector;
+	uint8_t  last_sector;
+	uint8_t  erased_mask;           /*bit n is set once sector n has been erased in this session*/
+	uint8_t  programmed_mask;       /*bit n is set once sector n was programmed in place (BL_SESSION_COMPARE)*/
+	uint32_t base;
+	uint32_t length;
+	uint32_t restart_address;       /*valid while status is BL_SESSION_RESTART*/
+	uint32_t erase_start_cycles;
+	uint32_t slot_head;
+	uint32_t slot_tail;
+	uint32_t slot_count;
+	uint32_t journal_next;          /*end of the data programmed in order (BL_SESSION_JOURNAL)*/
+} bl_session_t;
+
+/*BL_STREAM progress journal, kept in the backup SRAM at BL_JOURNAL_ADDR*/
+typedef struct
+{
+	uint32_t magic;                 /*BL_JOURNAL_MAGIC, 0 while the header is being rewritten*/
+	uint32_t image_id;              /*chosen by the host, the same for every attempt at one image*/
+	uint32_t base;
+	uint32_t length;
+	uint32_t verified;              /*image bytes from base programmed and read back, whole blocks or length*/
+	uint32_t erased_mask;           /*bit n is set once sector n has been erased for this image*/
+	uint32_t block_crc[BL_JOURNAL_BLOCKS];  /*bootloader_flash_digest of every verified block*/
+} bl_journal_t;
+#define BL_JOURNAL_ADDR        (BKPSRAM_END - sizeof(bl_journal_t))
+
+/*BL_JOURNAL reply, followed by crc_count block CRCs from first_block (little endian, field
+ *order is the wire format)*/
+typedef struct
+{
+	uint8_t  status;                /*HAL_OK or BL_JOURNAL_EMPTY*/
+	uint8_t  erased_mask;
+	uint16_t block_len;             /*BL_JOURNAL_BLOCK_LEN*/
+	uint32_t image_id;
+	uint32_t base;
+	uint32_t length;
+	uint32_t verified;
+	uint16_t first_block;
+	uint16_t crc_count;
+} bl_journal_reply_t;
+
+/*Bus state of this node, see BL_NODE*/
+typedef struct
+{
+	uint8_t  bus;                   /*set by the first BL_NODE frame*/
+	uint8_t  address;               /*BL_NODE_UNASSIGNED until BL_NODE_ASSIGN*/
+	uint8_t  group;                 /*member of BL_NODE_TO_GROUP*/
+	uint8_t  unicast;               /*the request being handled was for this node alone, it may answer*/
+	uint8_t  enum_slot;             /*1 + slot answered in the last BL_NODE_ENUM, 0 for none*/
+	uint8_t  enum_seed;             /*seed of that BL_NODE_ENUM*/
+	uint32_t rx_start;              /*BL_CYCLES_NOW after the length byte of the last frame*/
+	uint32_t rx_cycles;             /*BL_CYCLES_NOW when the last frame was complete, BL_NODE_ENUM slots start there*/
+} bl_node_t;
+
+/*BL_NODE_STATUS reply (little endian, field order is the wire format)*/
+typedef struct
+{
+	uint8_t  address;
+	uint8_t  session_active;
+	uint8_t  session_status;        /*sticky session status*/
+	uint8_t  erased_mask;           /*sectors the open session has erased*/
+	uint32_t slots_queued;          /*session chunks still to program*/
+	uint32_t crc_failures;          /*bl_stats.crc_failures, frames this node dropped*/
+	uint32_t uid[3];
+} bl_node_status_t;
 
 /*******************************************************************************
  *  EXTERN GLOBAL VARIABLES
@@ -80,22 +406,76 @@ void _Error_Handler(char *, int);
  *****************************************************************************/
 
 void  bootloader_uart_read_data(void);
+void bootloader_uart_init(void);
+void bootloader_uart_deinit(void);
+void bootloader_uart_rx_isr(void);
 void bootloader_jump_to_user_app(void);
 
 void bootloader_handle_getver_cmd(uint8_t *bl_rx_buffer);
+void bootloader_handle_gethelp_cmd(uint8_t *pBuffer);
+void bootloader_handle_getcid_cmd(uint8_t *pBuffer);
 void bootloader_handle_go_cmd(uint8_t *pBuffer);
 void bootloader_handle_flash_erase_cmd(uint8_t *pBuffer);
 void bootloader_handle_mem_write_cmd(uint8_t *pBuffer);
+void bootloader_handle_get_stats_cmd(uint8_t *pBuffer);
+void bootloader_handle_session_begin_cmd(uint8_t *pBuffer);
+void bootloader_handle_session_end_cmd(uint8_t *pBuffer);
+void bootloader_handle_session_write_cmd(uint8_t *pBuffer);
+void bootloader_handle_commit_cmd(uint8_t *pBuffer);
+void bootloader_handle_exec_stub_cmd(uint8_t *pBuffer);
+void bootloader_handle_bench_cmd(uint8_t *pBuffer);
+void bootloader_handle_stream_cmd(uint8_t *pBuffer);
+void bootloader_handle_journal_cmd(uint8_t *pBuffer);
+void bootloader_handle_node_cmd(uint8_t *pBuffer);
 void bootloader_send_ack(uint8_t command_code, uint8_t follow_len);
 void bootloader_send_nack(void);
+uint8_t *bootloader_reply_buffer(void);
+void bootloader_reply_send(uint32_t len);
+void bootloader_send_reply(uint8_t *pPayload, uint32_t len);
+void bootloader_reply_flush(void);
 
 uint8_t bootloader_verify_crc (uint8_t *pData, uint32_t len,uint32_t crc_host);
+uint32_t bootloader_flash_digest(uint32_t base, uint32_t len);
 uint8_t get_bootloader_version(void);
 void bootloader_uart_write_data(uint8_t *pBuffer,uint32_t len);
 
 uint8_t verify_address(uint32_t go_address);
+uint8_t bootloader_mem_class(uint32_t mem_address, uint32_t len);
 uint8_t execute_flash_erase(uint8_t sector_number , uint8_t number_of_sector);
 uint8_t execute_mem_write(uint8_t *pBuffer, uint32_t mem_address, uint32_t len);
+void execute_commit(uint32_t mem_address, uint32_t len, uint32_t crc, bl_commit_result_t *result);
+void execute_stub(uint32_t stub_base, bl_stub_params_t *params, bl_stub_result_t *result);
+void execute_bench(uint8_t scratch_sector, bl_bench_t *bench);
+
+/*SRAM resident flash engine, safe to run while the flash array is busy*/
+uint8_t bootloader_flash_erase_sector(uint32_t sector);
+uint8_t bootloader_flash_erase_start(uint32_t sector);
+uint8_t bootloader_flash_erase_poll(void);
+uint8_t bootloader_flash_get_sector(uint32_t address);
+uint8_t bootloader_flash_compare(uint32_t mem_address, uint8_t *pBuffer, uint32_t len);
+uint8_t bootloader_flash_mass_erase(void);
+uint8_t bootloader_flash_program(uint32_t mem_address, uint8_t *pBuffer, uint32_t len);
+
+uint8_t bootloader_session_begin(uint32_t base, uint32_t length, uint8_t flags);
+uint8_t bootloader_session_owns(uint8_t *pBuffer);
+void bootloader_session_queue(uint32_t mem_address, uint8_t *pData, uint32_t len);
+uint32_t bootloader_session_credit(uint32_t unit_len, uint32_t wire_len);
+void bootloader_stream_receive(uint32_t base, uint32_t length, uint32_t block_len, uint32_t parity);
+
+void bootloader_journal_init(void);
+void bootloader_journal_clear(void);
+uint8_t bootloader_journal_matches(uint32_t base, uint32_t length, uint32_t image_id);
+void bootloader_journal_open(uint32_t base, uint32_t length, uint32_t image_id, uint8_t resume);
+void bootloader_journal_advance(uint32_t end);
+
+void bootloader_fec_init(void);
+int32_t bootloader_fec_decode(uint8_t *pCodeword, uint32_t len, uint32_t parity);
+void bootloader_session_pump(void);
+void bootloader_session_idle(void);
+uint8_t bootloader_session_flush(void);
+
+void bootloader_stats_init(void);
+void bootloader_stats_clear(void);
 
 
 #endif /* INC_BSP_H_ */
@@ -12,34 +12,134 @@
 #include"stdarg.h"
 #include"string.h"
 #include"stdio.h"
+#if defined ( __GNUC__ ) && !defined (__CC_ARM)
+/*The __RAM_FUNC code runs while the flash is busy. GCC must not turn its copy loops into calls of
+ *memcpy, memmove or memset, which newlib keeps in flash*/
+#pragma GCC optimize ("no-tree-loop-distribute-patterns")
+#endif
 /*******************************************************************************
  *  EXTERN VARIABLES DEFINITION
  ******************************************************************************/
  extern CRC_HandleTypeDef hcrc;
  extern UART_HandleTypeDef huart2;
  extern UART_HandleTypeDef huart3;
+ /*Linker script symbols bounding the SRAM the bootloader itself uses*/
+ extern uint32_t _sdata;
+ extern uint32_t _end;
+ extern uint32_t _estack;
+ extern uint32_t _Min_Heap_Size;
+ extern uint32_t _Min_Stack_Size;
  /*******************************************************************************
  *  MACRO DEFINITION
  ******************************************************************************/
 #define D_UART   &huart3
 #define C_UART   &huart2
-#define BL_RX_LEN  200
+#define BL_CYCLES_NOW()  (DWT->CYCCNT)
+/*USART2_TX request: DMA1 stream 6 channel 4*/
+#define BL_TX_DMA        DMA1_Stream6
+#define BL_TX_DMA_FLAGS  (DMA_HIFCR_CTCIF6 | DMA_HIFCR_CHTIF6 | DMA_HIFCR_CTEIF6 | DMA_HIFCR_CDMEIF6 | DMA_HIFCR_CFEIF6)
 /*******************************************************************************
  *  GLOBAL VARIABLES DEFINITION
  ******************************************************************************/
  uint8_t supported_commands[] = {
                                 BL_GET_VER ,
+                                BL_GET_HELP,
+                                BL_GET_CID,
                                 BL_FLASH_ERASE,
                                 BL_MEM_WRITE,
 								BL_GO_TO_ADDR,
+								BL_GET_STATS,
+								BL_SESSION_BEGIN,
+								BL_SESSION_END,
+								BL_COMMIT,
+								BL_EXEC_STUB,
+								BL_BENCH,
+								BL_STREAM,
+								BL_JOURNAL,
+								BL_NODE,
  } ;
 
  uint8_t bl_rx_buffer[BL_RX_LEN];
 
+ bl_stats_t bl_stats;
+ static uint32_t bl_stats_start_tick;
+
+ /*C_UART receive ring, head is only written by bootloader_uart_rx_isr and tail only by the parser*/
+ static volatile uint8_t bl_rx_ring[BL_RX_RING_LEN];
+ static volatile uint32_t bl_rx_head;
+ static volatile uint32_t bl_rx_tail;
+
+ /*Vector table copy in SRAM so exception entry never fetches from a busy flash*/
+ static uint32_t bl_ram_vector_table[BL_VECTOR_TABLE_WORDS] __attribute__((aligned(512)));
+ static uint32_t bl_flash_vector_table;
+
+ /*Reply frames, one is built while DMA sends the other*/
+ static uint8_t bl_tx_frame[2][BL_TX_FRAME_LEN] __attribute__((aligned(4)));
+ static uint32_t bl_tx_index;
+
+ /*Sector start addresses, the last entry is the end of the flash.
+  *Deliberately not const so it is placed in SRAM and can be read while the flash is busy*/
+ static uint32_t bl_flash_sector_base[FLASH_SECTOR_TOTAL + 1] = {
+                                0x08000000U, 0x08004000U, 0x08008000U, 0x0800C000U,
+                                0x08010000U, 0x08020000U, 0x08040000U, 0x08060000U,
+                                0x08080000U,
+ };
+ static uint32_t bl_flash_erase_start_cycles;
+
+ /*Large SRAM work area, used as the write session slot queue or, outside a session,
+  *as the staging buffer BL_COMMIT programs from*/
+ static uint32_t bl_work_buffer[BL_WORK_BUFFER_LEN / 4];
+ #define BL_SESSION_SLOTS  (BL_WORK_BUFFER_LEN / sizeof(bl_session_slot_t))
+ static bl_session_t bl_session = { .erase_sector = BL_SECTOR_NONE };
+ /*Bit n is set once a BL_COMMIT programmed sector n, a later commit must not erase it silently*/
+ static uint8_t bl_commit_programmed_mask;
+ /*One BL_STREAM block and its CRC, held until the CRC passes*/
+ static uint8_t bl_stream_block[BL_STREAM_BLOCK_MAX + 4];
+ /*Reed-Solomon codeword being decoded and the GF(2^8) tables, built in SRAM by bootloader_fec_init.
+  *bl_gf_exp is doubled so a product of two logs needs no modulo*/
+ static uint8_t bl_fec_codeword[BL_FEC_CODEWORD_LEN];
+ static uint8_t bl_gf_exp[2 * BL_FEC_CODEWORD_LEN];
+ static uint8_t bl_gf_log[BL_FEC_CODEWORD_LEN + 1];
+ /*BL_STREAM progress journal, in the backup SRAM so it outlives the bootloader*/
+ #define BL_JOURNAL_STATE  ((bl_journal_t *)BL_JOURNAL_ADDR)
+ /*Address and group membership on a shared bus*/
+ static bl_node_t bl_node;
+
+ /*Services handed to RAM loader stubs, not const so it is placed in SRAM like the sector table.
+  *Erase and program go through range checked wrappers, a stub never reaches the bootloader sectors*/
+ static __RAM_FUNC uint8_t bootloader_stub_erase_sector(uint32_t sector);
+ static __RAM_FUNC uint8_t bootloader_stub_program(uint32_t mem_address, uint8_t *pBuffer, uint32_t len);
+ static bl_stub_api_t bl_stub_api = {
+                                .abi_version = BL_STUB_ABI_VERSION,
+                                .flash_erase_sector = bootloader_stub_erase_sector,
+                                .flash_program = bootloader_stub_program,
+                                .flash_compare = bootloader_flash_compare,
+                                .flash_get_sector = bootloader_flash_get_sector,
+                                .flash_digest = bootloader_flash_digest,
+ };
+
 /*******************************************************************************
  *  STATIC FUNCTION PROTOTYPES
  ******************************************************************************/
 static void printmsg(char *format,...);
+static __RAM_FUNC void bootloader_uart_read(uint8_t *pBuffer, uint32_t len);
+static __RAM_FUNC uint32_t bootloader_flash_begin(void);
+static __RAM_FUNC void bootloader_flash_end(uint32_t start_cycles);
+static __RAM_FUNC uint8_t bootloader_flash_wait(void);
+static __RAM_FUNC void bootloader_flash_flush_caches(void);
+static void bootloader_bkpsram_enable(void);
+static __RAM_FUNC uint32_t bootloader_uart_read_timeout(uint8_t *pBuffer, uint32_t len, uint32_t timeout_ms);
+static __RAM_FUNC void bootloader_reply_session_status(uint8_t status, uint32_t credit);
+static __RAM_FUNC void bootloader_reply_stream(uint8_t status, uint32_t offset, uint32_t credit);
+static __RAM_FUNC void bootloader_stream_resync(void);
+static __RAM_FUNC uint32_t bootloader_stream_read_block(uint32_t len, uint32_t parity);
+static __RAM_FUNC uint8_t bootloader_gf_mul(uint8_t a, uint8_t b);
+static __RAM_FUNC uint8_t bootloader_gf_div(uint8_t a, uint8_t b);
+static __RAM_FUNC uint8_t bootloader_gf_poly_eval(const uint8_t *pPoly, uint32_t degree, uint8_t x);
+static __RAM_FUNC uint8_t bootloader_node_receive(uint8_t *pBuffer);
+static __RAM_FUNC uint8_t bootloader_node_accept(uint8_t *pBuffer);
+static __RAM_FUNC void bootloader_node_skip(uint32_t len);
+static uint32_t bootloader_node_slot(uint8_t seed, uint32_t slots);
 
 /*******************************************************************************
  *  FUNCTION DEFINITIONS
@@ -48,20 +148,56 @@ static void printmsg(char *format,...);
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
 *   Function Name : bootloader_uart_read_data
-*   Description   : The function read the UART based cmd data and based on cmd it will process
+*   Description   : The function read the UART based cmd data and based on cmd it will process.
+*                   Runs from SRAM so the frame parser keeps going while the flash is busy
 *   Parameters    : p_args - NULL
 *   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-void  bootloader_uart_read_data(void)
+__RAM_FUNC void  bootloader_uart_read_data(void)
 {
     uint8_t rcv_len=0;
 
 	while(1)
 	{
 		//memset(bl_rx_buffer,0,200);
-		HAL_UART_Receive(C_UART,bl_rx_buffer,1,HAL_MAX_DELAY);
+		bootloader_uart_read(bl_rx_buffer,1);
+		uint32_t rx_start = BL_CYCLES_NOW();
 		rcv_len= bl_rx_buffer[0];
-		HAL_UART_Receive(C_UART,&bl_rx_buffer[1],rcv_len,HAL_MAX_DELAY);
+		if(bl_node.bus)
+		{
+			if(!bootloader_node_receive(bl_rx_buffer))
+			{
+				continue;
+			}
+		}else
+		{
+			if(rcv_len >= BL_RX_LEN)
+			{
+				/*longer than bl_rx_buffer and the max_frame_len BL_GET_HELP reports, drop it whole*/
+				bootloader_node_skip(rcv_len);
+				bootloader_send_nack();
+				continue;
+			}
+			bootloader_uart_read(&bl_rx_buffer[1],rcv_len);
+		}
+		bl_node.rx_start = rx_start;
+		bl_node.rx_cycles = BL_CYCLES_NOW();
+		bl_stats.cycles_rx += (uint32_t)(bl_node.rx_cycles - rx_start);
+		bl_stats.frames_rx++;
+
+		/*On a bus only requests addressed to this node go on, unwrapped*/
+		if((bl_node.bus || (bl_rx_buffer[1] == BL_NODE)) && !bootloader_node_accept(bl_rx_buffer))
+		{
+			continue;
+		}
+		/*Writes inside an open session are queued from SRAM, even while a sector erase is running*/
+		if(bootloader_session_owns(bl_rx_buffer))
+		{
+			bootloader_handle_session_write_cmd(bl_rx_buffer);
+			continue;
+		}
+		/*Everything else runs from flash, let any background erase finish first*/
+		bootloader_session_idle();
 
 		switch(bl_rx_buffer[1])
 		{
@@ -70,6 +206,16 @@ void  bootloader_uart_read_data(void)
                 bootloader_handle_getver_cmd(bl_rx_buffer);
                 break;
             }
+            case BL_GET_HELP:
+            {
+                bootloader_handle_gethelp_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_GET_CID:
+            {
+                bootloader_handle_getcid_cmd(bl_rx_buffer);
+                break;
+            }
             case BL_FLASH_ERASE:
             {
                 bootloader_handle_flash_erase_cmd(bl_rx_buffer);
@@ -84,6 +230,51 @@ void  bootloader_uart_read_data(void)
             {
                 bootloader_handle_go_cmd(bl_rx_buffer);
                 break;
+            }
+            case BL_GET_STATS:
+            {
+                bootloader_handle_get_stats_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_SESSION_BEGIN:
+            {
+                bootloader_handle_session_begin_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_SESSION_END:
+            {
+                bootloader_handle_session_end_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_COMMIT:
+            {
+                bootloader_handle_commit_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_EXEC_STUB:
+            {
+                bootloader_handle_exec_stub_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_BENCH:
+            {
+                bootloader_handle_bench_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_STREAM:
+            {
+                bootloader_handle_stream_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_JOURNAL:
+            {
+                bootloader_handle_journal_cmd(bl_rx_buffer);
+                break;
+            }
+            case BL_NODE:
+            {
+                bootloader_handle_node_cmd(bl_rx_buffer);
+                break;
             }
              default:
              {
@@ -147,10 +338,9 @@ void bootloader_handle_getver_cmd(uint8_t *bl_rx_buffer)
     {
         printmsg("BL_DEBUG_MSG:checksum success !!\n");
         /*checksum is correct..*/
-        bootloader_send_ack(bl_rx_buffer[0],1);
         bl_version=get_bootloader_version();
         printmsg("BL_DEBUG_MSG:BL_VER : %d %#x\n",bl_version,bl_version);
-        bootloader_uart_write_data(&bl_version,1);
+        bootloader_send_reply(&bl_version,1);
 
     }else
     {
@@ -163,6 +353,93 @@ void bootloader_handle_getver_cmd(uint8_t *bl_rx_buffer)
 
 }
 
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_handle_gethelp_cmd
+*   Description   : Helper function to handle BL_GET_HELP command, replies with bl_help_t
+*                   (frame limits, features, flash geometry, work buffer) and supported_commands[]
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_handle_gethelp_cmd(uint8_t *pBuffer)
+{
+    bl_help_t help;
+    printmsg("BL_DEBUG_MSG:bootloader_handle_gethelp_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        help.version = get_bootloader_version();
+        help.crc_modes = BL_CRC_MODE_BYTE_WORD;
+        help.sector_count = FLASH_SECTOR_TOTAL;
+        help.command_count = sizeof(supported_commands);
+        help.max_frame_len = BL_RX_LEN;
+        help.rx_ring_len = BL_RX_RING_LEN;
+        help.features = BL_FEATURE_SESSION | BL_FEATURE_LAZY_ERASE | BL_FEATURE_COMPARE | BL_FEATURE_STATS |
+                        BL_FEATURE_STAGING | BL_FEATURE_STUBS | BL_FEATURE_BENCH | BL_FEATURE_STREAM |
+                        BL_FEATURE_CREDITS | BL_FEATURE_FEC | BL_FEATURE_JOURNAL | BL_FEATURE_BUS;
+        help.baud_rate = huart2.Init.BaudRate;
+        help.work_buffer_addr = (uint32_t)bl_work_buffer;
+        help.work_buffer_len = sizeof(bl_work_buffer);
+        memcpy(help.sector_base, bl_flash_sector_base, sizeof(help.sector_base));
+
+        uint8_t *reply = bootloader_reply_buffer();
+        memcpy(reply, &help, sizeof(help));
+        memcpy(reply + sizeof(help), supported_commands, sizeof(supported_commands));
+        bootloader_reply_send(sizeof(help) + sizeof(supported_commands));
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
+}
+
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_handle_getcid_cmd
+*   Description   : Helper function to handle BL_GET_CID command, replies with bl_cid_t: the
+*                   chip ID, the 96-bit unique ID and the digest of the flash range in the request
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_handle_getcid_cmd(uint8_t *pBuffer)
+{
+    bl_cid_t cid;
+    uint32_t base = *((uint32_t *) (&pBuffer[2]) );
+    uint32_t length = *((uint32_t *) (&pBuffer[6]) );
+    printmsg("BL_DEBUG_MSG:bootloader_handle_getcid_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        cid.idcode = DBGMCU->IDCODE;
+        cid.uid[0] = *((uint32_t *) (UID_BASE) );
+        cid.uid[1] = *((uint32_t *) (UID_BASE + 4) );
+        cid.uid[2] = *((uint32_t *) (UID_BASE + 8) );
+        /*Only whole words inside the flash can be digested*/
+        if( length && !(base & 3) && !(length & 3) && (base >= FLASH_BASE) && (length <= FLASH_SIZE)
+            && (base - FLASH_BASE) <= (FLASH_SIZE - length) )
+        {
+            cid.digest_len = length;
+            cid.digest = bootloader_flash_digest(base, length);
+        }else
+        {
+            cid.digest_len = 0;
+            cid.digest = 0;
+        }
+        printmsg("BL_DEBUG_MSG:digest %#x over %d bytes\n",cid.digest,cid.digest_len);
+        bootloader_send_reply((uint8_t *)&cid,sizeof(cid));
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
+}
+
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
@@ -186,13 +463,13 @@ void bootloader_handle_go_cmd(uint8_t *pBuffer)
 	if (! bootloader_verify_crc(&bl_rx_buffer[0],command_packet_len-4,host_crc))
 	{
         printmsg("BL_DEBUG_MSG:checksum success !!\n");
-        bootloader_send_ack(pBuffer[0],1);
         go_address = *((uint32_t *)&pBuffer[2] );
         printmsg("BL_DEBUG_MSG:GO addr: %#x\n",go_address);
 
         if( verify_address(go_address) == ADDR_VALID )
         {
-            bootloader_uart_write_data(&addr_valid,1);
+            bootloader_send_reply(&addr_valid,1);
+            bootloader_uart_deinit();
             go_address+=1; //make T bit =1
             void (*lets_jump)(void) = (void *)go_address;
             printmsg("BL_DEBUG_MSG: jumping to go address! \n");
@@ -201,7 +478,7 @@ void bootloader_handle_go_cmd(uint8_t *pBuffer)
 		}else
 		{
             printmsg("BL_DEBUG_MSG:GO addr invalid ! \n");
-            bootloader_uart_write_data(&addr_invalid,1);
+            bootloader_send_reply(&addr_invalid,1);
 		}
 
 	}else
@@ -234,7 +511,6 @@ void bootloader_handle_flash_erase_cmd(uint8_t *pBuffer)
 	if (! bootloader_verify_crc(&bl_rx_buffer[0],command_packet_len-4,host_crc))
 	{
         printmsg("BL_DEBUG_MSG:checksum success !!\n");
-        bootloader_send_ack(pBuffer[0],1);
         printmsg("BL_DEBUG_MSG:initial_sector : %d  no_ofsectors: %d\n",pBuffer[2],pBuffer[3]);
 
         HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin,1);
@@ -243,7 +519,7 @@ void bootloader_handle_flash_erase_cmd(uint8_t *pBuffer)
 
         printmsg("BL_DEBUG_MSG: flash erase status: %#x\n",erase_status);
 
-        bootloader_uart_write_data(&erase_status,1);
+        bootloader_send_reply(&erase_status,1);
 
 	}else
 	{
@@ -270,7 +546,6 @@ void bootloader_handle_mem_write_cmd(uint8_t *pBuffer)
 	if (! bootloader_verify_crc(&bl_rx_buffer[0],command_packet_len-4,host_crc))
 	{
         printmsg("BL_DEBUG_MSG:checksum success !!\n");
-        bootloader_send_ack(pBuffer[0],1);
         printmsg("BL_DEBUG_MSG: mem write address : %#x\n",mem_address);
 		if( verify_address(mem_address) == ADDR_VALID )
 		{
@@ -278,13 +553,13 @@ void bootloader_handle_mem_write_cmd(uint8_t *pBuffer)
             HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
             write_status = execute_mem_write(&pBuffer[7],mem_address, payload_len);
             HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
-            bootloader_uart_write_data(&write_status,1);
+            bootloader_send_reply(&write_status,1);
 
 		}else
 		{
             printmsg("BL_DEBUG_MSG: invalid mem write address\n");
             write_status = ADDR_INVALID;
-            bootloader_uart_write_data(&write_status,1);
+            bootloader_send_reply(&write_status,1);
 		}
 
 
@@ -298,237 +573,2561 @@ void bootloader_handle_mem_write_cmd(uint8_t *pBuffer)
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : bootloader_send_ack
-*   Description   :This function sends ACK if CRC matches along with "len to follow"
-*   Parameters    : p_args - int8_t command_code,uint8_t follow_len
+*   Function Name : bootloader_handle_get_stats_cmd
+*   Description   :Helper function to handle BL_GET_STATS command, replies with bl_stats_t
+*                  and clears the counters afterwards when BL_STATS_CLEAR is set
+*   Parameters    : p_args - *pBuffer
 *   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-void bootloader_send_ack(uint8_t command_code, uint8_t follow_len)
+void bootloader_handle_get_stats_cmd(uint8_t *pBuffer)
 {
-	uint8_t ack_buf[2];
-	ack_buf[0] = BL_ACK;
-	ack_buf[1] = follow_len;
-	HAL_UART_Transmit(C_UART,ack_buf,2,HAL_MAX_DELAY);
-
+    uint8_t flags = pBuffer[2];
+    printmsg("BL_DEBUG_MSG:bootloader_handle_get_stats_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        bl_stats.sysclk_hz = HAL_RCC_GetHCLKFreq();
+        bl_stats.session_ms = HAL_GetTick() - bl_stats_start_tick;
+        bootloader_send_reply((uint8_t *)&bl_stats,sizeof(bl_stats_t));
+        if(flags & BL_STATS_CLEAR)
+        {
+            bootloader_stats_clear();
+        }
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
 }
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : bootloader_send_nack
-*   Description   :This function sends NACK "
-*   Parameters    : p_args -NULL
+*   Function Name : bootloader_handle_session_begin_cmd
+*   Description   :Helper function to handle BL_SESSION_BEGIN command
+*   Parameters    : p_args - *pBuffer
 *   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-void bootloader_send_nack(void)
+void bootloader_handle_session_begin_cmd(uint8_t *pBuffer)
 {
-	uint8_t nack = BL_NACK;
-	HAL_UART_Transmit(C_UART,&nack,1,HAL_MAX_DELAY);
+    uint8_t session_status = HAL_OK;
+    uint32_t base = *((uint32_t *) (&pBuffer[2]) );
+    uint32_t length = *((uint32_t *) (&pBuffer[6]) );
+    uint8_t flags = pBuffer[10];
+    printmsg("BL_DEBUG_MSG:bootloader_handle_session_begin_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        printmsg("BL_DEBUG_MSG: session base: %#x len: %d flags: %#x\n",base,length,flags);
+        session_status = bootloader_session_begin(base, length, flags);
+        bootloader_send_reply(&session_status,1);
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
 }
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : bootloader_verify_crc
-*   Description   :This verifies the CRC of the given buffer in pData
-*   Parameters    : p_args -uint8_t *pData,uint32_t crc_host
-*   Return Value  : uint8_t
+*   Function Name : bootloader_handle_session_end_cmd
+*   Description   :Helper function to handle BL_SESSION_END command, replies once every
+*                  queued write is programmed with the sticky session status. On
+*                  BL_SESSION_RESTART the session stays open for the resent data
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-uint8_t bootloader_verify_crc (uint8_t *pData, uint32_t len, uint32_t crc_host)
+void bootloader_handle_session_end_cmd(uint8_t *pBuffer)
 {
-    uint32_t uwCRCValue=0xff;
-
-    for (uint32_t i=0 ; i < len ; i++)
+    uint8_t session_status = HAL_OK;
+    printmsg("BL_DEBUG_MSG:bootloader_handle_session_end_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
 	{
-        uint32_t i_data = pData[i];
-        uwCRCValue = HAL_CRC_Accumulate(&hcrc, &i_data, 1);
-	}
-
-	 /* Reset CRC Calculation Unit */
-  __HAL_CRC_DR_RESET(&hcrc);
-
-	if( uwCRCValue == crc_host)
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+        session_status = bootloader_session_flush();
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
+        printmsg("BL_DEBUG_MSG: session status: %#x erased mask: %#x\n",session_status,bl_session.erased_mask);
+        bootloader_reply_session_status(session_status, 0);
+        if(session_status == BL_SESSION_RESTART)
+        {
+            bl_session.status = HAL_OK;
+        }else
+        {
+            bl_session.active = 0;
+        }
+	}else
 	{
-		return VERIFY_CRC_SUCCESS;
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
 	}
-
-	return VERIFY_CRC_FAIL;
 }
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : bootloader_uart_write_data
-*   Description   :This function writes data in to C_UART
-*   Parameters    : p_args -uint8_t *pBuffer,uint32_t len
+*   Function Name : bootloader_handle_commit_cmd
+*   Description   : Helper function to handle BL_COMMIT command. The request carries the flash
+*                   address, the length and the digest of the slice staged at the start of the
+*                   work buffer, the reply is bl_commit_result_t
+*   Parameters    : p_args - *pBuffer
 *   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-/* This function writes data in to C_UART */
-void bootloader_uart_write_data(uint8_t *pBuffer,uint32_t len)
+void bootloader_handle_commit_cmd(uint8_t *pBuffer)
 {
-	HAL_UART_Transmit(C_UART,pBuffer,len,HAL_MAX_DELAY);
-
+    bl_commit_result_t result;
+    uint32_t mem_address = *((uint32_t *) (&pBuffer[2]) );
+    uint32_t length = *((uint32_t *) (&pBuffer[6]) );
+    uint32_t staged_crc = *((uint32_t *) (&pBuffer[10]) );
+    printmsg("BL_DEBUG_MSG:bootloader_handle_commit_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+        execute_commit(mem_address, length, staged_crc, &result);
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
+        printmsg("BL_DEBUG_MSG: commit status: %#x crc: %#x\n",result.status,result.crc);
+        bootloader_send_reply((uint8_t *)&result,sizeof(result));
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
 }
-
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : get_bootloader_version
-*   Description   :return value of MACRO
-*   Parameters    : p_args -NULL
-*   Return Value  : uint8_t
+*   Function Name : bootloader_handle_exec_stub_cmd
+*   Description   : Helper function to handle BL_EXEC_STUB command. The request carries the
+*                   stub image address and BL_STUB_ARGS arguments, the reply is bl_stub_result_t
+*                   once the stub has returned
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-uint8_t get_bootloader_version(void)
+void bootloader_handle_exec_stub_cmd(uint8_t *pBuffer)
 {
-  return (uint8_t)BL_VERSION;
+    bl_stub_result_t result;
+    bl_stub_params_t params;
+    uint32_t stub_base = *((uint32_t *) (&pBuffer[2]) );
+    printmsg("BL_DEBUG_MSG:bootloader_handle_exec_stub_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        memcpy(params.arg, &pBuffer[6], sizeof(params.arg));
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+        execute_stub(stub_base, &params, &result);
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
+        printmsg("BL_DEBUG_MSG: stub status: %#x returned: %#x\n",result.status,result.stub_status);
+        bootloader_send_reply((uint8_t *)&result,sizeof(result));
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
 }
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : verify_address
-*   Description   :verify the address sent by the host .
-*   Parameters    : p_args -uint32_t go_address
-*   Return Value  : uint8_t
+*   Function Name : bootloader_handle_bench_cmd
+*   Description   : Helper function to handle BL_BENCH command. The request carries the scratch
+*                   sector. The ACK is followed by BL_BENCH_PING_LEN ping bytes the host echoes,
+*                   then by the bl_bench_t table once all measurements are done
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-uint8_t verify_address(uint32_t go_address)
+void bootloader_handle_bench_cmd(uint8_t *pBuffer)
 {
-	if ( go_address >= SRAM1_BASE && go_address <= SRAM1_END)
-	{
-		return ADDR_VALID;
-	}
-	else if ( go_address >= SRAM2_BASE && go_address <= SRAM2_END)
-	{
-		return ADDR_VALID;
-	}
-	else if ( go_address >= FLASH_BASE && go_address <= FLASH_END)
+    bl_bench_t bench;
+    uint8_t ping[BL_BENCH_PING_LEN];
+    uint8_t echo[BL_BENCH_PING_LEN];
+    uint8_t scratch_sector = pBuffer[2];
+    printmsg("BL_DEBUG_MSG:bootloader_handle_bench_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
 	{
-		return ADDR_VALID;
-	}
-	else if ( go_address >= BKPSRAM_BASE && go_address <= BKPSRAM_END)
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        bootloader_send_ack(pBuffer[0],BL_BENCH_PING_LEN + sizeof(bench));
+
+        /*UART round trip first, before the flash tests keep the host waiting*/
+        for(uint32_t i = 0 ; i < BL_BENCH_PING_LEN ; i++)
+        {
+            ping[i] = (uint8_t)(0xB0 + i);
+        }
+        uint32_t ping_start = BL_CYCLES_NOW();
+        bootloader_uart_write_data(ping,BL_BENCH_PING_LEN);
+        uint32_t echoed = bootloader_uart_read_timeout(echo,BL_BENCH_PING_LEN,BL_BENCH_PING_TIMEOUT_MS);
+        uint32_t rtt_cycles = BL_CYCLES_NOW() - ping_start;
+
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+        execute_bench(scratch_sector, &bench);
+        HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
+        bench.ping_len = BL_BENCH_PING_LEN;
+        bench.uart_rtt_cycles = ((echoed == BL_BENCH_PING_LEN) && !memcmp(ping, echo, BL_BENCH_PING_LEN)) ? rtt_cycles : 0;
+        printmsg("BL_DEBUG_MSG: bench status: %#x\n",bench.status);
+        bootloader_uart_write_data((uint8_t *)&bench,sizeof(bench));
+	}else
 	{
-		return ADDR_VALID;
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
 	}
-	else
-		return ADDR_INVALID;
 }
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : execute_flash_erase
-*   Description   :Erase the Entire Flash or sectors
-*   Parameters    : p_args -uint8_t sector_number,uint8_t number_of_sector
-*   Return Value  : uint8_t
+*   Function Name : bootloader_handle_stream_cmd
+*   Description   :Helper function to handle BL_STREAM command. Opens a write session over the
+*                  range and receives the raw image in bootloader_stream_receive, the host ends it
+*                  with BL_SESSION_END like any other session. A non zero parity byte turns on
+*                  the Reed-Solomon coding of the blocks. With BL_SESSION_RESUME the range is the
+*                  rest of the image the journal records, sectors it erased are not erased again
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-uint8_t execute_flash_erase(uint8_t sector_number , uint8_t number_of_sector)
+void bootloader_handle_stream_cmd(uint8_t *pBuffer)
 {
-	FLASH_EraseInitTypeDef flashErase_handle;
-	uint32_t sectorError;
-	HAL_StatusTypeDef status;
-
-
-	if( number_of_sector > 8 )
-		return INVALID_SECTOR;
-
-	if( (sector_number == 0xff ) || (sector_number <= 7) )
+    uint8_t stream_status = HAL_OK;
+    uint32_t base = *((uint32_t *) (&pBuffer[2]) );
+    uint32_t length = *((uint32_t *) (&pBuffer[6]) );
+    uint32_t block_len = *((uint16_t *) (&pBuffer[10]) );
+    uint8_t flags = pBuffer[12];
+    /*parity byte and image ID added after the first BL_STREAM hosts, their shorter header means none*/
+    uint32_t parity = (pBuffer[0] > 16) ? pBuffer[13] : 0;
+    uint32_t image_id = (pBuffer[0] > 20) ? *((uint32_t *) (&pBuffer[14]) ) : 0;
+    printmsg("BL_DEBUG_MSG:bootloader_handle_stream_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
 	{
-		if(sector_number == (uint8_t) 0xff)
-		{
-			flashErase_handle.TypeErase = FLASH_TYPEERASE_MASSERASE;
-		}else
-		{
-		    /*Here we are just calculating how many sectors needs to erased */
-			uint8_t remanining_sector = 8 - sector_number;
-            if( number_of_sector > remanining_sector)
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        printmsg("BL_DEBUG_MSG: stream base: %#x len: %d block: %d\n",base,length,block_len);
+        printmsg("BL_DEBUG_MSG: stream flags: %#x parity: %d\n",flags,parity);
+        if((block_len < BL_STREAM_BLOCK_MIN) || (block_len > BL_STREAM_BLOCK_MAX) ||
+           (parity && ((parity < BL_FEC_PARITY_MIN) || (parity > BL_FEC_PARITY_MAX))))
+        {
+            stream_status = HAL_ERROR;
+        }else if((flags & BL_SESSION_RESUME) && !bootloader_journal_matches(base, length, image_id))
+        {
+            stream_status = BL_JOURNAL_MISMATCH;
+        }else
+        {
+            /*blocks are only queued once their CRC passed, a BL_SESSION_COMPARE restart
+             *would have to rewind past them so it is not offered here*/
+            stream_status = bootloader_session_begin(base, length, (flags & BL_SESSION_LAZY_ERASE) | BL_SESSION_JOURNAL);
+            if(stream_status == HAL_OK)
             {
-            	number_of_sector = remanining_sector;
+                bootloader_journal_open(base, length, image_id, flags & BL_SESSION_RESUME);
             }
-			flashErase_handle.TypeErase = FLASH_TYPEERASE_SECTORS;
-			flashErase_handle.Sector = sector_number; // this is the initial sector
-			flashErase_handle.NbSectors = number_of_sector;
-		}
-		flashErase_handle.Banks = FLASH_BANK_1;
-
-		/*Get access to touch the flash registers */
-		HAL_FLASH_Unlock();
-		flashErase_handle.VoltageRange = FLASH_VOLTAGE_RANGE_3;  // our mcu will work on this voltage range
-		status = (uint8_t) HAL_FLASHEx_Erase(&flashErase_handle, &sectorError);
-		HAL_FLASH_Lock();
-
-		return status;
+        }
+        bootloader_reply_stream(stream_status, 0, bootloader_session_credit(block_len, BL_STREAM_WIRE_LEN(block_len, parity)));
+        if(stream_status == HAL_OK)
+        {
+            HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+            bootloader_stream_receive(base, length, block_len, parity);
+            HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
+        }
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
 	}
-
-
-	return INVALID_SECTOR;
 }
-
- /* -----------------------------------------------------------------------------
- *  FUNCTION DESCRIPTION
- *  -----------------------------------------------------------------------------
- *   Function Name : execute_mem_write
- *   Description   :This function writes the contents of pBuffer to  "mem_address" byte by byte
- *   Parameters    : p_args -uint8_t *pBuffer,uint32_t mem_address, uint32_t len
- *   Return Value  : uint8_t
- *  ---------------------------------------------------------------------------*/
-uint8_t execute_mem_write(uint8_t *pBuffer, uint32_t mem_address, uint32_t len)
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_handle_journal_cmd
+*   Description   :Helper function to handle BL_JOURNAL command. Replies with the journal header
+*                  and up to BL_JOURNAL_REPLY_CRCS verified block CRCs from the requested block
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_handle_journal_cmd(uint8_t *pBuffer)
 {
-    uint8_t status = HAL_OK;
-    uint32_t bytes_remaining = len;
-    uint32_t bytes_written = 0;
-    uint32_t chunk_size = 128;
-    HAL_FLASH_Unlock();
-
-    while (bytes_remaining > 0)
-    {
-        uint32_t current_chunk_size = (bytes_remaining >= chunk_size) ? chunk_size : bytes_remaining;
-        for (uint32_t i = 0; i < current_chunk_size; i++)
+    bl_journal_t *journal = BL_JOURNAL_STATE;
+    bl_journal_reply_t header;
+    uint8_t *reply = bootloader_reply_buffer();
+    uint32_t first_block = *((uint16_t *) (&pBuffer[2]) );
+    printmsg("BL_DEBUG_MSG:bootloader_handle_journal_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        memset(&header, 0, sizeof(header));
+        header.block_len = BL_JOURNAL_BLOCK_LEN;
+        header.first_block = first_block;
+        if(journal->magic != BL_JOURNAL_MAGIC)
         {
-            status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, mem_address + bytes_written + i, pBuffer[bytes_written + i]);
-            if (status != HAL_OK)
+            header.status = BL_JOURNAL_EMPTY;
+        }else
+        {
+            uint32_t verified_blocks = (journal->verified + BL_JOURNAL_BLOCK_LEN - 1) / BL_JOURNAL_BLOCK_LEN;
+            header.erased_mask = (uint8_t)journal->erased_mask;
+            header.image_id = journal->image_id;
+            header.base = journal->base;
+            header.length = journal->length;
+            header.verified = journal->verified;
+            if(verified_blocks > BL_JOURNAL_BLOCKS)
+            {
+                verified_blocks = BL_JOURNAL_BLOCKS;
+            }
+            /*first_block comes from the host, block_crc is only read below verified_blocks*/
+            if(first_block < verified_blocks)
             {
-                HAL_FLASH_Lock();
-                return status;
+                header.crc_count = ((verified_blocks - first_block) > BL_JOURNAL_REPLY_CRCS) ?
+                                   BL_JOURNAL_REPLY_CRCS : (verified_blocks - first_block);
+                /*the reply buffer is only byte aligned*/
+                memcpy(&reply[sizeof(header)], &journal->block_crc[first_block], 4 * header.crc_count);
             }
         }
-
-        bytes_written += current_chunk_size;
-        bytes_remaining -= current_chunk_size;
-    }
-    HAL_FLASH_Lock();
-
-    return status;
-}
-/*
-uint8_t execute_mem_write(uint8_t *pBuffer, uint32_t mem_address, uint32_t len)
+        memcpy(reply, &header, sizeof(header));
+        printmsg("BL_DEBUG_MSG: journal status: %#x verified: %d\n",header.status,header.verified);
+        bootloader_reply_send(sizeof(header) + 4 * header.crc_count);
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_handle_node_cmd
+*   Description   :Helper function to handle BL_NODE command, BL_NODE_FOR never gets here.
+*                  ASSIGN is answered by the node whose UID it names, ENUM by every node without
+*                  an address in its own slot. STATUS and DIGEST come inside BL_NODE_FOR and are
+*                  only answered when addressed to this node alone
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_handle_node_cmd(uint8_t *pBuffer)
 {
-    uint8_t status=HAL_OK;
+    uint8_t op = pBuffer[2];
+    uint8_t *reply = bootloader_reply_buffer();
+    printmsg("BL_DEBUG_MSG:bootloader_handle_node_cmd\n");
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+        printmsg("BL_DEBUG_MSG:checksum success !!\n");
+        switch(op)
+        {
+            case BL_NODE_GROUP:
+            {
+                bl_node.group = (bl_node.address != BL_NODE_UNASSIGNED) &&
+                                (pBuffer[3 + bl_node.address / 8] & (1U << (bl_node.address % 8)));
+                break;
+            }
+            case BL_NODE_ASSIGN:
+            {
+                if(memcmp(&pBuffer[3], (uint8_t *)UID_BASE, 12))
+                {
+                    break;
+                }
+                reply[0] = ((pBuffer[15] == BL_NODE_TO_GROUP) || (pBuffer[15] == BL_NODE_BROADCAST)) ? HAL_ERROR : HAL_OK;
+                if(reply[0] == HAL_OK)
+                {
+                    bl_node.address = pBuffer[15];
+                }
+                reply[1] = bl_node.address;
+                printmsg("BL_DEBUG_MSG: node address: %d\n",bl_node.address);
+                bl_node.unicast = 1;
+                bootloader_reply_send(2);
+                break;
+            }
+            case BL_NODE_ENUM:
+            {
+                uint32_t slots = pBuffer[3];
+                uint32_t slot_len = pBuffer[5];
+                uint32_t mask[2];
+                uint32_t byte_cycles = SystemCoreClock / (huart2.Init.BaudRate / 10U);
+                uint32_t measured = (bl_node.rx_cycles - bl_node.rx_start) / pBuffer[0];
+                uint32_t slot;
+
+                memcpy(mask, &pBuffer[8], sizeof(mask));
+                if(pBuffer[6] & BL_NODE_ENUM_RESET)
+                {
+                    bl_node.address = BL_NODE_UNASSIGNED;
+                    bl_node.group = 0;
+                    bl_node.enum_slot = 0;
+                }
+                if(bl_node.enum_slot)
+                {
+                    /*the host heard this UID in the round before and hands out the addresses in slot order.
+                     *A node that missed a request must not take the mask of a later round for its own*/
+                    slot = bl_node.enum_slot - 1;
+                    if((pBuffer[4] == (uint8_t)(bl_node.enum_seed + 1U)) && (mask[slot / 32] & (1U << (slot % 32))))
+                    {
+                        uint32_t address = pBuffer[7] + ((slot < 32) ? __builtin_popcount(mask[0] & ((1U << slot) - 1U)) :
+                                           __builtin_popcount(mask[0]) + __builtin_popcount(mask[1] & ((1U << (slot - 32)) - 1U)));
+
+                        /*the same addresses BL_NODE_ASSIGN refuses, the node stays unassigned and answers again*/
+                        if((address != BL_NODE_UNASSIGNED) && (address < BL_NODE_TO_GROUP))
+                        {
+                            bl_node.address = (uint8_t)address;
+                        }
+                        printmsg("BL_DEBUG_MSG: node address: %d\n",bl_node.address);
+                    }
+                    bl_node.enum_slot = 0;
+                }
+                if(!slots || (slots > BL_NODE_ENUM_SLOTS_MAX) || (bl_node.address != BL_NODE_UNASSIGNED))
+                {
+                    break;
+                }
+                /*Slots are counted in byte times of the host as the HSI sees them, so they do not drift
+                 *apart with the clocks of the nodes. A request that sat in the ring is not a measure*/
+                if((measured > byte_cycles - byte_cycles / 16) && (measured < byte_cycles + byte_cycles / 16))
+                {
+                    byte_cycles = measured;
+                }
+                slot = bootloader_node_slot(pBuffer[4], slots);
+                while((uint32_t)(BL_CYCLES_NOW() - bl_node.rx_cycles) < slot * slot_len * byte_cycles)
+                {
+                    /*answers in the slots before are of no interest, they must not fill the ring*/
+                    bl_rx_tail = bl_rx_head;
+                }
+                bl_node.enum_slot = slot + 1;
+                bl_node.enum_seed = pBuffer[4];
+                bl_node.unicast = 1;
+                bootloader_send_reply((uint8_t *)UID_BASE, 12);
+                break;
+            }
+            case BL_NODE_STATUS:
+            {
+                bl_node_status_t status;
+
+                status.address = bl_node.address;
+                status.session_active = bl_session.active;
+                status.session_status = bl_session.status;
+                status.erased_mask = bl_session.erased_mask;
+                status.slots_queued = bl_session.slot_count;
+                status.crc_failures = bl_stats.crc_failures;
+                status.uid[0] = *((uint32_t *) (UID_BASE) );
+                status.uid[1] = *((uint32_t *) (UID_BASE + 4) );
+                status.uid[2] = *((uint32_t *) (UID_BASE + 8) );
+                bootloader_send_reply((uint8_t *)&status, sizeof(status));
+                break;
+            }
+            case BL_NODE_DIGEST:
+            {
+                uint32_t base = *((uint32_t *) (&pBuffer[3]) );
+                uint32_t block_len = *((uint16_t *) (&pBuffer[7]) );
+                uint32_t count = pBuffer[9];
+                uint32_t length = block_len * count;
+
+                if(!bl_node.unicast)
+                {
+                    break;
+                }
+                /*whole words inside the flash, as BL_GET_CID*/
+                if(!count || (count > BL_NODE_DIGESTS_MAX) || !block_len || (base & 3) || (block_len & 3) ||
+                   (base < FLASH_BASE) || (length > FLASH_SIZE) || ((base - FLASH_BASE) > (FLASH_SIZE - length)))
+                {
+                    reply[0] = ADDR_INVALID;
+                    bootloader_reply_send(1);
+                    break;
+                }
+                reply[0] = HAL_OK;
+                for(uint32_t i = 0 ; i < count ; i++)
+                {
+                    uint32_t digest = bootloader_flash_digest(base + i * block_len, block_len);
+                    /*the reply buffer is only byte aligned*/
+                    memcpy(&reply[1 + 4 * i], &digest, 4);
+                }
+                bootloader_reply_send(1 + 4 * count);
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+	}else
+	{
+        printmsg("BL_DEBUG_MSG:checksum fail !!\n");
+        bootloader_send_nack();
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_handle_session_write_cmd
+*   Description   :BL_MEM_WRITE inside an open session. The payload is queued and acknowledged
+*                  at once, bootloader_session_pump programs it when its sector is erased.
+*                  Runs from SRAM, the reported status is the sticky session status
+*   Parameters    : p_args - *pBuffer
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_handle_session_write_cmd(uint8_t *pBuffer)
+{
+	uint8_t payload_len = pBuffer[6];
+	uint32_t mem_address = *((uint32_t *) ( &pBuffer[2]) );
+	uint32_t command_packet_len = pBuffer[0]+1 ;
+	uint32_t host_crc = *((uint32_t * ) (pBuffer+command_packet_len - 4) ) ;
+	if (! bootloader_verify_crc(&pBuffer[0],command_packet_len-4,host_crc))
+	{
+		bootloader_session_queue(mem_address, &pBuffer[7], payload_len);
+        bootloader_reply_session_status(bl_session.status, bootloader_session_credit(BL_RX_LEN, BL_RX_LEN));
+        if(bl_session.status == BL_SESSION_RESTART)
+        {
+            bl_session.status = HAL_OK;
+        }
+	}else
+	{
+        bootloader_send_nack();
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_send_ack
+*   Description   :This function sends ACK if CRC matches along with "len to follow". Only for
+*                  replies that can not be framed in one go (BL_BENCH), the rest use bootloader_send_reply
+*   Parameters    : p_args - int8_t command_code,uint8_t follow_len
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_send_ack(uint8_t command_code, uint8_t follow_len)
+{
+	uint8_t ack_buf[2];
+	ack_buf[0] = BL_ACK;
+	ack_buf[1] = follow_len;
+	bootloader_uart_write_data(ack_buf,2);
 
-    //We have to unlock flash module to get control of registers
-    HAL_FLASH_Unlock();
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_send_nack
+*   Description   :This function sends NACK "
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_send_nack(void)
+{
+	uint8_t nack = BL_NACK;
+	bl_stats.nacks_sent++;
+	bootloader_uart_write_data(&nack,1);
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_reply_buffer
+*   Description   :Payload area of the reply frame that is not being sent, fill it and pass
+*                  the payload length to bootloader_reply_send
+*   Parameters    : p_args -NULL
+*   Return Value  : uint8_t * - room for 255 payload bytes
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t *bootloader_reply_buffer(void)
+{
+	return &bl_tx_frame[bl_tx_index][2];
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_reply_send
+*   Description   :Frames the payload in bootloader_reply_buffer as [BL_REPLY][len][payload][crc32]
+*                  and hands it to DMA. Returns as soon as the previous reply has left the DMA,
+*                  the caller goes on while this one is sent. The CRC unit is reset first and
+*                  left reset, whatever the caller did with it
+*   Parameters    : p_args -uint32_t len
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_reply_send(uint32_t len)
+{
+	uint8_t *frame = bl_tx_frame[bl_tx_index];
+	uint32_t crc_start = BL_CYCLES_NOW();
+	uint32_t crc;
 
-    for(uint32_t i = 0 ; i <len ; i++)
+	if(bl_node.bus && !bl_node.unicast)
+	{
+		/*addressed together with other nodes, only one may drive the line*/
+		return;
+	}
+	frame[0] = BL_REPLY;
+	frame[1] = (uint8_t)len;
+	hcrc.Instance->CR = CRC_CR_RESET;
+	for(uint32_t i = 0 ; i < len + 2 ; i++)
+	{
+		hcrc.Instance->DR = frame[i];
+	}
+	crc = hcrc.Instance->DR;
+	hcrc.Instance->CR = CRC_CR_RESET;
+	bl_stats.cycles_crc += (uint32_t)(BL_CYCLES_NOW() - crc_start);
+	frame[len + 2] = (uint8_t)crc;
+	frame[len + 3] = (uint8_t)(crc >> 8);
+	frame[len + 4] = (uint8_t)(crc >> 16);
+	frame[len + 5] = (uint8_t)(crc >> 24);
+
+	while(BL_TX_DMA->CR & DMA_SxCR_EN)
+	{
+	}
+	DMA1->HIFCR = BL_TX_DMA_FLAGS;
+	BL_TX_DMA->M0AR = (uint32_t)frame;
+	BL_TX_DMA->NDTR = len + 6;
+	BL_TX_DMA->CR |= DMA_SxCR_EN;
+	bl_tx_index ^= 1;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_send_reply
+*   Description   :Sends len bytes of pPayload as one framed reply
+*   Parameters    : p_args -uint8_t *pPayload, uint32_t len
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_send_reply(uint8_t *pPayload, uint32_t len)
+{
+	uint8_t *reply = bootloader_reply_buffer();
+
+	for(uint32_t i = 0 ; i < len ; i++)
+	{
+		reply[i] = pPayload[i];
+	}
+	bootloader_reply_send(len);
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_reply_flush
+*   Description   :Waits until the last reply has completely left the UART
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_reply_flush(void)
+{
+	while(BL_TX_DMA->CR & DMA_SxCR_EN)
+	{
+	}
+	while(!(huart2.Instance->SR & USART_SR_TC))
+	{
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_reply_session_status
+*   Description   :Replies with a session status, followed by the resend address for
+*                  BL_SESSION_RESTART or else by the receive credit when it is not 0
+*   Parameters    : p_args -uint8_t status, uint32_t credit
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_reply_session_status(uint8_t status, uint32_t credit)
+{
+	uint8_t *reply = bootloader_reply_buffer();
+
+	reply[0] = status;
+	if(status == BL_SESSION_RESTART)
+	{
+		reply[1] = (uint8_t)bl_session.restart_address;
+		reply[2] = (uint8_t)(bl_session.restart_address >> 8);
+		reply[3] = (uint8_t)(bl_session.restart_address >> 16);
+		reply[4] = (uint8_t)(bl_session.restart_address >> 24);
+		bootloader_reply_send(5);
+	}else if(credit)
+	{
+		reply[1] = (uint8_t)credit;
+		reply[2] = (uint8_t)(credit >> 8);
+		bootloader_reply_send(3);
+	}else
+	{
+		bootloader_reply_send(1);
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_reply_stream
+*   Description   :BL_STREAM checkpoint reply: status, the offset the host continues from and
+*                  the blocks it may send beyond it
+*   Parameters    : p_args -uint8_t status, uint32_t offset, uint32_t credit
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_reply_stream(uint8_t status, uint32_t offset, uint32_t credit)
+{
+	uint8_t *reply = bootloader_reply_buffer();
+
+	reply[0] = status;
+	reply[1] = (uint8_t)offset;
+	reply[2] = (uint8_t)(offset >> 8);
+	reply[3] = (uint8_t)(offset >> 16);
+	reply[4] = (uint8_t)(offset >> 24);
+	reply[5] = (uint8_t)credit;
+	reply[6] = (uint8_t)(credit >> 8);
+	bootloader_reply_send(7);
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_verify_crc
+*   Description   :This verifies the CRC of the given buffer in pData. Same result as
+*                  HAL_CRC_Accumulate fed one byte per word, done on the registers to run from SRAM
+*   Parameters    : p_args -uint8_t *pData,uint32_t crc_host
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_verify_crc (uint8_t *pData, uint32_t len, uint32_t crc_host)
+{
+    uint32_t uwCRCValue=0xff;
+    uint32_t crc_start = BL_CYCLES_NOW();
+
+    for (uint32_t i=0 ; i < len ; i++)
+	{
+        hcrc.Instance->DR = pData[i];
+	}
+    if(len)
     {
-        //Here we program the flash byte by byte
-        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,mem_address+i,pBuffer[i] );
+        uwCRCValue = hcrc.Instance->DR;
     }
 
-    HAL_FLASH_Lock();
+	 /* Reset CRC Calculation Unit */
+    hcrc.Instance->CR = CRC_CR_RESET;
+    bl_stats.cycles_crc += (uint32_t)(BL_CYCLES_NOW() - crc_start);
 
-    return status;
-}*/
+	if( uwCRCValue == crc_host)
+	{
+		return VERIFY_CRC_SUCCESS;
+	}
+
+    bl_stats.crc_failures++;
+	return VERIFY_CRC_FAIL;
+}
 /* -----------------------------------------------------------------------------
 *  FUNCTION DESCRIPTION
 *  -----------------------------------------------------------------------------
-*   Function Name : printmsg
-*   Description   :prints formatted string to console over UART
-*   Parameters    : p_args -char *format,...
+*   Function Name : bootloader_flash_digest
+*   Description   : CRC of len bytes of flash from base, written to the CRC unit one word at a
+*                   time. The unit is left reset for bootloader_verify_crc. Runs from SRAM for
+*                   the session journal, the flash must not be busy
+*   Parameters    : p_args - uint32_t base, uint32_t len (both word aligned)
+*   Return Value  : uint32_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint32_t bootloader_flash_digest(uint32_t base, uint32_t len)
+{
+    uint32_t digest;
+    uint32_t crc_start = BL_CYCLES_NOW();
+
+    hcrc.Instance->CR = CRC_CR_RESET;
+    for (uint32_t offset = 0 ; offset < len ; offset += 4)
+	{
+        hcrc.Instance->DR = *((volatile uint32_t *) (base + offset) );
+	}
+    digest = hcrc.Instance->DR;
+    hcrc.Instance->CR = CRC_CR_RESET;
+    bl_stats.cycles_crc += (uint32_t)(BL_CYCLES_NOW() - crc_start);
+    return digest;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_uart_write_data
+*   Description   :This function writes data in to C_UART
+*   Parameters    : p_args -uint8_t *pBuffer,uint32_t len
 *   Return Value  : NULL
 *  ---------------------------------------------------------------------------*/
-/*  */
- void printmsg(char *format,...)
- {
+/* This function writes data in to C_UART, polled on the registers so it can run from SRAM */
+__RAM_FUNC void bootloader_uart_write_data(uint8_t *pBuffer,uint32_t len)
+{
+	USART_TypeDef *uart = huart2.Instance;
 
-	char str[80];
-	va_list args;
-	va_start(args, format);
-	vsprintf(str, format,args);
-	HAL_UART_Transmit(D_UART,(uint8_t *)str, strlen(str),HAL_MAX_DELAY);
-	va_end(args);
- }
+	if(bl_node.bus && !bl_node.unicast)
+	{
+		return;
+	}
+	/*Never interleave with a reply still going out by DMA*/
+	while(BL_TX_DMA->CR & DMA_SxCR_EN)
+	{
+	}
+	for(uint32_t i = 0 ; i < len ; i++)
+	{
+		while(!(uart->SR & USART_SR_TXE))
+		{
+		}
+		uart->DR = pBuffer[i];
+	}
+	while(!(uart->SR & USART_SR_TC))
+	{
+	}
+}
+
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : get_bootloader_version
+*   Description   :return value of MACRO
+*   Parameters    : p_args -NULL
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+uint8_t get_bootloader_version(void)
+{
+  return (uint8_t)BL_VERSION;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : verify_address
+*   Description   :verify the address sent by the host .
+*   Parameters    : p_args -uint32_t go_address
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+uint8_t verify_address(uint32_t go_address)
+{
+	if ( go_address >= SRAM1_BASE && go_address <= SRAM1_END)
+	{
+		return ADDR_VALID;
+	}
+	else if ( go_address >= SRAM2_BASE && go_address <= SRAM2_END)
+	{
+		return ADDR_VALID;
+	}
+	else if ( go_address >= FLASH_BASE && go_address <= FLASH_END)
+	{
+		return ADDR_VALID;
+	}
+	else if ( go_address >= BKPSRAM_BASE && go_address <= BKPSRAM_END)
+	{
+		return ADDR_VALID;
+	}
+	else
+		return ADDR_INVALID;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_mem_class
+*   Description   : Classifies the whole range [mem_address, mem_address + len) as flash, SRAM
+*                   or BKPSRAM. The bootloader sectors and the SRAM holding the bootloader data,
+*                   heap or stack are BL_MEM_INVALID, except the work buffer while no write
+*                   session uses it
+*   Parameters    : p_args -uint32_t mem_address, uint32_t len
+*   Return Value  : uint8_t - BL_MEM_*
+*  ---------------------------------------------------------------------------*/
+uint8_t bootloader_mem_class(uint32_t mem_address, uint32_t len)
+{
+	uint32_t end = mem_address + len;
 
+	if((len == 0) || (end < mem_address))
+	{
+		return BL_MEM_INVALID;
+	}
+	/*Sectors 0 and 1 hold the bootloader, sessions and BL_COMMIT refuse them as well*/
+	if((mem_address >= FLASH_SECTOR2_BASE_ADDRESS) && (end <= (FLASH_BASE + FLASH_SIZE)))
+	{
+		return BL_MEM_FLASH;
+	}
+	/*The work buffer is bootloader data but open to the host as staging area while no session uses it*/
+	if(!bl_session.active && (mem_address >= (uint32_t)bl_work_buffer) &&
+	   (end <= ((uint32_t)bl_work_buffer + sizeof(bl_work_buffer))))
+	{
+		return BL_MEM_SRAM;
+	}
+	if((mem_address >= SRAM1_BASE) && (end <= SRAM2_END))
+	{
+		uint32_t used_start = (uint32_t)&_sdata;
+		uint32_t used_end = (uint32_t)&_end + (uint32_t)&_Min_Heap_Size;
+		uint32_t stack_start = (uint32_t)&_estack - (uint32_t)&_Min_Stack_Size;
+
+		if(((mem_address < used_end) && (end > used_start)) || (end > stack_start))
+		{
+			return BL_MEM_INVALID;
+		}
+		return BL_MEM_SRAM;
+	}
+	/*the top of the backup SRAM holds the BL_STREAM journal*/
+	if((mem_address >= BKPSRAM_BASE) && (end <= BL_JOURNAL_ADDR))
+	{
+		return BL_MEM_BKPSRAM;
+	}
+	return BL_MEM_INVALID;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_bkpsram_enable
+*   Description   : Clocks the backup SRAM and opens the backup domain for writes
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static void bootloader_bkpsram_enable(void)
+{
+	__HAL_RCC_PWR_CLK_ENABLE();
+	HAL_PWR_EnableBkUpAccess();
+	__HAL_RCC_BKPSRAM_CLK_ENABLE();
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : execute_flash_erase
+*   Description   :Erase the Entire Flash or sectors
+*   Parameters    : p_args -uint8_t sector_number,uint8_t number_of_sector
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+uint8_t execute_flash_erase(uint8_t sector_number , uint8_t number_of_sector)
+{
+	uint8_t status = HAL_OK;
+
+
+	if( number_of_sector > FLASH_SECTOR_TOTAL )
+		return INVALID_SECTOR;
+
+	if( (sector_number == 0xff ) || (sector_number < FLASH_SECTOR_TOTAL) )
+	{
+		uint32_t erase_start = BL_CYCLES_NOW();
+		if(sector_number == (uint8_t) 0xff)
+		{
+			status = bootloader_flash_mass_erase();
+			bl_stats.sector_erases += FLASH_SECTOR_TOTAL;
+		}else
+		{
+		    /*Here we are just calculating how many sectors needs to erased */
+			uint8_t remanining_sector = FLASH_SECTOR_TOTAL - sector_number;
+            if( number_of_sector > remanining_sector)
+            {
+            	number_of_sector = remanining_sector;
+            }
+            for(uint8_t i = 0 ; (i < number_of_sector) && (status == HAL_OK) ; i++)
+            {
+            	status = bootloader_flash_erase_sector(sector_number + i);
+            	bl_stats.sector_erases++;
+            }
+		}
+		bl_stats.cycles_flash_erase += (uint32_t)(BL_CYCLES_NOW() - erase_start);
+
+		return status;
+	}
+
+
+	return INVALID_SECTOR;
+}
+
+ /* -----------------------------------------------------------------------------
+ *  FUNCTION DESCRIPTION
+ *  -----------------------------------------------------------------------------
+ *   Function Name : execute_mem_write
+ *   Description   :This function writes the contents of pBuffer to  "mem_address". Flash goes through
+ *                  the SRAM flash engine, SRAM and BKPSRAM targets are plain copies at bus speed
+ *   Parameters    : p_args -uint8_t *pBuffer,uint32_t mem_address, uint32_t len
+ *   Return Value  : uint8_t
+ *  ---------------------------------------------------------------------------*/
+uint8_t execute_mem_write(uint8_t *pBuffer, uint32_t mem_address, uint32_t len)
+{
+    uint8_t status = HAL_OK;
+    uint32_t write_start = BL_CYCLES_NOW();
+
+    switch(bootloader_mem_class(mem_address, len))
+    {
+        case BL_MEM_FLASH:
+        {
+            status = bootloader_flash_program(mem_address, pBuffer, len);
+            if (status == HAL_OK)
+            {
+                bl_stats.bytes_programmed += len;
+            }
+            bl_stats.cycles_flash_program += (uint32_t)(BL_CYCLES_NOW() - write_start);
+            break;
+        }
+        case BL_MEM_BKPSRAM:
+        {
+            bootloader_bkpsram_enable();
+        }
+        /* fall through */
+        case BL_MEM_SRAM:
+        {
+            memcpy((void *)mem_address, pBuffer, len);
+            bl_stats.bytes_copied += len;
+            bl_stats.cycles_ram_copy += (uint32_t)(BL_CYCLES_NOW() - write_start);
+            break;
+        }
+        default:
+        {
+            printmsg("BL_DEBUG_MSG: mem write range not writable\n");
+            status = BL_INVALID_ADDRESS;
+            break;
+        }
+    }
+
+    return status;
+}
+ /* -----------------------------------------------------------------------------
+ *  FUNCTION DESCRIPTION
+ *  -----------------------------------------------------------------------------
+ *   Function Name : execute_commit
+ *   Description   :Programs len bytes staged at the start of the work buffer to mem_address. The
+ *                  staged data is checked against crc first. A sector is erased only when its
+ *                  part of the slice can not be programmed over the current content, so slices
+ *                  sharing a sector can be committed one after the other. When that erase would
+ *                  wipe data an earlier commit programmed into the sector, the sector is erased
+ *                  but nothing is programmed and the reply is BL_SESSION_RESTART with the sector
+ *                  base in crc, the host resends its image from there
+ *   Parameters    : p_args -uint32_t mem_address, uint32_t len, uint32_t crc, bl_commit_result_t *result
+ *   Return Value  : NULL
+ *  ---------------------------------------------------------------------------*/
+void execute_commit(uint32_t mem_address, uint32_t len, uint32_t crc, bl_commit_result_t *result)
+{
+    uint32_t commit_start = BL_CYCLES_NOW();
+    uint8_t *staging = (uint8_t *)bl_work_buffer;
+    uint8_t first_sector = bootloader_flash_get_sector(mem_address);
+    uint8_t last_sector = bootloader_flash_get_sector(mem_address + len - 1);
+    uint8_t erase_mask = 0;
+
+    memset(result, 0, sizeof(*result));
+    if(bl_session.active || (len == 0) || (len > sizeof(bl_work_buffer)) || (len & 3) ||
+       (mem_address < FLASH_SECTOR2_BASE_ADDRESS) ||
+       (first_sector == BL_SECTOR_NONE) || (last_sector == BL_SECTOR_NONE))
+    {
+        result->status = INVALID_SECTOR;
+        return;
+    }
+    if(bootloader_flash_digest((uint32_t)staging, len) != crc)
+    {
+        result->status = BL_COMMIT_BAD_CRC;
+        return;
+    }
+
+    /*Find the sectors to erase before programming anything, a sector holding earlier commits
+     *is erased on its own and the host resends from its base*/
+    for(uint8_t sector = first_sector ; sector <= last_sector ; sector++)
+    {
+        uint32_t start = (bl_flash_sector_base[sector] > mem_address) ? bl_flash_sector_base[sector] : mem_address;
+        uint32_t end = (bl_flash_sector_base[sector + 1] < (mem_address + len)) ? bl_flash_sector_base[sector + 1] : (mem_address + len);
+
+        if(bootloader_flash_compare(start, staging + (start - mem_address), end - start) != BL_FLASH_NEEDS_ERASE)
+        {
+            continue;
+        }
+        if(bl_commit_programmed_mask & (1U << sector))
+        {
+            uint32_t erase_start = BL_CYCLES_NOW();
+            result->status = bootloader_flash_erase_sector(sector);
+            result->sectors_erased++;
+            bl_stats.sector_erases++;
+            bl_stats.cycles_flash_erase += (uint32_t)(BL_CYCLES_NOW() - erase_start);
+            bl_commit_programmed_mask &= ~(1U << sector);
+            if(result->status == HAL_OK)
+            {
+                result->status = BL_SESSION_RESTART;
+                result->crc = bl_flash_sector_base[sector];
+            }
+            result->cycles = BL_CYCLES_NOW() - commit_start;
+            return;
+        }
+        erase_mask |= (1U << sector);
+    }
+
+    result->status = HAL_OK;
+    for(uint8_t sector = first_sector ; (sector <= last_sector) && (result->status == HAL_OK) ; sector++)
+    {
+        uint32_t start = (bl_flash_sector_base[sector] > mem_address) ? bl_flash_sector_base[sector] : mem_address;
+        uint32_t end = (bl_flash_sector_base[sector + 1] < (mem_address + len)) ? bl_flash_sector_base[sector + 1] : (mem_address + len);
+        uint8_t *src = staging + (start - mem_address);
+
+        if(erase_mask & (1U << sector))
+        {
+            uint32_t erase_start = BL_CYCLES_NOW();
+            result->status = bootloader_flash_erase_sector(sector);
+            result->sectors_erased++;
+            bl_stats.sector_erases++;
+            bl_stats.cycles_flash_erase += (uint32_t)(BL_CYCLES_NOW() - erase_start);
+        }
+        if(result->status == HAL_OK)
+        {
+            uint32_t program_start = BL_CYCLES_NOW();
+            result->status = bootloader_flash_program(start, src, end - start);
+            bl_stats.cycles_flash_program += (uint32_t)(BL_CYCLES_NOW() - program_start);
+            bl_commit_programmed_mask |= (1U << sector);
+        }
+    }
+    if(result->status == HAL_OK)
+    {
+        bl_stats.bytes_programmed += len;
+        result->crc = bootloader_flash_digest(mem_address, len);
+    }
+    result->cycles = BL_CYCLES_NOW() - commit_start;
+}
+ /* -----------------------------------------------------------------------------
+ *  FUNCTION DESCRIPTION
+ *  -----------------------------------------------------------------------------
+ *   Function Name : execute_stub
+ *   Description   :Checks the bl_stub_header_t at stub_base and calls the stub entry with the
+ *                  service table and params. The whole image must be writable SRAM, which
+ *                  keeps stubs out of the flash and out of the bootloader's own data
+ *   Parameters    : p_args -uint32_t stub_base, bl_stub_params_t *params, bl_stub_result_t *result
+ *   Return Value  : NULL
+ *  ---------------------------------------------------------------------------*/
+void execute_stub(uint32_t stub_base, bl_stub_params_t *params, bl_stub_result_t *result)
+{
+    bl_stub_header_t *header = (bl_stub_header_t *)stub_base;
+    bl_stub_entry_t stub_entry;
+    uint32_t entry_offset;
+    uint32_t stub_start;
+
+    memset(result, 0, sizeof(*result));
+    memset(params->result, 0, sizeof(params->result));
+    if((stub_base & 3U) || (bootloader_mem_class(stub_base, sizeof(*header)) != BL_MEM_SRAM))
+    {
+        result->status = BL_STUB_BAD_ADDRESS;
+        return;
+    }
+    entry_offset = header->entry & ~1U;
+    if((header->magic != BL_STUB_MAGIC) || (header->abi_version != BL_STUB_ABI_VERSION) ||
+       (header->image_len < sizeof(*header)) || (entry_offset < sizeof(*header)) ||
+       (entry_offset >= header->image_len))
+    {
+        result->status = BL_STUB_BAD_HEADER;
+        return;
+    }
+    if(bootloader_mem_class(stub_base, header->image_len) != BL_MEM_SRAM)
+    {
+        result->status = BL_STUB_BAD_ADDRESS;
+        return;
+    }
+
+    bl_stub_api.sysclk_hz = SystemCoreClock;
+    stub_entry = (bl_stub_entry_t)((stub_base + entry_offset) | 1U);
+    /*The image arrived as data writes, make sure they completed before fetching it as code*/
+    __DSB();
+    __ISB();
+    stub_start = BL_CYCLES_NOW();
+    result->stub_status = stub_entry(&bl_stub_api, params);
+    result->cycles = BL_CYCLES_NOW() - stub_start;
+    result->status = BL_STUB_OK;
+    memcpy(result->result, params->result, sizeof(result->result));
+}
+ /* -----------------------------------------------------------------------------
+ *  FUNCTION DESCRIPTION
+ *  -----------------------------------------------------------------------------
+ *   Function Name : bootloader_stub_erase_sector
+ *   Description   :bl_stub_api flash_erase_sector, refuses the bootloader sectors 0 and 1 and
+ *                  sector numbers past the flash before anything reaches FLASH->CR
+ *   Parameters    : p_args -uint32_t sector
+ *   Return Value  : uint8_t
+ *  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint8_t bootloader_stub_erase_sector(uint32_t sector)
+{
+    if((sector >= FLASH_SECTOR_TOTAL) || (bl_flash_sector_base[sector] < FLASH_SECTOR2_BASE_ADDRESS))
+    {
+        return INVALID_SECTOR;
+    }
+    return bootloader_flash_erase_sector(sector);
+}
+ /* -----------------------------------------------------------------------------
+ *  FUNCTION DESCRIPTION
+ *  -----------------------------------------------------------------------------
+ *   Function Name : bootloader_stub_program
+ *   Description   :bl_stub_api flash_program, the range must lie in the flash above the
+ *                  bootloader sectors
+ *   Parameters    : p_args -uint32_t mem_address, uint8_t *pBuffer, uint32_t len
+ *   Return Value  : uint8_t
+ *  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint8_t bootloader_stub_program(uint32_t mem_address, uint8_t *pBuffer, uint32_t len)
+{
+    if((mem_address < FLASH_SECTOR2_BASE_ADDRESS) || (mem_address > (FLASH_BASE + FLASH_SIZE)) ||
+       (len > ((FLASH_BASE + FLASH_SIZE) - mem_address)))
+    {
+        return INVALID_SECTOR;
+    }
+    return bootloader_flash_program(mem_address, pBuffer, len);
+}
+ /* -----------------------------------------------------------------------------
+ *  FUNCTION DESCRIPTION
+ *  -----------------------------------------------------------------------------
+ *   Function Name : execute_bench
+ *   Description   :Runs the BL_BENCH measurements with the DWT cycle counter. The SRAM tests
+ *                  use the work buffer, the flash tests erase and program scratch_sector and
+ *                  leave it erased. Sectors below FLASH_SECTOR2_BASE_ADDRESS hold the
+ *                  bootloader and are never used. Does not touch bl_stats
+ *   Parameters    : p_args -uint8_t scratch_sector, bl_bench_t *bench
+ *   Return Value  : NULL
+ *  ---------------------------------------------------------------------------*/
+void execute_bench(uint8_t scratch_sector, bl_bench_t *bench)
+{
+    uint8_t *src = (uint8_t *)bl_work_buffer;
+    uint8_t *dst = src + (BL_WORK_BUFFER_LEN / 2);
+    uint32_t *words = bl_work_buffer;
+    bl_stats_t saved_stats = bl_stats;
+    uint32_t start;
+
+    memset(bench, 0, sizeof(*bench));
+    bench->sysclk_hz = SystemCoreClock;
+    bench->scratch_sector = scratch_sector;
+    bench->program_len = BL_BENCH_PROGRAM_LEN;
+    bench->byte_len = BL_BENCH_BYTE_LEN;
+    bench->crc_len = BL_BENCH_CRC_LEN;
+    bench->copy_len = BL_BENCH_COPY_LEN;
+    if(bl_session.active)
+    {
+        /*The work buffer holds the session queue*/
+        bench->status = HAL_BUSY;
+        return;
+    }
+
+    /*Counting pattern, no word of it is 0xFFFFFFFF so no program operation is skipped*/
+    for(uint32_t i = 0 ; i < BL_BENCH_COPY_LEN ; i++)
+    {
+        src[i] = (uint8_t)i;
+    }
+
+    start = BL_CYCLES_NOW();
+    memcpy(dst, src, BL_BENCH_COPY_LEN);
+    bench->memcpy_cycles = BL_CYCLES_NOW() - start;
+
+    hcrc.Instance->CR = CRC_CR_RESET;
+    start = BL_CYCLES_NOW();
+    for(uint32_t i = 0 ; i < BL_BENCH_CRC_LEN ; i++)
+    {
+        hcrc.Instance->DR = src[i];
+    }
+    (void)hcrc.Instance->DR;
+    bench->crc_byte_cycles = BL_CYCLES_NOW() - start;
+    hcrc.Instance->CR = CRC_CR_RESET;
+    start = BL_CYCLES_NOW();
+    for(uint32_t i = 0 ; i < BL_BENCH_CRC_LEN / 4 ; i++)
+    {
+        hcrc.Instance->DR = words[i];
+    }
+    (void)hcrc.Instance->DR;
+    bench->crc_word_cycles = BL_CYCLES_NOW() - start;
+    hcrc.Instance->CR = CRC_CR_RESET;
+
+    if((scratch_sector < FLASH_SECTOR_TOTAL) &&
+       (bl_flash_sector_base[scratch_sector] >= FLASH_SECTOR2_BASE_ADDRESS))
+    {
+        uint32_t base = bl_flash_sector_base[scratch_sector];
+
+        start = BL_CYCLES_NOW();
+        bench->status = bootloader_flash_erase_sector(scratch_sector);
+        bench->erase_cycles = BL_CYCLES_NOW() - start;
+        if(bench->status == HAL_OK)
+        {
+            start = BL_CYCLES_NOW();
+            bench->status = bootloader_flash_program(base, src, BL_BENCH_PROGRAM_LEN);
+            bench->program_word_cycles = BL_CYCLES_NOW() - start;
+        }
+        if(bench->status == HAL_OK)
+        {
+            start = BL_CYCLES_NOW();
+            for(uint32_t i = 0 ; (i < BL_BENCH_BYTE_LEN) && (bench->status == HAL_OK) ; i++)
+            {
+                bench->status = bootloader_flash_program(base + BL_BENCH_PROGRAM_LEN + i, &src[i], 1);
+            }
+            bench->program_byte_cycles = BL_CYCLES_NOW() - start;
+        }
+        if(bench->status == HAL_OK)
+        {
+            bench->status = bootloader_flash_erase_sector(scratch_sector);
+        }
+    }
+    /*The flash engine counts its own work, the benchmark must not show up in the session profile*/
+    bl_stats = saved_stats;
+}
+/*
+uint8_t execute_mem_write(uint8_t *pBuffer, uint32_t mem_address, uint32_t len)
+{
+    uint8_t status=HAL_OK;
+
+    //We have to unlock flash module to get control of registers
+    HAL_FLASH_Unlock();
+
+    for(uint32_t i = 0 ; i <len ; i++)
+    {
+        //Here we program the flash byte by byte
+        status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,mem_address+i,pBuffer[i] );
+    }
+
+    HAL_FLASH_Lock();
+
+    return status;
+}*/
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : printmsg
+*   Description   :prints formatted string to console over UART
+*   Parameters    : p_args -char *format,...
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+/*  */
+ void printmsg(char *format,...)
+ {
+
+	char str[80];
+	uint32_t log_start = BL_CYCLES_NOW();
+	va_list args;
+	va_start(args, format);
+	/*Longer messages are cut, not written past str*/
+	vsnprintf(str, sizeof(str), format,args);
+	HAL_UART_Transmit(D_UART,(uint8_t *)str, strlen(str),HAL_MAX_DELAY);
+	va_end(args);
+	bl_stats.cycles_log += (uint32_t)(BL_CYCLES_NOW() - log_start);
+ }
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_stats_init
+*   Description   :enables the DWT cycle counter used for the performance counters and clears them
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_stats_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	bootloader_stats_clear();
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_stats_clear
+*   Description   :resets all performance counters and restarts the session timer
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_stats_clear(void)
+{
+	memset(&bl_stats,0,sizeof(bl_stats));
+	bl_stats_start_tick = HAL_GetTick();
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_uart_init
+*   Description   :moves the vector table to SRAM and switches C_UART reception to the
+*                  RXNE interrupt feeding bl_rx_ring
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_uart_init(void)
+{
+	bl_flash_vector_table = SCB->VTOR;
+	memcpy(bl_ram_vector_table, (void *)bl_flash_vector_table, sizeof(bl_ram_vector_table));
+	__disable_irq();
+	SCB->VTOR = (uint32_t)bl_ram_vector_table;
+	__DSB();
+	__enable_irq();
+
+	bl_rx_head = 0;
+	bl_rx_tail = 0;
+	__HAL_UART_ENABLE_IT(C_UART, UART_IT_RXNE);
+
+	/*Replies go out through DMA, byte transfers from memory to USART2->DR on TXE*/
+	__HAL_RCC_DMA1_CLK_ENABLE();
+	BL_TX_DMA->CR = 0;
+	while(BL_TX_DMA->CR & DMA_SxCR_EN)
+	{
+	}
+	DMA1->HIFCR = BL_TX_DMA_FLAGS;
+	BL_TX_DMA->PAR = (uint32_t)&huart2.Instance->DR;
+	BL_TX_DMA->CR = (4U << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL_1 | DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+	huart2.Instance->CR3 |= USART_CR3_DMAT;
+	HAL_NVIC_SetPriority(USART2_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(USART2_IRQn);
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_uart_deinit
+*   Description   :undoes bootloader_uart_init before control is handed to other code
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_uart_deinit(void)
+{
+	bootloader_reply_flush();
+	huart2.Instance->CR3 &= ~USART_CR3_DMAT;
+	BL_TX_DMA->CR = 0;
+	HAL_NVIC_DisableIRQ(USART2_IRQn);
+	__HAL_UART_DISABLE_IT(C_UART, UART_IT_RXNE);
+	if(bl_flash_vector_table)
+	{
+		SCB->VTOR = bl_flash_vector_table;
+		__DSB();
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_uart_rx_isr
+*   Description   :C_UART receive interrupt body. Reading SR then DR clears ORE/FE so every
+*                  error is counted exactly once. A full ring is counted as an overrun
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_uart_rx_isr(void)
+{
+	USART_TypeDef *uart = huart2.Instance;
+	uint32_t sr = uart->SR;
+
+	if(sr & (USART_SR_RXNE | USART_SR_ORE))
+	{
+		uint8_t data = (uint8_t)uart->DR;
+		uint32_t next = (bl_rx_head + 1) & (BL_RX_RING_LEN - 1);
+
+		if(sr & USART_SR_ORE)
+		{
+			bl_stats.uart_overrun_errors++;
+		}
+		if(sr & USART_SR_FE)
+		{
+			bl_stats.uart_framing_errors++;
+		}
+		if(next != bl_rx_tail)
+		{
+			bl_rx_ring[bl_rx_head] = data;
+			bl_rx_head = next;
+		}else
+		{
+			bl_stats.uart_overrun_errors++;
+		}
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_uart_read
+*   Description   :blocking read of len bytes from bl_rx_ring
+*   Parameters    : p_args -uint8_t *pBuffer,uint32_t len
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_uart_read(uint8_t *pBuffer, uint32_t len)
+{
+	for(uint32_t i = 0 ; i < len ; i++)
+	{
+		while(bl_rx_tail == bl_rx_head)
+		{
+			bootloader_session_pump();
+		}
+		pBuffer[i] = bl_rx_ring[bl_rx_tail];
+		bl_rx_tail = (bl_rx_tail + 1) & (BL_RX_RING_LEN - 1);
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_uart_read_timeout
+*   Description   :bootloader_uart_read that gives up once no byte arrived for timeout_ms. Counts
+*                  DWT cycles, SysTick is masked while the flash is busy
+*   Parameters    : p_args -uint8_t *pBuffer, uint32_t len, uint32_t timeout_ms
+*   Return Value  : uint32_t - bytes read
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint32_t bootloader_uart_read_timeout(uint8_t *pBuffer, uint32_t len, uint32_t timeout_ms)
+{
+	uint32_t timeout_cycles = timeout_ms * (SystemCoreClock / 1000U);
+	uint32_t start = BL_CYCLES_NOW();
+	uint32_t i = 0;
+
+	while(i < len)
+	{
+		if(bl_rx_tail != bl_rx_head)
+		{
+			pBuffer[i++] = bl_rx_ring[bl_rx_tail];
+			bl_rx_tail = (bl_rx_tail + 1) & (BL_RX_RING_LEN - 1);
+			start = BL_CYCLES_NOW();
+		}else if((uint32_t)(BL_CYCLES_NOW() - start) >= timeout_cycles)
+		{
+			break;
+		}else
+		{
+			bootloader_session_pump();
+		}
+	}
+	return i;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_begin
+*   Description   :unlocks the flash and masks SysTick, whose handler lives in flash and
+*                  would stall the CPU (and the UART interrupt with it) until the operation ends
+*   Parameters    : p_args -NULL
+*   Return Value  : uint32_t - cycle count at start, to be passed to bootloader_flash_end
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint32_t bootloader_flash_begin(void)
+{
+	SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+	if(FLASH->CR & FLASH_CR_LOCK)
+	{
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+	return BL_CYCLES_NOW();
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_end
+*   Description   :locks the flash, re-enables SysTick and credits the ticks it missed
+*   Parameters    : p_args -uint32_t start_cycles
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_flash_end(uint32_t start_cycles)
+{
+	FLASH->CR |= FLASH_CR_LOCK;
+	uwTick += (BL_CYCLES_NOW() - start_cycles) / (SystemCoreClock / 1000U);
+	SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_wait
+*   Description   :polls BSY from SRAM and converts the error flags to a HAL status
+*   Parameters    : p_args -NULL
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint8_t bootloader_flash_wait(void)
+{
+	uint32_t errors = FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+	                  FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR | FLASH_FLAG_RDERR;
+
+	while(FLASH->SR & FLASH_SR_BSY)
+	{
+	}
+	FLASH->SR = FLASH_FLAG_EOP;
+	if(FLASH->SR & errors)
+	{
+		FLASH->SR = errors;
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_flush_caches
+*   Description   :resets the ART instruction/data caches after an erase (same as FLASH_FlushCaches)
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_flash_flush_caches(void)
+{
+	if(FLASH->ACR & FLASH_ACR_ICEN)
+	{
+		FLASH->ACR &= ~FLASH_ACR_ICEN;
+		FLASH->ACR |= FLASH_ACR_ICRST;
+		FLASH->ACR &= ~FLASH_ACR_ICRST;
+		FLASH->ACR |= FLASH_ACR_ICEN;
+	}
+	if(FLASH->ACR & FLASH_ACR_DCEN)
+	{
+		FLASH->ACR &= ~FLASH_ACR_DCEN;
+		FLASH->ACR |= FLASH_ACR_DCRST;
+		FLASH->ACR &= ~FLASH_ACR_DCRST;
+		FLASH->ACR |= FLASH_ACR_DCEN;
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_erase_sector
+*   Description   :erases one sector (voltage range 3, x32 parallelism) entirely from SRAM
+*   Parameters    : p_args -uint32_t sector
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_erase_sector(uint32_t sector)
+{
+	uint8_t status = bootloader_flash_erase_start(sector);
+
+	if(status == HAL_OK)
+	{
+		do
+		{
+			status = bootloader_flash_erase_poll();
+		}while(status == HAL_BUSY);
+	}
+
+	return status;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_erase_start
+*   Description   :starts a sector erase and returns without waiting for it. Until
+*                  bootloader_flash_erase_poll reports completion only SRAM code may run
+*   Parameters    : p_args -uint32_t sector
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_erase_start(uint32_t sector)
+{
+	uint8_t status;
+
+	bl_flash_erase_start_cycles = bootloader_flash_begin();
+	status = bootloader_flash_wait();
+	if(status == HAL_OK)
+	{
+		FLASH->CR &= ~(FLASH_CR_PSIZE | FLASH_CR_SNB);
+		FLASH->CR |= FLASH_PSIZE_WORD | FLASH_CR_SER | (sector << FLASH_CR_SNB_Pos);
+		FLASH->CR |= FLASH_CR_STRT;
+	}else
+	{
+		bootloader_flash_end(bl_flash_erase_start_cycles);
+	}
+
+	return status;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_erase_poll
+*   Description   :completes an erase started by bootloader_flash_erase_start
+*   Parameters    : p_args -NULL
+*   Return Value  : uint8_t - HAL_BUSY while the erase is still running
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_erase_poll(void)
+{
+	uint8_t status;
+
+	if(FLASH->SR & FLASH_SR_BSY)
+	{
+		return HAL_BUSY;
+	}
+	status = bootloader_flash_wait();
+	FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+	bootloader_flash_flush_caches();
+	bootloader_flash_end(bl_flash_erase_start_cycles);
+
+	return status;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_get_sector
+*   Description   :maps a flash address to its sector number
+*   Parameters    : p_args -uint32_t address
+*   Return Value  : uint8_t - sector number or BL_SECTOR_NONE
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_get_sector(uint32_t address)
+{
+	for(uint8_t sector = 0 ; sector < FLASH_SECTOR_TOTAL ; sector++)
+	{
+		if((address >= bl_flash_sector_base[sector]) && (address < bl_flash_sector_base[sector + 1]))
+		{
+			return sector;
+		}
+	}
+	return BL_SECTOR_NONE;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_mass_erase
+*   Description   :mass erase of bank 1 entirely from SRAM
+*   Parameters    : p_args -NULL
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_mass_erase(void)
+{
+	uint8_t status;
+	uint32_t start = bootloader_flash_begin();
+
+	status = bootloader_flash_wait();
+	if(status == HAL_OK)
+	{
+		FLASH->CR &= ~FLASH_CR_PSIZE;
+		FLASH->CR |= FLASH_CR_MER;
+		FLASH->CR |= FLASH_CR_STRT | (FLASH_VOLTAGE_RANGE_3 << 8U);
+		status = bootloader_flash_wait();
+		FLASH->CR &= ~FLASH_CR_MER;
+	}
+	bootloader_flash_flush_caches();
+	bootloader_flash_end(start);
+
+	return status;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_program
+*   Description   :programs pBuffer to mem_address entirely from SRAM, a word at a time where
+*                  the address is word aligned. Words the flash already holds are skipped,
+*                  which also skips 0xFF data over erased flash
+*   Parameters    : p_args -uint32_t mem_address,uint8_t *pBuffer,uint32_t len
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_program(uint32_t mem_address, uint8_t *pBuffer, uint32_t len)
+{
+	uint8_t status;
+	uint32_t start = bootloader_flash_begin();
+	uint32_t i = 0;
+
+	status = bootloader_flash_wait();
+	while((i < len) && (status == HAL_OK))
+	{
+		uint32_t address = mem_address + i;
+		if(!(address & 3U) && ((len - i) >= 4))
+		{
+			uint32_t word = pBuffer[i] | (pBuffer[i + 1] << 8) | (pBuffer[i + 2] << 16) | ((uint32_t)pBuffer[i + 3] << 24);
+			if(*(__IO uint32_t *)address != word)
+			{
+				FLASH->CR &= ~FLASH_CR_PSIZE;
+				FLASH->CR |= FLASH_PSIZE_WORD | FLASH_CR_PG;
+				*(__IO uint32_t *)address = word;
+				status = bootloader_flash_wait();
+			}else
+			{
+				bl_stats.words_skipped++;
+			}
+			i += 4;
+		}else
+		{
+			if(*(__IO uint8_t *)address != pBuffer[i])
+			{
+				FLASH->CR &= ~FLASH_CR_PSIZE;
+				FLASH->CR |= FLASH_PSIZE_BYTE | FLASH_CR_PG;
+				*(__IO uint8_t *)address = pBuffer[i];
+				status = bootloader_flash_wait();
+			}
+			i++;
+		}
+	}
+	FLASH->CR &= ~FLASH_CR_PG;
+	bootloader_flash_end(start);
+
+	return status;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_flash_compare
+*   Description   :checks whether pBuffer can be programmed over the current flash content
+*                  without an erase, i.e. whether every change is a 1->0 bit transition
+*   Parameters    : p_args -uint32_t mem_address,uint8_t *pBuffer,uint32_t len
+*   Return Value  : uint8_t - BL_FLASH_EQUAL, BL_FLASH_PROGRAMMABLE or BL_FLASH_NEEDS_ERASE
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_flash_compare(uint32_t mem_address, uint8_t *pBuffer, uint32_t len)
+{
+	uint8_t result = BL_FLASH_EQUAL;
+
+	for(uint32_t i = 0 ; i < len ; i++)
+	{
+		uint8_t current = *(__IO uint8_t *)(mem_address + i);
+		if((current & pBuffer[i]) != pBuffer[i])
+		{
+			return BL_FLASH_NEEDS_ERASE;
+		}
+		if(current != pBuffer[i])
+		{
+			result = BL_FLASH_PROGRAMMABLE;
+		}
+	}
+	return result;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_begin
+*   Description   :opens a write session over [base, base+length). The bootloader sectors
+*                  (below FLASH_SECTOR2_BASE_ADDRESS) can not be part of a session
+*   Parameters    : p_args -uint32_t base,uint32_t length,uint8_t flags
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+uint8_t bootloader_session_begin(uint32_t base, uint32_t length, uint8_t flags)
+{
+	uint8_t first_sector = bootloader_flash_get_sector(base);
+	uint8_t last_sector = bootloader_flash_get_sector(base + length - 1);
+
+	if(bl_session.active)
+	{
+		bootloader_session_flush();
+	}
+	if((length == 0) || (base < FLASH_SECTOR2_BASE_ADDRESS) ||
+	   (first_sector == BL_SECTOR_NONE) || (last_sector == BL_SECTOR_NONE))
+	{
+		bl_session.active = 0;
+		return ADDR_INVALID;
+	}
+
+	if(!(flags & BL_SESSION_JOURNAL))
+	{
+		/*other writes are not journaled, a later resume could not trust the journal*/
+		bootloader_journal_clear();
+	}
+	memset(&bl_session, 0, sizeof(bl_session));
+	bl_session.flags = flags;
+	bl_session.status = HAL_OK;
+	bl_session.erase_sector = BL_SECTOR_NONE;
+	bl_session.first_sector = first_sector;
+	bl_session.last_sector = last_sector;
+	bl_session.base = base;
+	bl_session.length = length;
+	bl_session.active = 1;
+
+	return HAL_OK;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_owns
+*   Description   :tells whether a received frame is a BL_MEM_WRITE inside the open session
+*   Parameters    : p_args -uint8_t *pBuffer
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_session_owns(uint8_t *pBuffer)
+{
+	uint32_t mem_address = *((uint32_t *) ( &pBuffer[2]) );
+	uint8_t payload_len = pBuffer[6];
+
+	if(!bl_session.active || (pBuffer[1] != BL_MEM_WRITE))
+	{
+		return 0;
+	}
+	return (mem_address >= bl_session.base) &&
+	       ((mem_address + payload_len) <= (bl_session.base + bl_session.length));
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_queue
+*   Description   : Copies len bytes for mem_address into the session slot queue, pumping the
+*                   session while the queue is full. Stops early once the session failed
+*   Parameters    : p_args - uint32_t mem_address, uint8_t *pData, uint32_t len
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_session_queue(uint32_t mem_address, uint8_t *pData, uint32_t len)
+{
+	bl_session_slot_t *slots = (bl_session_slot_t *)bl_work_buffer;
+
+	for(uint32_t offset = 0 ; (offset < len) && (bl_session.status == HAL_OK) ; offset += BL_SESSION_SLOT_LEN)
+	{
+		while(bl_session.slot_count == BL_SESSION_SLOTS)
+		{
+			bootloader_session_pump();
+		}
+		bl_session_slot_t *slot = &slots[bl_session.slot_head];
+		slot->address = mem_address + offset;
+		slot->len = ((len - offset) > BL_SESSION_SLOT_LEN) ? BL_SESSION_SLOT_LEN : (len - offset);
+		for(uint32_t i = 0 ; i < slot->len ; i++)
+		{
+			slot->data[i] = pData[offset + i];
+		}
+		bl_session.slot_head = (bl_session.slot_head + 1 == BL_SESSION_SLOTS) ? 0 : bl_session.slot_head + 1;
+		bl_session.slot_count++;
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_credit
+*   Description   : Receive credit for the host: units of up to unit_len data bytes (wire_len
+*                   bytes on the line) it may send beyond the one just answered. The units that
+*                   fit in the free slots go straight to the queue, one more waits in the receive
+*                   buffer while the queue is full and the ring holds the rest
+*   Parameters    : p_args - uint32_t unit_len, uint32_t wire_len
+*   Return Value  : uint32_t
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint32_t bootloader_session_credit(uint32_t unit_len, uint32_t wire_len)
+{
+	uint32_t slots_per_unit = (unit_len + BL_SESSION_SLOT_LEN - 1) / BL_SESSION_SLOT_LEN;
+	uint32_t credit = (BL_SESSION_SLOTS - bl_session.slot_count) / slots_per_unit + 1 + BL_RX_RING_LEN / wire_len;
+
+	return (credit > BL_CREDIT_MAX) ? BL_CREDIT_MAX : credit;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_stream_receive
+*   Description   : Receives a BL_STREAM image: blocks of block_len raw bytes (the last one
+*                   shorter), each followed by its CRC and coded with parity bytes per codeword
+*                   when parity is set. A good block goes to the session queue, a bad or short
+*                   one is dropped and the host resends from the last checkpoint.
+*                   Every block gets a checkpoint reply, there is no per frame ACK. Runs from
+*                   SRAM so data keeps arriving while sectors erase in the background
+*   Parameters    : p_args - uint32_t base, uint32_t length, uint32_t block_len, uint32_t parity
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_stream_receive(uint32_t base, uint32_t length, uint32_t block_len, uint32_t parity)
+{
+	uint32_t offset = 0;
+	uint8_t status = HAL_OK;
+	uint32_t wire_len = BL_STREAM_WIRE_LEN(block_len, parity);
+
+	while((offset < length) && ((status == HAL_OK) || (status == BL_STREAM_ROLLBACK)))
+	{
+		uint32_t data_len = ((length - offset) > block_len) ? block_len : (length - offset);
+		uint32_t rx_start = BL_CYCLES_NOW();
+		uint32_t received = bootloader_stream_read_block(data_len + 4, parity);
+
+		if(!received)
+		{
+			/*host gone, the session stays open for BL_SESSION_END*/
+			return;
+		}
+		bl_stats.cycles_rx += (uint32_t)(BL_CYCLES_NOW() - rx_start);
+		bl_stats.frames_rx++;
+
+		if(received < data_len + 4)
+		{
+			/*bytes were lost and the line is already idle*/
+			status = BL_STREAM_ROLLBACK;
+		}else if(bootloader_verify_crc(bl_stream_block, data_len, *((uint32_t *) (&bl_stream_block[data_len]))))
+		{
+			status = BL_STREAM_ROLLBACK;
+		}else
+		{
+			bootloader_session_queue(base + offset, bl_stream_block, data_len);
+			offset += data_len;
+			status = bl_session.status;
+		}
+		bootloader_reply_stream(status, offset, bootloader_session_credit(block_len, wire_len));
+
+		if((status == BL_STREAM_ROLLBACK) && (received == data_len + 4))
+		{
+			bootloader_stream_resync();
+		}
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_stream_read_block
+*   Description   : Reads len bytes of block and CRC into bl_stream_block, one codeword at a time
+*                   when parity is set. A codeword that cannot be repaired is kept as received,
+*                   the block CRC then rejects it
+*   Parameters    : p_args - uint32_t len, uint32_t parity
+*   Return Value  : uint32_t - bytes stored, 0 when the block did not start within
+*                   BL_STREAM_TIMEOUT_MS, less than len when the line went idle in between
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint32_t bootloader_stream_read_block(uint32_t len, uint32_t parity)
+{
+	uint32_t chunk_max = parity ? (BL_FEC_CODEWORD_LEN - parity) : len;
+	uint32_t timeout_ms = BL_STREAM_TIMEOUT_MS;
+	uint32_t received = 0;
+
+	while(received < len)
+	{
+		uint32_t chunk = ((len - received) > chunk_max) ? chunk_max : (len - received);
+		uint8_t *pDest = parity ? bl_fec_codeword : &bl_stream_block[received];
+
+		if(!bootloader_uart_read_timeout(pDest, 1, timeout_ms))
+		{
+			break;
+		}
+		timeout_ms = BL_STREAM_GAP_MS;
+		if(bootloader_uart_read_timeout(&pDest[1], chunk + parity - 1, BL_STREAM_GAP_MS) < (chunk + parity - 1))
+		{
+			break;
+		}
+		if(parity)
+		{
+			bootloader_fec_decode(bl_fec_codeword, chunk + parity, parity);
+			for(uint32_t i = 0 ; i < chunk ; i++)
+			{
+				bl_stream_block[received + i] = bl_fec_codeword[i];
+			}
+		}
+		received += chunk;
+	}
+	return received;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_fec_init
+*   Description   : Builds the GF(2^8) exponent and log tables of BL_FEC_POLY in SRAM
+*   Parameters    : p_args - NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_fec_init(void)
+{
+	uint32_t x = 1;
+
+	for(uint32_t i = 0 ; i < BL_FEC_CODEWORD_LEN ; i++)
+	{
+		bl_gf_exp[i] = (uint8_t)x;
+		bl_gf_exp[i + BL_FEC_CODEWORD_LEN] = (uint8_t)x;
+		bl_gf_log[x] = (uint8_t)i;
+		x <<= 1;
+		if(x & 0x100)
+		{
+			x ^= BL_FEC_POLY;
+		}
+	}
+}
+static __RAM_FUNC uint8_t bootloader_gf_mul(uint8_t a, uint8_t b)
+{
+	if(!a || !b)
+	{
+		return 0;
+	}
+	return bl_gf_exp[bl_gf_log[a] + bl_gf_log[b]];
+}
+static __RAM_FUNC uint8_t bootloader_gf_div(uint8_t a, uint8_t b)
+{
+	if(!a)
+	{
+		return 0;
+	}
+	return bl_gf_exp[bl_gf_log[a] + BL_FEC_CODEWORD_LEN - bl_gf_log[b]];
+}
+/*Polynomial with the lowest coefficient first*/
+static __RAM_FUNC uint8_t bootloader_gf_poly_eval(const uint8_t *pPoly, uint32_t degree, uint8_t x)
+{
+	uint8_t y = pPoly[degree];
+
+	for(uint32_t i = degree ; i > 0 ; i--)
+	{
+		y = bootloader_gf_mul(y, x) ^ pPoly[i - 1];
+	}
+	return y;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_fec_decode
+*   Description   : Repairs a Reed-Solomon codeword in place: data bytes followed by parity
+*                   bytes, first byte is the highest power. Syndromes, Berlekamp-Massey for
+*                   the error locator, Chien search for the positions and Forney for the values.
+*                   The corrections are applied only once every error is located, a codeword
+*                   beyond repair is left as received. A clean codeword costs the syndromes only
+*   Parameters    : p_args - uint8_t *pCodeword, uint32_t len (at most BL_FEC_CODEWORD_LEN),
+*                   uint32_t parity (at most BL_FEC_PARITY_MAX)
+*   Return Value  : int32_t - bytes corrected, -1 when there were more errors than parity/2
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC int32_t bootloader_fec_decode(uint8_t *pCodeword, uint32_t len, uint32_t parity)
+{
+	uint8_t syndrome[BL_FEC_PARITY_MAX];
+	uint8_t locator[BL_FEC_PARITY_MAX + 1];
+	uint8_t previous[BL_FEC_PARITY_MAX + 1];
+	uint8_t evaluator[BL_FEC_PARITY_MAX];
+	uint8_t scratch[BL_FEC_PARITY_MAX + 1];
+	uint8_t position[BL_FEC_PARITY_MAX / 2];
+	uint8_t value[BL_FEC_PARITY_MAX / 2];
+	uint32_t errors = 0;
+	uint32_t shift = 1;
+	uint8_t last_discrepancy = 1;
+	uint8_t dirty = 0;
+	int32_t corrected = 0;
+	uint32_t fec_start = BL_CYCLES_NOW();
+
+	for(uint32_t j = 0 ; j < parity ; j++)
+	{
+		uint8_t root = bl_gf_exp[j];
+		uint8_t s = 0;
+		for(uint32_t i = 0 ; i < len ; i++)
+		{
+			s = bootloader_gf_mul(s, root) ^ pCodeword[i];
+		}
+		syndrome[j] = s;
+		dirty |= s;
+	}
+	if(!dirty)
+	{
+		bl_stats.cycles_fec += (uint32_t)(BL_CYCLES_NOW() - fec_start);
+		return 0;
+	}
+
+	/*Berlekamp-Massey. No memcpy or initializers here, they would call into newlib in flash*/
+	for(uint32_t i = 0 ; i <= parity ; i++)
+	{
+		locator[i] = previous[i] = (i == 0);
+	}
+	for(uint32_t n = 0 ; n < parity ; n++)
+	{
+		uint8_t discrepancy = syndrome[n];
+		for(uint32_t i = 1 ; i <= errors ; i++)
+		{
+			discrepancy ^= bootloader_gf_mul(locator[i], syndrome[n - i]);
+		}
+		if(!discrepancy)
+		{
+			shift++;
+			continue;
+		}
+		uint8_t scale = bootloader_gf_div(discrepancy, last_discrepancy);
+		for(uint32_t i = 0 ; i <= parity ; i++)
+		{
+			scratch[i] = locator[i];
+		}
+		for(uint32_t i = 0 ; (i + shift) <= parity ; i++)
+		{
+			locator[i + shift] ^= bootloader_gf_mul(scale, previous[i]);
+		}
+		if((2 * errors) <= n)
+		{
+			errors = n + 1 - errors;
+			for(uint32_t i = 0 ; i <= parity ; i++)
+			{
+				previous[i] = scratch[i];
+			}
+			last_discrepancy = discrepancy;
+			shift = 1;
+		}else
+		{
+			shift++;
+		}
+	}
+
+	if((2 * errors) <= parity)
+	{
+		/*error evaluator, syndrome times locator modulo x^parity*/
+		for(uint32_t i = 0 ; i < parity ; i++)
+		{
+			evaluator[i] = 0;
+			for(uint32_t j = 0 ; (j <= i) && (j <= errors) ; j++)
+			{
+				evaluator[i] ^= bootloader_gf_mul(locator[j], syndrome[i - j]);
+			}
+		}
+		/*Chien search: byte i is the coefficient of x^(len - 1 - i), its locator is alpha^(len - 1 - i)*/
+		for(uint32_t i = 0 ; i < len ; i++)
+		{
+			uint32_t power = len - 1 - i;
+			uint8_t inverse = bl_gf_exp[(BL_FEC_CODEWORD_LEN - power) % BL_FEC_CODEWORD_LEN];
+			if(bootloader_gf_poly_eval(locator, errors, inverse))
+			{
+				continue;
+			}
+			/*Forney, the derivative of the locator keeps its odd terms*/
+			uint8_t derivative = 0;
+			uint8_t inverse_squared = bootloader_gf_mul(inverse, inverse);
+			uint8_t term = 1;
+			for(uint32_t j = 1 ; j <= errors ; j += 2)
+			{
+				derivative ^= bootloader_gf_mul(locator[j], term);
+				term = bootloader_gf_mul(term, inverse_squared);
+			}
+			if(!derivative || ((uint32_t)corrected == errors))
+			{
+				corrected = -1;
+				break;
+			}
+			position[corrected] = (uint8_t)i;
+			value[corrected] = bootloader_gf_mul(bl_gf_exp[power],
+			                   bootloader_gf_div(bootloader_gf_poly_eval(evaluator, parity - 1, inverse), derivative));
+			corrected++;
+		}
+	}
+	if(((uint32_t)corrected != errors) || !errors)
+	{
+		/*more errors than the code corrects, nothing is changed and the CRC of the block decides*/
+		corrected = -1;
+		bl_stats.fec_failures++;
+	}else
+	{
+		for(uint32_t i = 0 ; i < errors ; i++)
+		{
+			pCodeword[position[i]] ^= value[i];
+		}
+		bl_stats.fec_codewords++;
+		bl_stats.fec_corrected += corrected;
+	}
+	bl_stats.cycles_fec += (uint32_t)(BL_CYCLES_NOW() - fec_start);
+	return corrected;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_stream_resync
+*   Description   : Drops the blocks the host sent after a bad one, until the line is idle
+*                   for BL_STREAM_GAP_MS. The host waits longer than that before it resends
+*   Parameters    : p_args - NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_stream_resync(void)
+{
+	uint8_t discard;
+
+	while(bootloader_uart_read_timeout(&discard, 1, BL_STREAM_GAP_MS))
+	{
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_node_receive
+*   Description   : Rest of a frame on a shared bus, its length byte is already in pBuffer[0].
+*                   Replies of other nodes are skipped, a length that can not be a request or a
+*                   frame cut short drops input until the line is idle for BL_NODE_GAP_MS, so a
+*                   node that lost the frame sync (stream data, noise) finds it again
+*   Parameters    : p_args - uint8_t *pBuffer
+*   Return Value  : uint8_t - 1 when pBuffer holds a whole frame
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint8_t bootloader_node_receive(uint8_t *pBuffer)
+{
+	uint32_t len = pBuffer[0];
+
+	if(len == BL_REPLY)
+	{
+		uint8_t payload_len;
+
+		if(bootloader_uart_read_timeout(&payload_len, 1, BL_NODE_GAP_MS))
+		{
+			bootloader_node_skip(payload_len + 4);
+		}
+		return 0;
+	}
+	if((len < 5) || (len >= BL_RX_LEN) ||
+	   (bootloader_uart_read_timeout(&pBuffer[1], len, BL_NODE_GAP_MS) < len))
+	{
+		bootloader_node_skip(0xFFFFFFFFU);
+		return 0;
+	}
+	return 1;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_node_accept
+*   Description   : Bus addressing of a received frame, the first BL_NODE frame turns it on.
+*                   Anything but BL_NODE is not addressed and dropped, as is a frame that fails
+*                   its CRC: nobody knows who it was for, so no NACK. The request inside a
+*                   BL_NODE_FOR for this node is moved to the start of pBuffer
+*   Parameters    : p_args - uint8_t *pBuffer
+*   Return Value  : uint8_t - 1 when pBuffer holds a request to handle
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC uint8_t bootloader_node_accept(uint8_t *pBuffer)
+{
+	uint32_t frame_len = pBuffer[0] + 1;
+	uint32_t request_len = frame_len - BL_NODE_FOR_LEN;
+	uint8_t address = pBuffer[3];
+
+	if((pBuffer[1] != BL_NODE) ||
+	   bootloader_verify_crc(pBuffer, frame_len - 4, *((uint32_t *) (&pBuffer[frame_len - 4]))))
+	{
+		return 0;
+	}
+	bl_node.bus = 1;
+	bl_node.unicast = 0;
+	if(pBuffer[2] != BL_NODE_FOR)
+	{
+		return 1;
+	}
+	if((address != BL_NODE_BROADCAST) &&
+	   ((bl_node.address == BL_NODE_UNASSIGNED) || ((address != bl_node.address) && ((address != BL_NODE_TO_GROUP) || !bl_node.group))))
+	{
+		return 0;
+	}
+	if((frame_len < BL_NODE_FOR_LEN + 6) || (pBuffer[4] + 1U != request_len))
+	{
+		return 0;
+	}
+	bl_node.unicast = (address == bl_node.address);
+	for(uint32_t i = 0 ; i < request_len ; i++)
+	{
+		pBuffer[i] = pBuffer[i + 4];
+	}
+	return 1;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_node_slot
+*   Description   : BL_NODE_ENUM slot of this node, a hash of the UID and the seed. Nodes that
+*                   collide in one round are spread apart by the next seed
+*   Parameters    : p_args - uint8_t seed, uint32_t slots
+*   Return Value  : uint32_t - slot, 0 to slots - 1
+*  ---------------------------------------------------------------------------*/
+static uint32_t bootloader_node_slot(uint8_t seed, uint32_t slots)
+{
+	uint32_t hash = (seed + 1U) * 0x9E3779B1U;
+
+	for(uint32_t i = 0 ; i < 3 ; i++)
+	{
+		hash ^= *((uint32_t *) (UID_BASE + 4 * i) );
+		hash *= 0x85EBCA6BU;
+		hash ^= hash >> 13;
+	}
+	return hash % slots;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_node_skip
+*   Description   : Drops len bytes, or fewer once the line is idle for BL_NODE_GAP_MS
+*   Parameters    : p_args - uint32_t len
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+static __RAM_FUNC void bootloader_node_skip(uint32_t len)
+{
+	uint8_t discard;
+
+	while(len-- && bootloader_uart_read_timeout(&discard, 1, BL_NODE_GAP_MS))
+	{
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_pump
+*   Description   :background flash scheduler, called whenever the parser waits for bytes.
+*                  Does one step per call: retire a finished erase, program the oldest
+*                  queued chunk once its sectors are erased, start the erase that chunk
+*                  needs, or with nothing queued erase the next sector of the range ahead
+*                  of the data so the erase time hides behind the transfer. With
+*                  BL_SESSION_LAZY_ERASE only sectors that a write touches are erased.
+*                  erased_mask guarantees a sector is erased at most once per session
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_session_pump(void)
+{
+	bl_session_slot_t *slots = (bl_session_slot_t *)bl_work_buffer;
+	uint8_t sector;
+
+	if(!bl_session.active)
+	{
+		return;
+	}
+
+	if(bl_session.erase_sector != BL_SECTOR_NONE)
+	{
+		uint8_t status = bootloader_flash_erase_poll();
+		if(status == HAL_BUSY)
+		{
+			return;
+		}
+		bl_stats.cycles_flash_erase += (uint32_t)(BL_CYCLES_NOW() - bl_session.erase_start_cycles);
+		if(status == HAL_OK)
+		{
+			bl_session.erased_mask |= (1U << bl_session.erase_sector);
+			if(bl_session.flags & BL_SESSION_JOURNAL)
+			{
+				BL_JOURNAL_STATE->erased_mask = bl_session.erased_mask;
+			}
+		}else
+		{
+			bl_session.status = status;
+		}
+		bl_session.erase_sector = BL_SECTOR_NONE;
+		return;
+	}
+
+	if(bl_session.slot_count)
+	{
+		bl_session_slot_t *slot = &slots[bl_session.slot_tail];
+		uint8_t last = bootloader_flash_get_sector(slot->address + slot->len - 1);
+
+		for(sector = bootloader_flash_get_sector(slot->address) ; sector <= last ; sector++)
+		{
+			if(!(bl_session.erased_mask & (1U << sector)))
+			{
+				break;
+			}
+		}
+		if((sector <= last) && (bl_session.status == HAL_OK) && (bl_session.flags & BL_SESSION_COMPARE))
+		{
+			if(bootloader_flash_compare(slot->address, slot->data, slot->len) != BL_FLASH_NEEDS_ERASE)
+			{
+				/*equal or 1->0 changes only, program in place without erasing*/
+				for(uint8_t in_place = sector ; in_place <= last ; in_place++)
+				{
+					if(!(bl_session.erased_mask & (1U << in_place)))
+					{
+						bl_session.programmed_mask |= (1U << in_place);
+					}
+				}
+				sector = last + 1;
+			}else if(bl_session.programmed_mask & (1U << sector))
+			{
+				/*earlier data of this session was programmed in place into the sector and is
+				 *lost by the erase, the host resends from the start of the sector*/
+				bl_session.status = BL_SESSION_RESTART;
+				bl_session.restart_address = (bl_flash_sector_base[sector] > bl_session.base) ?
+				                             bl_flash_sector_base[sector] : bl_session.base;
+				bl_session.programmed_mask &= ~(1U << sector);
+				bl_session.slot_tail = bl_session.slot_head;
+				bl_session.slot_count = 0;
+			}
+		}
+		if(bl_session.slot_count && ((sector > last) || (bl_session.status != HAL_OK)))
+		{
+			if(bl_session.status == HAL_OK)
+			{
+				uint32_t program_start = BL_CYCLES_NOW();
+				bl_session.status = bootloader_flash_program(slot->address, slot->data, slot->len);
+				bl_stats.cycles_flash_program += (uint32_t)(BL_CYCLES_NOW() - program_start);
+				bl_stats.bytes_programmed += slot->len;
+				if((bl_session.flags & BL_SESSION_JOURNAL) && (bl_session.status == HAL_OK) &&
+				   (slot->address == bl_session.journal_next))
+				{
+					/*read back before the journal vouches for it, a resume skips this data*/
+					if(bootloader_flash_compare(slot->address, slot->data, slot->len) != BL_FLASH_EQUAL)
+					{
+						bl_session.status = HAL_ERROR;
+					}else
+					{
+						bootloader_journal_advance(slot->address + slot->len);
+					}
+				}
+			}
+			bl_session.slot_tail = (bl_session.slot_tail + 1 == BL_SESSION_SLOTS) ? 0 : bl_session.slot_tail + 1;
+			bl_session.slot_count--;
+			return;
+		}
+	}else if((bl_session.status == HAL_OK) && !(bl_session.flags & (BL_SESSION_LAZY_ERASE | BL_SESSION_COMPARE)))
+	{
+		for(sector = bl_session.first_sector ; sector <= bl_session.last_sector ; sector++)
+		{
+			if(!(bl_session.erased_mask & (1U << sector)))
+			{
+				break;
+			}
+		}
+		if(sector > bl_session.last_sector)
+		{
+			return;
+		}
+	}else
+	{
+		return;
+	}
+
+	bl_session.erase_start_cycles = BL_CYCLES_NOW();
+	if(bootloader_flash_erase_start(sector) == HAL_OK)
+	{
+		bl_session.erase_sector = sector;
+		bl_stats.sector_erases++;
+	}else
+	{
+		bl_session.status = HAL_ERROR;
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_idle
+*   Description   :waits for a background erase to complete so flash resident code can run
+*   Parameters    : p_args -NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_session_idle(void)
+{
+	while(bl_session.active && (bl_session.erase_sector != BL_SECTOR_NONE))
+	{
+		bootloader_session_pump();
+	}
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_session_flush
+*   Description   :runs the scheduler until every queued chunk is programmed and, unless the
+*                  session is BL_SESSION_LAZY_ERASE/COMPARE, every sector of the range is erased
+*   Parameters    : p_args -NULL
+*   Return Value  : uint8_t - sticky session status
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC uint8_t bootloader_session_flush(void)
+{
+	uint32_t range_mask = ((1U << (bl_session.last_sector + 1)) - 1) & ~((1U << bl_session.first_sector) - 1);
+
+	while(bl_session.active)
+	{
+		if((bl_session.slot_count == 0) && (bl_session.erase_sector == BL_SECTOR_NONE))
+		{
+			if((bl_session.status != HAL_OK) || (bl_session.flags & (BL_SESSION_LAZY_ERASE | BL_SESSION_COMPARE)) ||
+			   ((bl_session.erased_mask & range_mask) == range_mask))
+			{
+				break;
+			}
+		}
+		bootloader_session_pump();
+	}
+
+	return bl_session.status;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_journal_init
+*   Description   : Opens the backup SRAM the journal lives in, its content is kept
+*   Parameters    : p_args - NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_journal_init(void)
+{
+	bootloader_bkpsram_enable();
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_journal_clear
+*   Description   : Forgets the journal, the next BL_SESSION_RESUME is refused
+*   Parameters    : p_args - NULL
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_journal_clear(void)
+{
+	BL_JOURNAL_STATE->magic = 0;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_journal_matches
+*   Description   : Tells whether a BL_STREAM of [base, base+length) can resume the journaled
+*                   image: same image ID and end, base on a block boundary within the verified data
+*   Parameters    : p_args - uint32_t base, uint32_t length, uint32_t image_id
+*   Return Value  : uint8_t
+*  ---------------------------------------------------------------------------*/
+uint8_t bootloader_journal_matches(uint32_t base, uint32_t length, uint32_t image_id)
+{
+	bl_journal_t *journal = BL_JOURNAL_STATE;
+
+	return (journal->magic == BL_JOURNAL_MAGIC) && (journal->image_id == image_id) &&
+	       (base >= journal->base) && ((base - journal->base) <= journal->verified) &&
+	       (((base - journal->base) % BL_JOURNAL_BLOCK_LEN) == 0) &&
+	       ((base + length) == (journal->base + journal->length));
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_journal_open
+*   Description   : Starts journaling the BL_STREAM session just opened. A new image resets the
+*                   journal, a resume keeps it up to base and hands the sectors already erased
+*                   for the image to the session so they are not erased again
+*   Parameters    : p_args - uint32_t base, uint32_t length, uint32_t image_id, uint8_t resume
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+void bootloader_journal_open(uint32_t base, uint32_t length, uint32_t image_id, uint8_t resume)
+{
+	bl_journal_t *journal = BL_JOURNAL_STATE;
+
+	if(resume)
+	{
+		journal->verified = base - journal->base;
+		bl_session.erased_mask = (uint8_t)journal->erased_mask;
+	}else
+	{
+		journal->magic = 0;
+		journal->image_id = image_id;
+		journal->base = base;
+		journal->length = length;
+		journal->verified = 0;
+		journal->erased_mask = 0;
+		journal->magic = BL_JOURNAL_MAGIC;
+	}
+	bl_session.journal_next = base;
+}
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : bootloader_journal_advance
+*   Description   : Data up to end is programmed and read back in order, records the CRC of
+*                   every journal block it completes. Called from the session pump, so the
+*                   flash is idle
+*   Parameters    : p_args - uint32_t end
+*   Return Value  : NULL
+*  ---------------------------------------------------------------------------*/
+__RAM_FUNC void bootloader_journal_advance(uint32_t end)
+{
+	bl_journal_t *journal = BL_JOURNAL_STATE;
+	uint32_t done = end - journal->base;
+
+	bl_session.journal_next = end;
+	while(journal->verified < done)
+	{
+		uint32_t block_len = ((journal->length - journal->verified) > BL_JOURNAL_BLOCK_LEN) ?
+		                     BL_JOURNAL_BLOCK_LEN : (journal->length - journal->verified);
+		if((journal->verified + block_len) > done)
+		{
+			break;
+		}
+		journal->block_crc[journal->verified / BL_JOURNAL_BLOCK_LEN] =
+		        bootloader_flash_digest(journal->base + journal->verified, block_len);
+		journal->verified += block_len;
+	}
+}
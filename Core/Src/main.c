@@ -103,6 +103,10 @@ int main(void)
     {
 	  HAL_GPIO_WritePin(LD2_GPIO_Port,LD2_Pin ,GPIO_PIN_SET);
 	  HAL_UART_Transmit(&huart3,(uint8_t *)msg1, strlen(msg1),HAL_MAX_DELAY);
+	  bootloader_stats_init();
+	  bootloader_fec_init();
+	  bootloader_journal_init();
+	  bootloader_uart_init();
   	  bootloader_uart_read_data();
 
 
@@ -22,6 +22,7 @@
 #include "stm32f4xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "bsp.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -199,5 +200,13 @@ void SysTick_Handler(void)
 /******************************************************************************/
 
 /* USER CODE BEGIN 1 */
+/**
+  * @brief This function handles USART2 global interrupt.
+  *        Placed in SRAM so reception continues while the flash is programmed or erased.
+  */
+__RAM_FUNC void USART2_IRQHandler(void)
+{
+  bootloader_uart_rx_isr();
+}
 
 /* USER CODE END 1 */
@@ -0,0 +1,1754 @@
+"""
+Simulated bootloader and the self-tests of python_script.py. A "sim:" port name opens a
+SimulatedLine instead of a serial port, the --*-selftest options run here. python_script
+imports this module only for those, the protocol constants and the host flow come from it.
+"""
+import collections
+import heapq
+import io
+import json
+import math
+import os
+import random
+import struct
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+import python_script as host
+from python_script import (APP_BASE_ADDRESS, AppImage, BL_ACK, BL_BAUD_RATE, BL_BENCH_FORMAT,
+                           BL_CRC_MODE_BYTE_WORD, BL_FEATURE_BENCH, BL_FEATURE_BUS, BL_FEATURE_COMPARE,
+                           BL_FEATURE_CREDITS, BL_FEATURE_FEC, BL_FEATURE_JOURNAL, BL_FEATURE_LAZY_ERASE,
+                           BL_FEATURE_SESSION, BL_FEATURE_STATS, BL_FEATURE_STREAM, BL_FEATURE_STUBS,
+                           BL_HELP_FORMAT, BL_JOURNAL_EMPTY, BL_JOURNAL_FORMAT, BL_JOURNAL_MISMATCH, BL_NACK,
+                           BL_NODE_ASSIGN, BL_NODE_BROADCAST, BL_NODE_DIGEST, BL_NODE_DIGESTS_MAX, BL_NODE_ENUM,
+                           BL_NODE_ENUM_RESET, BL_NODE_ENUM_SLOTS_MAX, BL_NODE_FOR, BL_NODE_FOR_LEN,
+                           BL_NODE_GAP_MS, BL_NODE_GROUP, BL_NODE_STATUS, BL_NODE_STATUS_FORMAT,
+                           BL_NODE_TO_GROUP, BL_NODE_UNASSIGNED, BL_REPLY, BL_RX_RING_LEN, BL_SECTOR_NONE,
+                           BL_SESSION_COMPARE, BL_SESSION_LAZY_ERASE, BL_SESSION_RESTART, BL_SESSION_RESUME,
+                           BL_STATS_CLEAR, BL_STATS_FORMAT, BL_STREAM_BLOCK_MAX, BL_STREAM_BLOCK_MIN,
+                           BL_STREAM_FORMAT, BL_STREAM_GAP_MS, BL_STREAM_ROLLBACK, BL_STREAM_TIMEOUT_MS,
+                           BL_STUB_ABI_VERSION, BL_STUB_BAD_ADDRESS, BL_STUB_BAD_HEADER, BL_STUB_HEADER_FORMAT,
+                           BL_STUB_MAGIC, BL_STUB_OK, BL_STUB_RESULT_FORMAT, COMMAND_BL_BENCH,
+                           COMMAND_BL_EXEC_STUB, COMMAND_BL_FLASH_ERASE, COMMAND_BL_GET_CID,
+                           COMMAND_BL_GET_HELP, COMMAND_BL_GET_STATS, COMMAND_BL_GET_VER, COMMAND_BL_GO_TO_ADDR,
+                           COMMAND_BL_JOURNAL, COMMAND_BL_MEM_WRITE, COMMAND_BL_MEM_WRITE_LEN, COMMAND_BL_NODE,
+                           COMMAND_BL_SESSION_BEGIN, COMMAND_BL_SESSION_END, COMMAND_BL_STREAM,
+                           FEC_CODEWORD_LEN, FEC_GF_EXP, FEC_GF_LOG, FEC_PARITY_MAX, FEC_PARITY_MIN,
+                           FLASH_SECTOR_BASE, Flash_HAL_BUSY, Flash_HAL_ERROR, Flash_HAL_INV_ADDR, Flash_HAL_OK,
+                           fec_encode, get_crc, get_flash_digest, gf_mul, open_serial_port, parse_device_caps,
+                           select_transfer_mode, select_transfer_path)
+
+# Simulated bootloader behind a sim:NAME port, timings of the STM32F446 at 3.3 V
+SIM_VERSION = 0x10
+SIM_RX_LEN = 200            # BL_RX_LEN, longest request frame
+SIM_FEATURES = (BL_FEATURE_SESSION | BL_FEATURE_LAZY_ERASE | BL_FEATURE_COMPARE | BL_FEATURE_STATS |
+                BL_FEATURE_CREDITS | BL_FEATURE_BUS | BL_FEATURE_STUBS | BL_FEATURE_BENCH | BL_FEATURE_STREAM |
+                BL_FEATURE_JOURNAL | BL_FEATURE_FEC)
+SIM_COMMANDS = bytes([COMMAND_BL_GET_VER, COMMAND_BL_GET_HELP, COMMAND_BL_GET_CID, COMMAND_BL_GO_TO_ADDR,
+                      COMMAND_BL_FLASH_ERASE, COMMAND_BL_MEM_WRITE, COMMAND_BL_GET_STATS,
+                      COMMAND_BL_SESSION_BEGIN, COMMAND_BL_SESSION_END, COMMAND_BL_NODE, COMMAND_BL_EXEC_STUB,
+                      COMMAND_BL_BENCH, COMMAND_BL_STREAM,
+                      COMMAND_BL_JOURNAL])
+SIM_WORK_BUFFER_ADDR = 0x20000400
+SIM_WORK_BUFFER_LEN = 96 * 1024
+SIM_IDCODE = 0x10006421
+SIM_SYSCLK_HZ = 84000000    # HSI and PLL setup of main.c
+# BL_BENCH lengths of bsp.h and the cycles execute_bench measures on the board for them
+SIM_BENCH_PING_LEN = 8
+SIM_BENCH_LENS = dict(program_len=1024, byte_len=64, crc_len=4096, copy_len=32 * 1024)
+SIM_BENCH_CYCLES = dict(crc_byte_cycles=4096 * 5, crc_word_cycles=1024 * 5, memcpy_cycles=32 * 1024 // 4 * 3)
+SIM_STUB_CALL_CYCLES = 60   # stub_blank_check call, argument checks and return
+SIM_STUB_SCAN_CYCLES = 3    # stub_blank_check per word, four loads and a compare per four words plus wait states
+SIM_STUB_DIGEST_CYCLES = 4  # bootloader_flash_digest per word through the CRC unit
+SIM_FEC_SYNDROME_CYCLES = 8 # bootloader_fec_decode per byte and parity byte, a bootloader_gf_mul and an XOR
+SIM_APP_BASE = APP_BASE_ADDRESS
+SIM_ERASE_TIME = {0x4000: 0.25, 0x10000: 0.55, 0x20000: 1.0}    # seconds per sector size, typical
+SIM_WORD_PROGRAM_TIME = 16e-6
+SIM_SESSION_SLOTS = SIM_WORK_BUFFER_LEN // 136  # bl_session_slot_t: address, length and 128 data bytes
+SIM_SESSION_SLOT_LEN = 128
+SIM_SESSION_JOURNAL = 0x80  # BL_SESSION_JOURNAL, internal to the bootloader: BL_STREAM sessions are journaled
+SIM_JOURNAL_BLOCK_LEN = 2048
+SIM_JOURNAL_REPLY_CRCS = 48
+SIM_REPLY_LATENCY = 10e-6   # parser to the first reply byte on the line
+SIM_POLL = 0.001            # seconds a read waits between two looks at the simulated line
+SIM_BUS_CLOCK_SKEW = 0.01  # HSI spread of the nodes on a simulated bus
+BUS_SELFTEST_IMAGE_LEN = 64 * 1024
+BUS_SELFTEST_LOSSY_BER = 2e-5
+ENUM_SELFTEST_NODES = (32, 64)
+ENUM_SELFTEST_TRIALS = 5
+
+def get_crc_reference(buff, length):
+    crc = 0xFFFFFFFF
+    for data in buff[0:length]:
+        crc ^= data
+        for _ in range(32):
+            if crc & 0x80000000:
+                crc = ((crc << 1) ^ 0x04C11DB7) & 0xFFFFFFFF
+            else:
+                crc = (crc << 1) & 0xFFFFFFFF
+    return crc
+
+def crc_selftest(cases=500, bench_frames=256):
+    """
+    Cross-check get_crc against get_crc_reference on random frames and time both on full
+    128 byte MEM_WRITE frames.
+    """
+    for n in range(cases):
+        frame = os.urandom(n % 260)
+        if get_crc(frame, len(frame)) != get_crc_reference(frame, len(frame)):
+            print("\n   CRC mismatch on {0}".format(frame.hex()))
+            return -1
+    print("\n   CRC cross-check: {0} frames match the reference".format(cases))
+
+    frame = list(os.urandom(COMMAND_BL_MEM_WRITE_LEN - 4 + 128))
+    for crc_function in (get_crc_reference, get_crc):
+        start = time.perf_counter()
+        for _ in range(bench_frames):
+            crc_function(frame, len(frame))
+        elapsed = (time.perf_counter() - start) / bench_frames
+        print("   {0:<18} {1:8.1f} us/frame  {2:8.2f} MB/s".format(crc_function.__name__, elapsed * 1e6,
+                                                                     len(frame) / elapsed / 1e6))
+    return 0
+
+# GET_HELP reply bytes the device sends (None: all of them), its features, frame and ring length,
+# then the wanted stream, staging, session and flags and the (session, flags, chunk, window, path)
+# the host must pick
+MODE_SELFTEST_CASES = [
+    ("no BL_GET_HELP",            0,    0x0F,   200,  512, 1, 1, 1, 0x03, (0, 0x00, 128,  1, 'erase')),
+    ("short BL_GET_HELP reply",   24,   0x0F,   200,  512, 1, 1, 1, 0x03, (0, 0x00, 128,  1, 'erase')),
+    ("session only",              None, 0x09,   200,  512, 0, 0, 1, 0x03, (1, 0x00, 188,  2, 'session')),
+    ("session, lazy erase",       None, 0x0B,   200,  512, 0, 0, 1, 0x03, (1, 0x01, 188,  2, 'session')),
+    ("session, lazy, compare",    None, 0x0F,   200,  512, 0, 0, 1, 0x03, (1, 0x03, 188,  2, 'session')),
+    ("compare flag not wanted",   None, 0x0F,   200,  512, 0, 0, 1, 0x01, (1, 0x01, 188,  2, 'session')),
+    ("no session support",        None, 0x0E,   200,  512, 0, 0, 1, 0x03, (0, 0x00, 188,  2, 'erase')),
+    ("session not wanted",        None, 0x0F,   200,  512, 0, 0, 0, 0x03, (0, 0x00, 188,  2, 'erase')),
+    ("staging",                   None, 0x1F,   200,  512, 0, 1, 1, 0x03, (1, 0x03, 188,  2, 'staged')),
+    ("staging not supported",     None, 0x0F,   200,  512, 0, 1, 1, 0x03, (1, 0x03, 188,  2, 'session')),
+    ("stream before staging",     None, 0x9F,   200,  512, 1, 1, 1, 0x03, (1, 0x03, 188,  2, 'stream')),
+    ("stream not supported",      None, 0x1F,   200,  512, 1, 0, 1, 0x03, (1, 0x03, 188,  2, 'session')),
+    ("stream without session",    None, 0x80,   200,  512, 1, 0, 1, 0x03, (0, 0x00, 188,  2, 'stream')),
+    ("this bootloader",           None, 0xFFF,  200,  512, 1, 1, 1, 0x03, (1, 0x03, 188,  2, 'stream')),
+    ("small frames",              None, 0x0F,    64,  512, 0, 0, 1, 0x03, (1, 0x03,  52,  8, 'session')),
+    ("large frames",              None, 0x0F,  1024, 4096, 0, 0, 1, 0x03, (1, 0x03, 252, 15, 'session')),
+    ("ring holds two frames",     None, 0x0F,   200,  256, 0, 0, 1, 0x03, (1, 0x03, 116,  2, 'session')),
+    ("ring shorter than a frame", None, 0x0F,   200,   16, 0, 0, 1, 0x03, (1, 0x03, 188,  1, 'session')),
+]
+
+def mode_selftest():
+    """
+    Check the transfer mode the host picks for a set of BL_GET_HELP replies, from bootloaders
+    without BL_GET_HELP or with a reply that lacks fields up to this one.
+    """
+    failed = 0
+    for (name, reply_len, features, max_frame_len, rx_ring_len, want_stream, want_staging, want_session,
+         want_flags, expected) in MODE_SELFTEST_CASES:
+        reply = BL_HELP_FORMAT.pack(0x10, 0x03, len(FLASH_SECTOR_BASE) - 1, 0, max_frame_len,
+                                    rx_ring_len, features, BL_BAUD_RATE, 0x20000000, 1024,
+                                    *FLASH_SECTOR_BASE)
+        caps = parse_device_caps(reply[:reply_len])
+        mode = select_transfer_mode(caps, want_session, want_flags)
+        mode += (select_transfer_path(caps, want_stream, want_staging, mode[0]),)
+        status = "ok" if mode == expected else "FAIL, expected {0}".format(expected)
+        failed += mode != expected
+        print("   {0:<26} session {1} flags {2:#04x} {3:>3} byte frames {4:>2} in flight {5:<8} {6}".format(
+            name, *mode, status))
+    print("\n   Transfer mode: {0} of {1} cases as expected".format(
+        len(MODE_SELFTEST_CASES) - failed, len(MODE_SELFTEST_CASES)))
+    return -1 if failed else 0
+
+def gf_div(a, b):
+    return FEC_GF_EXP[FEC_GF_LOG[a] + FEC_CODEWORD_LEN - FEC_GF_LOG[b]] if a else 0
+
+def gf_poly_eval(poly, degree, x):
+    """poly with the lowest coefficient first, at x."""
+    y = poly[degree]
+    for i in range(degree, 0, -1):
+        y = gf_mul(y, x) ^ poly[i - 1]
+    return y
+
+def fec_decode(codeword, parity):
+    """
+    bootloader_fec_decode step by step: repairs the Reed-Solomon codeword (a bytearray, first
+    byte the highest power) in place with syndromes, Berlekamp-Massey, Chien search and Forney.
+    Returns the bytes corrected, or -1 with codeword left as received when there were more
+    errors than parity // 2.
+    """
+    syndrome = []
+    for j in range(parity):
+        s = 0
+        for byte in codeword:
+            s = gf_mul(s, FEC_GF_EXP[j]) ^ byte
+        syndrome.append(s)
+    if not any(syndrome):
+        return 0
+
+    locator = [1] + [0] * parity
+    previous = list(locator)
+    errors, shift, last_discrepancy = 0, 1, 1
+    for n in range(parity):
+        discrepancy = syndrome[n]
+        for i in range(1, errors + 1):
+            discrepancy ^= gf_mul(locator[i], syndrome[n - i])
+        if not discrepancy:
+            shift += 1
+            continue
+        scale = gf_div(discrepancy, last_discrepancy)
+        scratch = list(locator)
+        for i in range(parity + 1 - shift):
+            locator[i + shift] ^= gf_mul(scale, previous[i])
+        if 2 * errors <= n:
+            errors = n + 1 - errors
+            previous = scratch
+            last_discrepancy = discrepancy
+            shift = 1
+        else:
+            shift += 1
+
+    corrections = []
+    if 2 * errors <= parity:
+        evaluator = [0] * parity
+        for i in range(parity):
+            for j in range(min(i, errors) + 1):
+                evaluator[i] ^= gf_mul(locator[j], syndrome[i - j])
+        for i in range(len(codeword)):
+            power = len(codeword) - 1 - i
+            inverse = FEC_GF_EXP[(FEC_CODEWORD_LEN - power) % FEC_CODEWORD_LEN]
+            if gf_poly_eval(locator, errors, inverse):
+                continue
+            derivative, term = 0, 1
+            inverse_squared = gf_mul(inverse, inverse)
+            for j in range(1, errors + 1, 2):
+                derivative ^= gf_mul(locator[j], term)
+                term = gf_mul(term, inverse_squared)
+            if not derivative or len(corrections) == errors:
+                corrections = None
+                break
+            corrections.append((i, gf_mul(FEC_GF_EXP[power], gf_div(gf_poly_eval(evaluator, parity - 1, inverse), derivative))))
+    if not errors or corrections is None or len(corrections) != errors:
+        return -1
+    for i, value in corrections:
+        codeword[i] ^= value
+    return errors
+
+class SimulatedNode:
+    """
+    A bootloader on a SimulatedLine, modelled on bootloader_uart_read_data and the session
+    engine of bsp.c. firmware() is the parser, a generator that yields what the CPU waits
+    for: a received byte (with a timeout), a point in time, or a reply to send. The line
+    resumes it at the simulated time that happens, so the receive ring fills and overruns
+    while the node is busy as the DMA ring does. The flash engine runs in the background in
+    the same time. Commands the host flow does not use are not modelled and stay unanswered.
+    On a bus it follows bootloader_node_receive and bootloader_node_accept and answers the
+    BL_NODE operations. ber flips a bit of a received byte at that rate per bit.
+    """
+    def __init__(self, line, uid, flash_time=1.0, seed=0, features=SIM_FEATURES):
+        self.line = line
+        self.uid = uid
+        self.flash_time = flash_time
+        self.features = features
+        self.random = random.Random(seed)
+        self.flash = bytearray(b'\xff' * (FLASH_SECTOR_BASE[-1] - FLASH_SECTOR_BASE[0]))
+        self.work_buffer = bytearray(SIM_WORK_BUFFER_LEN)
+        self.pending = collections.deque()
+        self.cpu = 0.0
+        self.tx_free = 0.0
+        self.token = 0
+        self.session = None
+        self.journal = None     # backup SRAM, outlives the sessions
+        self.engine_time = 0.0
+        self.started = False
+        self.frames_rx = self.bytes_programmed = self.crc_failures = self.nacks_sent = 0
+        self.overruns = self.sector_erases = self.words_skipped = 0
+        self.fec_codewords = self.fec_corrected = self.fec_failures = 0
+        self.ring_peak = 0
+        self.erase_rx = 0
+        self.flash_parser = False
+        self.ber = 0.0
+        self.clock = 1.0
+        self.bus = self.unicast = self.group = False
+        self.address = BL_NODE_UNASSIGNED
+        self.enum_slot = self.enum_seed = 0
+        self.rx_end = self.discard_until = 0.0
+        self.firmware_run = self.firmware()
+        self.request = next(self.firmware_run)
+
+    # Scheduling: the line calls receive() for every byte and wake() for the timers set here
+
+    def receive(self, byte, at):
+        if at < self.discard_until:
+            return
+        if self.ber and self.random.random() < 8 * self.ber:
+            byte ^= 1 << self.random.randrange(8)
+        session = self.session
+        if session and session['erase_sector'] is not None:
+            # the flash engine is caught up lazily, the erase may be over already
+            self.erase_rx += session['erase_end'] - self.erase_time(session['erase_sector']) <= at < session['erase_end']
+        if len(self.pending) >= BL_RX_RING_LEN:
+            self.overruns += 1
+            return
+        self.pending.append((byte, at))
+        self.ring_peak = max(self.ring_peak, len(self.pending))
+        self.step(at)
+
+    def wake(self, token, at):
+        if token == self.token:
+            self.step(at)
+
+    def timer(self, at):
+        self.token += 1
+        self.line.schedule(at, self.wake, self.token)
+
+    def step(self, now):
+        while self.request is not None:
+            if self.cpu > now:
+                self.timer(self.cpu)
+                return
+            kind, value = self.request
+            if kind == 'read':
+                if self.pending:
+                    byte, at = self.pending.popleft()
+                    self.cpu = max(self.cpu, at)
+                    result = byte
+                elif value is None:
+                    return
+                elif now < self.cpu + value:
+                    self.timer(self.cpu + value)
+                    return
+                else:
+                    self.cpu += value
+                    result = None
+            elif kind == 'until':
+                self.cpu = max(self.cpu, value)
+                result = None
+            elif kind == 'discard':
+                # waits like 'until' and drops what arrives meanwhile
+                self.discard_until = value
+                while self.pending and self.pending[0][1] < value:
+                    self.pending.popleft()
+                self.cpu = max(self.cpu, value)
+                if self.cpu > now:
+                    self.timer(self.cpu)
+                    return
+                result = None
+            elif kind == 'send':
+                start = max(self.cpu + SIM_REPLY_LATENCY, self.tx_free)
+                self.tx_free = self.line.transmit(self, value, start, self.clock)
+                result = None
+            try:
+                self.request = self.firmware_run.send(result)
+            except StopIteration:
+                self.request = None
+
+    # Parser, bootloader_uart_read_data
+
+    def read(self, length, timeout=None):
+        data = bytearray()
+        while len(data) < length:
+            byte = yield ('read', timeout)
+            if byte is None:
+                break
+            data.append(byte)
+        return bytes(data)
+
+    def skip(self, length, timeout):
+        while length:
+            if (yield ('read', timeout)) is None:
+                break
+            length -= 1
+
+    def busy(self, until):
+        yield ('until', until)
+
+    def send_reply(self, payload):
+        if self.bus and not self.unicast:
+            return  # addressed together with other nodes
+        frame = bytes([BL_REPLY, len(payload)]) + payload
+        yield ('send', frame + struct.pack('<I', get_crc(frame, len(frame))))
+
+    def send_nack(self):
+        self.nacks_sent += 1
+        if not (self.bus and not self.unicast):
+            yield ('send', bytes([BL_NACK]))
+
+    def firmware(self):
+        while not self.started:
+            if self.flash_parser and self.session:
+                # a parser running from flash stops with the CPU while the flash erases
+                self.engine_run(self.cpu)
+                if self.session['erase_sector'] is not None:
+                    yield from self.busy(self.session['erase_end'])
+            length = (yield from self.read(1))[0]
+            if self.bus:
+                frame = yield from self.node_receive(length)
+                if frame is None:
+                    continue
+            elif length >= SIM_RX_LEN:
+                # longer than bl_rx_buffer, dropped whole
+                yield from self.skip(length, BL_NODE_GAP_MS / 1000.0)
+                yield from self.send_nack()
+                continue
+            else:
+                frame = bytes([length]) + (yield from self.read(length))
+            self.rx_end = self.cpu
+            self.frames_rx += 1
+            self.engine_run(self.cpu)
+            if self.bus or frame[1] == COMMAND_BL_NODE:
+                frame = self.node_accept(frame)
+                if frame is None:
+                    continue
+            if len(frame) < 6 or get_crc(frame, len(frame) - 4) != struct.unpack_from('<I', frame, len(frame) - 4)[0]:
+                self.crc_failures += 1
+                yield from self.send_nack()
+                continue
+            if self.session_owns(frame):
+                yield from self.session_write(frame)
+                continue
+            # Everything else runs from flash, a background erase finishes first
+            if self.session and self.session['erase_sector'] is not None:
+                yield from self.busy(self.session['erase_end'])
+                self.engine_run(self.cpu)
+            yield from self.handle(frame)
+
+    def node_receive(self, length):
+        """bootloader_node_receive: the rest of a frame on a bus, None for a reply or a lost sync."""
+        gap = BL_NODE_GAP_MS / 1000.0
+        if length == BL_REPLY:
+            payload_len = yield from self.read(1, gap)
+            if payload_len:
+                yield from self.skip(payload_len[0] + 4, gap)
+            return None
+        rest = (yield from self.read(length, gap)) if 5 <= length < SIM_RX_LEN else b''
+        if len(rest) < length:
+            yield from self.skip(math.inf, gap)
+            return None
+        return bytes([length]) + rest
+
+    def node_accept(self, frame):
+        """bootloader_node_accept: the request to handle, unwrapped from BL_NODE_FOR, or None."""
+        if frame[1] != COMMAND_BL_NODE or get_crc(frame, len(frame) - 4) != struct.unpack_from('<I', frame, len(frame) - 4)[0]:
+            return None
+        self.bus, self.unicast = True, False
+        if frame[2] != BL_NODE_FOR:
+            return frame
+        address = frame[3]
+        if address != BL_NODE_BROADCAST and (self.address == BL_NODE_UNASSIGNED or (
+                address != self.address and (address != BL_NODE_TO_GROUP or not self.group))):
+            return None
+        if len(frame) < BL_NODE_FOR_LEN + 6 or frame[4] + 1 != len(frame) - BL_NODE_FOR_LEN:
+            return None
+        self.unicast = address == self.address
+        return frame[4:len(frame) - 4]
+
+    def node_slot(self, seed, slots):
+        """bootloader_node_slot"""
+        value = ((seed + 1) * 0x9E3779B1) & 0xFFFFFFFF
+        for word in struct.unpack('<3I', self.uid):
+            value = ((value ^ word) * 0x85EBCA6B) & 0xFFFFFFFF
+            value ^= value >> 13
+        return value % slots
+
+    def node_handle(self, frame):
+        """bootloader_handle_node_cmd"""
+        op = frame[2]
+        if op == BL_NODE_GROUP:
+            self.group = self.address != BL_NODE_UNASSIGNED and bool(frame[3 + self.address // 8] & (1 << self.address % 8))
+        elif op == BL_NODE_ASSIGN and frame[3:15] == self.uid:
+            status = Flash_HAL_ERROR if frame[15] in (BL_NODE_TO_GROUP, BL_NODE_BROADCAST) else Flash_HAL_OK
+            if status == Flash_HAL_OK:
+                self.address = frame[15]
+            self.unicast = True
+            yield from self.send_reply(bytes([status, self.address]))
+        elif op == BL_NODE_ENUM:
+            slots, seed, slot_len, flags, first, mask = struct.unpack_from('<5BQ', frame, 3)
+            if flags & BL_NODE_ENUM_RESET:
+                self.address, self.group, self.enum_slot = BL_NODE_UNASSIGNED, False, 0
+            if self.enum_slot:
+                slot = self.enum_slot - 1
+                if seed == (self.enum_seed + 1) & 0xFF and mask >> slot & 1:
+                    address = first + bin(mask & ((1 << slot) - 1)).count('1')
+                    if address != BL_NODE_UNASSIGNED and address < BL_NODE_TO_GROUP:
+                        self.address = address
+                self.enum_slot = 0
+            if not slots or slots > BL_NODE_ENUM_SLOTS_MAX or self.address != BL_NODE_UNASSIGNED:
+                return
+            # slots count byte times measured on the request, nominal ones when the clock is off by 1/16 or more
+            byte_time = 10.0 / self.line.baudrate
+            if abs(self.clock - 1.0) >= 1.0 / 16:
+                byte_time /= self.clock
+            slot = self.node_slot(seed, slots)
+            yield ('discard', self.rx_end + slot * slot_len * byte_time)
+            self.enum_slot, self.enum_seed, self.unicast = slot + 1, seed, True
+            yield from self.send_reply(self.uid)
+        elif op == BL_NODE_STATUS:
+            session = self.session
+            yield from self.send_reply(BL_NODE_STATUS_FORMAT.pack(
+                self.address, bool(session), session['status'] if session else Flash_HAL_OK,
+                session['erased_mask'] if session else 0, len(session['slots']) if session else 0,
+                self.crc_failures, *struct.unpack('<3I', self.uid)))
+        elif op == BL_NODE_DIGEST and self.unicast:
+            base, block_len, count = struct.unpack_from('<IHB', frame, 3)
+            offset = base - FLASH_SECTOR_BASE[0]
+            if (not count or count > BL_NODE_DIGESTS_MAX or not block_len or (base | block_len) & 3 or
+                    offset < 0 or offset + block_len * count > len(self.flash)):
+                yield from self.send_reply(bytes([Flash_HAL_INV_ADDR]))
+                return
+            digests = [get_flash_digest(self.flash[offset + i * block_len:offset + (i + 1) * block_len]) for i in range(count)]
+            yield from self.send_reply(bytes([Flash_HAL_OK]) + struct.pack('<{0}I'.format(count), *digests))
+
+    def handle(self, frame):
+        command = frame[1]
+        if command == COMMAND_BL_GET_VER:
+            yield from self.send_reply(bytes([SIM_VERSION]))
+        elif command == COMMAND_BL_GET_HELP:
+            yield from self.send_reply(BL_HELP_FORMAT.pack(
+                SIM_VERSION, BL_CRC_MODE_BYTE_WORD, len(FLASH_SECTOR_BASE) - 1, len(SIM_COMMANDS), SIM_RX_LEN,
+                BL_RX_RING_LEN, self.features, self.line.baudrate, SIM_WORK_BUFFER_ADDR, SIM_WORK_BUFFER_LEN,
+                *FLASH_SECTOR_BASE) + SIM_COMMANDS)
+        elif command == COMMAND_BL_GET_CID:
+            base, length = struct.unpack_from('<II', frame, 2)
+            offset = base - FLASH_SECTOR_BASE[0]
+            if not (length and not (base | length) & 3 and 0 <= offset <= len(self.flash) - length):
+                length = 0
+            digest = get_flash_digest(self.flash[offset:offset + length]) if length else 0
+            yield from self.send_reply(struct.pack('<I', SIM_IDCODE) + self.uid + struct.pack('<II', length, digest))
+        elif command == COMMAND_BL_GO_TO_ADDR:
+            self.started = True
+            yield from self.send_reply(bytes([Flash_HAL_OK]))
+        elif command == COMMAND_BL_FLASH_ERASE:
+            sector, count = frame[2], frame[3]
+            if sector == 0xFF:
+                sectors = range(len(FLASH_SECTOR_BASE) - 1)
+            else:
+                sectors = range(sector, min(sector + count, len(FLASH_SECTOR_BASE) - 1))
+            status = Flash_HAL_INV_ADDR if count > len(FLASH_SECTOR_BASE) - 1 or (sector != 0xFF and not sectors) else Flash_HAL_OK
+            if status == Flash_HAL_OK:
+                for erase_sector in sectors:
+                    yield from self.busy(self.cpu + self.erase_time(erase_sector))
+                    self.erase(erase_sector)
+            yield from self.send_reply(bytes([status]))
+        elif command == COMMAND_BL_MEM_WRITE:
+            address, length = struct.unpack_from('<IB', frame, 2)
+            if SIM_APP_BASE <= address and address + length <= FLASH_SECTOR_BASE[-1]:
+                yield from self.busy(self.cpu + self.program(address, frame[7:7 + length]))
+                status = Flash_HAL_OK
+            elif (not self.session and SIM_WORK_BUFFER_ADDR <= address and
+                    address + length <= SIM_WORK_BUFFER_ADDR + SIM_WORK_BUFFER_LEN):
+                offset = address - SIM_WORK_BUFFER_ADDR
+                self.work_buffer[offset:offset + length] = frame[7:7 + length]
+                status = Flash_HAL_OK
+            else:
+                status = Flash_HAL_INV_ADDR
+            yield from self.send_reply(bytes([status]))
+        elif command == COMMAND_BL_GET_STATS:
+            yield from self.send_reply(BL_STATS_FORMAT.pack(
+                self.frames_rx, self.bytes_programmed, self.crc_failures, self.nacks_sent, self.overruns, 0, 0, 0,
+                0, 0, 0, 0, 0, self.sector_erases, self.words_skipped, 0, 0, self.fec_codewords, self.fec_corrected,
+                self.fec_failures, 0))
+            if frame[2] & BL_STATS_CLEAR:
+                self.frames_rx = self.bytes_programmed = self.crc_failures = self.nacks_sent = 0
+                self.overruns = self.sector_erases = self.words_skipped = 0
+                self.fec_codewords = self.fec_corrected = self.fec_failures = 0
+        elif command == COMMAND_BL_SESSION_BEGIN:
+            base, length, flags = struct.unpack_from('<IIB', frame, 2)
+            yield from self.session_flush()
+            status = self.session_begin(base, length, flags)
+            yield from self.send_reply(bytes([status]))
+        elif command == COMMAND_BL_NODE:
+            yield from self.node_handle(frame)
+        elif command == COMMAND_BL_EXEC_STUB:
+            yield from self.exec_stub(frame)
+        elif command == COMMAND_BL_BENCH:
+            yield from self.bench(frame[2])
+        elif command == COMMAND_BL_STREAM:
+            yield from self.stream(frame)
+        elif command == COMMAND_BL_JOURNAL:
+            yield from self.journal_reply(struct.unpack_from('<H', frame, 2)[0])
+        elif command == COMMAND_BL_SESSION_END:
+            status = yield from self.session_flush()
+            yield from self.send_session_status(status, 0)
+            if self.session:
+                if status == BL_SESSION_RESTART:
+                    self.session['status'] = Flash_HAL_OK
+                else:
+                    self.session = None
+
+    def exec_stub(self, frame):
+        """
+        execute_stub: the header checks of bsp.c, then the stub. Thumb code does not run here,
+        every stub with a good header is answered as Stubs/stub_blank_check.c would.
+        """
+        stub_base, *args = struct.unpack_from('<5I', frame, 2)
+        offset = stub_base - SIM_WORK_BUFFER_ADDR
+        result = [0] * 4
+        stub_status = cycles = 0
+        if self.session or stub_base & 3 or not 0 <= offset <= SIM_WORK_BUFFER_LEN - BL_STUB_HEADER_FORMAT.size:
+            status = BL_STUB_BAD_ADDRESS
+        else:
+            magic, abi_version, entry, image_len = BL_STUB_HEADER_FORMAT.unpack_from(self.work_buffer, offset)
+            entry_offset = entry & ~1
+            if (magic != BL_STUB_MAGIC or abi_version != BL_STUB_ABI_VERSION or image_len < BL_STUB_HEADER_FORMAT.size or
+                    not BL_STUB_HEADER_FORMAT.size <= entry_offset < image_len):
+                status = BL_STUB_BAD_HEADER
+            elif offset + image_len > SIM_WORK_BUFFER_LEN:
+                status = BL_STUB_BAD_ADDRESS
+            else:
+                status = BL_STUB_OK
+                stub_status, result, cycles = self.blank_check(*args[:2])
+                yield from self.busy(self.cpu + cycles / SIM_SYSCLK_HZ)
+        yield from self.send_reply(BL_STUB_RESULT_FORMAT.pack(status, stub_status, cycles, *result))
+
+    def bench(self, scratch_sector):
+        """
+        bootloader_handle_bench_cmd: ACK, ping bytes for the host to echo, then the bl_bench_t of
+        execute_bench. The flash tests take the simulated erase and program times, the SRAM
+        and CRC figures are the fixed SIM_BENCH_CYCLES.
+        """
+        yield ('send', bytes([BL_ACK, SIM_BENCH_PING_LEN + BL_BENCH_FORMAT.size]))
+        ping = bytes(range(0xB0, 0xB0 + SIM_BENCH_PING_LEN))
+        ping_start = self.cpu
+        yield ('send', ping)
+        echo = yield from self.read(SIM_BENCH_PING_LEN, 0.1)
+        rtt_cycles = round((self.cpu - ping_start) * SIM_SYSCLK_HZ) if echo == ping else 0
+
+        bench = dict(SIM_BENCH_LENS, sysclk_hz=SIM_SYSCLK_HZ, scratch_sector=scratch_sector, status=Flash_HAL_OK,
+                     ping_len=SIM_BENCH_PING_LEN, uart_rtt_cycles=rtt_cycles, erase_cycles=0, program_word_cycles=0,
+                     program_byte_cycles=0, crc_byte_cycles=0, crc_word_cycles=0, memcpy_cycles=0)
+        if self.session:
+            bench['status'] = Flash_HAL_BUSY  # the work buffer holds the session queue
+        else:
+            bench.update(SIM_BENCH_CYCLES)
+            if scratch_sector < len(FLASH_SECTOR_BASE) - 1 and FLASH_SECTOR_BASE[scratch_sector] >= SIM_APP_BASE:
+                base = FLASH_SECTOR_BASE[scratch_sector]
+                erase_time = self.erase_time(scratch_sector)
+                self.erase(scratch_sector)
+                word_time = self.program(base, bytes(i & 0xFF for i in range(SIM_BENCH_LENS['program_len'])))
+                byte_time = SIM_BENCH_LENS['byte_len'] * SIM_WORD_PROGRAM_TIME * self.flash_time
+                self.erase(scratch_sector)
+                yield from self.busy(self.cpu + 2 * erase_time + word_time + byte_time)
+                bench.update(erase_cycles=round(erase_time * SIM_SYSCLK_HZ),
+                             program_word_cycles=round(word_time * SIM_SYSCLK_HZ),
+                             program_byte_cycles=round(byte_time * SIM_SYSCLK_HZ))
+        yield ('send', BL_BENCH_FORMAT.pack(*(bench[field] for field in host.BenchResult._fields)))
+
+    def blank_check(self, base, length):
+        """stub_blank_check on the simulated flash. Returns (return value, result[], cycles)."""
+        offset = base - FLASH_SECTOR_BASE[0]
+        if (base | length) & 3 or not length or not 0 <= offset <= len(self.flash) - length:
+            return 2, [0] * 4, SIM_STUB_CALL_CYCLES
+        data = self.flash[offset:offset + length]
+        dirty = [i for i in range(0, length, 4) if data[i:i + 4] != b'\xff\xff\xff\xff']
+        scan_cycles = length // 4 * SIM_STUB_SCAN_CYCLES
+        result = [base + dirty[0] if dirty else 0xFFFFFFFF, len(dirty), get_flash_digest(data), scan_cycles]
+        return (1 if dirty else 0), result, SIM_STUB_CALL_CYCLES + scan_cycles + length // 4 * SIM_STUB_DIGEST_CYCLES
+
+    # Flash and write session, bootloader_session_pump and the flash engine of bsp.c
+
+    def sector_of(self, address):
+        for sector in range(len(FLASH_SECTOR_BASE) - 1):
+            if FLASH_SECTOR_BASE[sector] <= address < FLASH_SECTOR_BASE[sector + 1]:
+                return sector
+        return BL_SECTOR_NONE
+
+    def erase_time(self, sector):
+        return SIM_ERASE_TIME[FLASH_SECTOR_BASE[sector + 1] - FLASH_SECTOR_BASE[sector]] * self.flash_time
+
+    def erase(self, sector):
+        start, end = (base - FLASH_SECTOR_BASE[0] for base in FLASH_SECTOR_BASE[sector:sector + 2])
+        self.flash[start:end] = b'\xff' * (end - start)
+        self.sector_erases += 1
+
+    def program(self, address, data):
+        """Program data over the flash, 1->0 only as the cells do. Returns the time it took."""
+        offset = address - FLASH_SECTOR_BASE[0]
+        current = self.flash[offset:offset + len(data)]
+        words = sum(1 for i in range(0, len(data), 4) if current[i:i + 4] != data[i:i + 4])
+        self.words_skipped += -(-len(data) // 4) - words
+        self.flash[offset:offset + len(data)] = bytes(a & b for a, b in zip(current, data))
+        self.bytes_programmed += len(data)
+        return words * SIM_WORD_PROGRAM_TIME * self.flash_time
+
+    def session_begin(self, base, length, flags):
+        first, last = self.sector_of(base), self.sector_of(base + length - 1)
+        self.session = None
+        if not length or base < SIM_APP_BASE or BL_SECTOR_NONE in (first, last):
+            return Flash_HAL_INV_ADDR
+        if not flags & SIM_SESSION_JOURNAL:
+            self.journal = None  # other writes are not journaled
+        self.session = dict(base=base, length=length, flags=flags, status=Flash_HAL_OK, first=first, last=last,
+                            erased_mask=0, programmed_mask=0, slots=collections.deque(), erase_sector=None,
+                            erase_end=0.0, restart_address=0, journal_next=base)
+        self.engine_time = self.cpu
+        return Flash_HAL_OK
+
+    def session_owns(self, frame):
+        session = self.session
+        if not session or frame[1] != COMMAND_BL_MEM_WRITE:
+            return False
+        address, length = struct.unpack_from('<IB', frame, 2)
+        return session['base'] <= address and address + length <= session['base'] + session['length']
+
+    def session_write(self, frame):
+        session = self.session
+        address, length = struct.unpack_from('<IB', frame, 2)
+        yield from self.session_queue(address, frame[7:7 + length])
+        credit = self.session_credit(SIM_RX_LEN, SIM_RX_LEN)
+        if not self.features & BL_FEATURE_CREDITS:
+            credit = 0  # a bootloader from before the credits
+        yield from self.send_session_status(session['status'], credit)
+        if session['status'] == BL_SESSION_RESTART:
+            session['status'] = Flash_HAL_OK
+
+    def session_queue(self, address, data):
+        """bootloader_session_queue: data in slots, waiting for the flash engine while the queue is full."""
+        session = self.session
+        for offset in range(0, len(data), SIM_SESSION_SLOT_LEN):
+            if session['status'] != Flash_HAL_OK:
+                break
+            while len(session['slots']) == SIM_SESSION_SLOTS:
+                yield from self.busy(self.engine_next())
+                self.engine_run(self.cpu)
+            session['slots'].append((address + offset, data[offset:offset + SIM_SESSION_SLOT_LEN]))
+
+    def session_credit(self, unit_len, wire_len):
+        """bootloader_session_credit: units the host may send beyond the one just answered."""
+        slots_per_unit = -(-unit_len // SIM_SESSION_SLOT_LEN)
+        credit = (SIM_SESSION_SLOTS - len(self.session['slots'])) // slots_per_unit + 1 + BL_RX_RING_LEN // wire_len
+        return min(credit, 0xFFFF)
+
+    def stream(self, frame):
+        """
+        bootloader_handle_stream_cmd and bootloader_stream_receive: a session over the range,
+        then raw blocks with their CRC, Reed-Solomon coded when parity is set, and one
+        checkpoint reply per block, journaled so that a BL_SESSION_RESUME can continue it.
+        """
+        base, length, block_len, flags = struct.unpack_from('<IIHB', frame, 2)
+        parity, image_id = struct.unpack_from('<BI', frame, 13) if frame[0] > 16 else (0, 0)
+        if (not BL_STREAM_BLOCK_MIN <= block_len <= BL_STREAM_BLOCK_MAX or
+                parity and not FEC_PARITY_MIN <= parity <= FEC_PARITY_MAX):
+            status = Flash_HAL_ERROR
+        elif flags & BL_SESSION_RESUME and not self.journal_matches(base, length, image_id):
+            status = BL_JOURNAL_MISMATCH
+        else:
+            yield from self.session_flush()
+            status = self.session_begin(base, length, flags & BL_SESSION_LAZY_ERASE | SIM_SESSION_JOURNAL)
+            if status == Flash_HAL_OK:
+                self.journal_open(base, length, image_id, flags & BL_SESSION_RESUME)
+        wire_len = host.stream_wire_len(block_len, parity)
+        yield from self.send_reply(BL_STREAM_FORMAT.pack(status, 0, self.session_credit(block_len, wire_len) if self.session else 0))
+        if status != Flash_HAL_OK:
+            return
+        offset = 0
+        while status in (Flash_HAL_OK, BL_STREAM_ROLLBACK) and offset < length:
+            data_len = min(block_len, length - offset)
+            block = yield from self.stream_read_block(data_len + 4, parity)
+            if not block:
+                return  # host gone, the session stays open for BL_SESSION_END
+            self.frames_rx += 1
+            self.engine_run(self.cpu)
+            if len(block) < data_len + 4 or get_crc(block, data_len) != struct.unpack_from('<I', block, data_len)[0]:
+                status = BL_STREAM_ROLLBACK
+            else:
+                yield from self.session_queue(base + offset, block[:data_len])
+                offset += data_len
+                status = self.session['status']
+            yield from self.send_reply(BL_STREAM_FORMAT.pack(status, offset, self.session_credit(block_len, wire_len)))
+            if status == BL_STREAM_ROLLBACK and len(block) == data_len + 4:
+                # bootloader_stream_resync: drop the blocks in flight until the line is idle
+                while (yield ('read', BL_STREAM_GAP_MS / 1000.0)) is not None:
+                    pass
+
+    def stream_read_block(self, length, parity):
+        """
+        bootloader_stream_read_block: length bytes of a block, the first within
+        BL_STREAM_TIMEOUT_MS and the rest without a gap of BL_STREAM_GAP_MS. With parity every
+        codeword is repaired as it arrives. Returns what was received up to the first gap.
+        """
+        chunk_max = FEC_CODEWORD_LEN - parity if parity else length
+        timeout = BL_STREAM_TIMEOUT_MS / 1000.0
+        block = bytearray()
+        while len(block) < length:
+            chunk = min(length - len(block), chunk_max)
+            codeword = yield from self.read(1, timeout)
+            if not codeword:
+                break
+            timeout = BL_STREAM_GAP_MS / 1000.0
+            codeword += yield from self.read(chunk + parity - 1, timeout)
+            if len(codeword) < chunk + parity:
+                break
+            if parity:
+                codeword = bytearray(codeword)
+                yield from self.busy(self.cpu + len(codeword) * parity * SIM_FEC_SYNDROME_CYCLES / SIM_SYSCLK_HZ)
+                corrected = fec_decode(codeword, parity)
+                if corrected > 0:
+                    self.fec_codewords += 1
+                    self.fec_corrected += corrected
+                elif corrected < 0:
+                    self.fec_failures += 1
+            block += codeword[:chunk]
+        return bytes(block)
+
+    def journal_reply(self, first_block):
+        """bootloader_handle_journal_cmd: the journal header and the block CRCs from first_block."""
+        journal = self.journal
+        if journal is None:
+            yield from self.send_reply(BL_JOURNAL_FORMAT.pack(BL_JOURNAL_EMPTY, 0, SIM_JOURNAL_BLOCK_LEN, 0, 0, 0, 0,
+                                                              first_block, 0))
+            return
+        block_crcs = journal['block_crc'][first_block:first_block + SIM_JOURNAL_REPLY_CRCS]
+        yield from self.send_reply(BL_JOURNAL_FORMAT.pack(
+            Flash_HAL_OK, journal['erased_mask'], SIM_JOURNAL_BLOCK_LEN, journal['image_id'], journal['base'],
+            journal['length'], journal['verified'], first_block, len(block_crcs)) +
+            struct.pack('<{0}I'.format(len(block_crcs)), *block_crcs))
+
+    def journal_matches(self, base, length, image_id):
+        """bootloader_journal_matches: base on a block boundary within the verified data, same image and end."""
+        journal = self.journal
+        return (journal is not None and journal['image_id'] == image_id and
+                0 <= base - journal['base'] <= journal['verified'] and
+                (base - journal['base']) % SIM_JOURNAL_BLOCK_LEN == 0 and
+                base + length == journal['base'] + journal['length'])
+
+    def journal_open(self, base, length, image_id, resume):
+        """bootloader_journal_open: a new image resets the journal, a resume keeps its erased sectors."""
+        if resume:
+            self.journal['verified'] = base - self.journal['base']
+            del self.journal['block_crc'][self.journal['verified'] // SIM_JOURNAL_BLOCK_LEN:]
+            self.session['erased_mask'] = self.journal['erased_mask']
+        else:
+            self.journal = dict(image_id=image_id, base=base, length=length, verified=0, erased_mask=0, block_crc=[])
+
+    def journal_advance(self, end):
+        """bootloader_journal_advance: the CRC of every journal block programmed up to end, returns the time taken."""
+        journal = self.journal
+        done = end - journal['base']
+        self.session['journal_next'] = end
+        cycles = 0
+        while journal['verified'] < done:
+            block_len = min(journal['length'] - journal['verified'], SIM_JOURNAL_BLOCK_LEN)
+            if journal['verified'] + block_len > done:
+                break
+            offset = journal['base'] + journal['verified'] - FLASH_SECTOR_BASE[0]
+            journal['block_crc'].append(get_flash_digest(self.flash[offset:offset + block_len]))
+            journal['verified'] += block_len
+            cycles += block_len // 4 * SIM_STUB_DIGEST_CYCLES
+        return cycles / SIM_SYSCLK_HZ
+
+    def send_session_status(self, status, credit):
+        if status == BL_SESSION_RESTART:
+            yield from self.send_reply(struct.pack('<BI', status, self.session['restart_address']))
+        elif credit:
+            yield from self.send_reply(struct.pack('<BH', status, credit))
+        else:
+            yield from self.send_reply(bytes([status]))
+
+    def session_flush(self):
+        """bootloader_session_flush: program everything queued, with a full erase the whole range."""
+        while self.session and not self.session_done():
+            yield from self.busy(self.engine_next())
+            self.engine_run(self.cpu)
+        return self.session['status'] if self.session else Flash_HAL_OK
+
+    def session_done(self):
+        session = self.session
+        if session['slots'] or session['erase_sector'] is not None:
+            return False
+        range_mask = ((1 << (session['last'] + 1)) - 1) & ~((1 << session['first']) - 1)
+        return (session['status'] != Flash_HAL_OK or session['flags'] & (BL_SESSION_LAZY_ERASE | BL_SESSION_COMPARE) or
+                session['erased_mask'] & range_mask == range_mask)
+
+    def engine_next(self):
+        """Time the flash engine finishes its next step."""
+        session = self.session
+        if session['erase_sector'] is not None:
+            return session['erase_end']
+        return max(self.engine_time, self.cpu)
+
+    def engine_run(self, now):
+        """Run the flash engine of the open session up to now, one pump step after the other."""
+        session = self.session
+        while session:
+            if session['erase_sector'] is not None:
+                if session['erase_end'] > now:
+                    return
+                self.erase(session['erase_sector'])
+                session['erased_mask'] |= 1 << session['erase_sector']
+                if session['flags'] & SIM_SESSION_JOURNAL:
+                    self.journal['erased_mask'] = session['erased_mask']
+                self.engine_time = session['erase_end']
+                session['erase_sector'] = None
+                continue
+            if self.engine_time > now:
+                return
+            sector = None
+            if session['slots']:
+                address, data = session['slots'][0]
+                last = self.sector_of(address + len(data) - 1)
+                sector = self.sector_of(address)
+                while sector <= last and session['erased_mask'] & (1 << sector):
+                    sector += 1
+                if sector <= last and session['status'] == Flash_HAL_OK and session['flags'] & BL_SESSION_COMPARE:
+                    offset = address - FLASH_SECTOR_BASE[0]
+                    if all(a & b == b for a, b in zip(self.flash[offset:offset + len(data)], data)):
+                        # equal or 1->0 changes only, programmed in place without erasing
+                        for in_place in range(sector, last + 1):
+                            if not session['erased_mask'] & (1 << in_place):
+                                session['programmed_mask'] |= 1 << in_place
+                        sector = last + 1
+                    elif session['programmed_mask'] & (1 << sector):
+                        # the erase loses what was programmed in place, the host resends from the sector start
+                        session['status'] = BL_SESSION_RESTART
+                        session['restart_address'] = max(FLASH_SECTOR_BASE[sector], session['base'])
+                        session['programmed_mask'] &= ~(1 << sector)
+                        session['slots'].clear()
+                if session['slots'] and (sector > last or session['status'] != Flash_HAL_OK):
+                    if session['status'] == Flash_HAL_OK:
+                        self.engine_time += self.program(address, data)
+                        if session['flags'] & SIM_SESSION_JOURNAL and address == session['journal_next']:
+                            # read back before the journal vouches for it, a resume skips this data
+                            offset = address - FLASH_SECTOR_BASE[0]
+                            if self.flash[offset:offset + len(data)] != data:
+                                session['status'] = Flash_HAL_ERROR
+                            else:
+                                self.engine_time += self.journal_advance(address + len(data))
+                    session['slots'].popleft()
+                    continue
+            elif session['status'] == Flash_HAL_OK and not session['flags'] & (BL_SESSION_LAZY_ERASE | BL_SESSION_COMPARE):
+                sector = session['first']
+                while sector <= session['last'] and session['erased_mask'] & (1 << sector):
+                    sector += 1
+                if sector > session['last']:
+                    sector = None
+            if sector is None:
+                # nothing to do until the parser queues more
+                self.engine_time = now
+                return
+            session['erase_sector'] = sector
+            session['erase_end'] = self.engine_time + self.erase_time(sector)
+
+class SimulatedLine:
+    """
+    The serial port of a "sim:" port name: one or more SimulatedNode behind a line that
+    carries the bytes at the baud rate. A half duplex line is a bus, where the bytes of two
+    senders that overlap are garbled for everyone. Everything runs in the thread that uses the port,
+    whenever the host reads, writes or waits the simulation is brought up to the present,
+    so the device answers in real time. It supports what the host uses of serial.Serial.
+    """
+    def __init__(self, port, baudrate=BL_BAUD_RATE, timeout=None, write_timeout=None):
+        self.port = port
+        self.baudrate = baudrate
+        self.timeout = timeout
+        self.write_timeout = write_timeout
+        self.is_open = True
+        self.nodes = []
+        self.events = []
+        self.sequence = 0
+        self.host_free = 0.0
+        self.bytes_written = 0
+        self.received = bytearray()
+        self.half_duplex = False
+        self.transmissions = []
+        self.now = 0.0
+        self.lock = threading.RLock()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def schedule(self, at, action, *args):
+        self.sequence += 1
+        heapq.heappush(self.events, (at, self.sequence, action, args))
+
+    def transmit(self, sender, data, start, clock=1.0):
+        """
+        Put data on the line from start on, at the baud rate of a sender whose clock runs that
+        much fast. Returns the time its last byte ends.
+        """
+        byte_time = 10.0 / (self.baudrate * clock)
+        for index, byte in enumerate(data):
+            self.schedule(start + (index + 1) * byte_time, self.deliver, sender, byte)
+        end = start + len(data) * byte_time
+        # the ones over before the byte on the line now can not overlap anything any more
+        self.transmissions = [t for t in self.transmissions if t[1] > self.now - byte_time] + [(start, end, sender)]
+        return end
+
+    def deliver(self, sender, byte, at):
+        byte_start = at - 10.0 / self.baudrate
+        if self.half_duplex and any(other is not sender and start < at and end > byte_start
+                                    for start, end, other in self.transmissions):
+            byte ^= 0x55    # collision
+        if sender is not None:
+            self.received.append(byte)
+        for node in self.nodes:
+            if node is not sender:
+                node.receive(byte, at)
+
+    def advance(self):
+        now = time.perf_counter()
+        while self.events and self.events[0][0] <= now:
+            at, _, action, args = heapq.heappop(self.events)
+            self.now = at
+            action(*args, at)
+        return now
+
+    def write(self, data):
+        with self.lock:
+            now = self.advance()
+            self.host_free = self.transmit(None, bytes(data), max(now, self.host_free))
+            self.bytes_written += len(data)
+        return len(data)
+
+    def flush(self):
+        time.sleep(max(0.0, self.host_free - time.perf_counter()))
+        with self.lock:
+            self.advance()
+
+    @property
+    def in_waiting(self):
+        with self.lock:
+            self.advance()
+            return len(self.received)
+
+    def read(self, size=1):
+        deadline = None if self.timeout is None else time.perf_counter() + self.timeout
+        while True:
+            with self.lock:
+                now = self.advance()
+                if len(self.received) >= size or (deadline is not None and now >= deadline):
+                    data = bytes(self.received[:size])
+                    del self.received[:size]
+                    return data
+                wait = min(self.events[0][0] - now, SIM_POLL) if self.events else SIM_POLL
+            if deadline is not None:
+                wait = min(wait, deadline - now)
+            time.sleep(max(0.0, wait))
+
+    def reset_input_buffer(self):
+        with self.lock:
+            self.advance()
+            self.received.clear()
+
+    def close(self):
+        self.is_open = False
+
+def open_simulated_port(port, baudrate, **settings):
+    """
+    SimulatedLine of a port name sim:NAME[,OPTION...] with one bootloader behind it, its UID
+    derived from NAME. Options: flash=FACTOR scales the flash times, nocredit makes it a
+    bootloader without receive credits, flashparser one whose parser runs from flash and
+    stops during erases, silent leaves the line without a bootloader,
+    nodes=N puts N of them on the line as a bus, with UIDs from one lot and clocks within
+    SIM_BUS_CLOCK_SKEW, and ber=RATE flips received bits at that rate.
+    """
+    name, *options = port[4:].split(',')
+    options = dict(option.partition('=')[::2] for option in options)
+    line = SimulatedLine(port, baudrate, **settings)
+    if 'silent' in options:
+        return line
+    features = SIM_FEATURES & ~BL_FEATURE_CREDITS if 'nocredit' in options else SIM_FEATURES
+    lot = zlib.crc32(name.encode())
+    line.half_duplex = 'nodes' in options
+    for index in range(int(options.get('nodes', 1))):
+        # wafer X/Y in the first word, wafer number and lot in the other two
+        uid = struct.pack('<3I', zlib.crc32(struct.pack('<II', lot, index)), lot & 0xFFFF00FF | (index // 400) << 8, lot)
+        node = SimulatedNode(line, uid, float(options.get('flash', 1.0)), lot + index, features)
+        node.ber = float(options.get('ber', 0.0))
+        node.flash_parser = 'flashparser' in options
+        if line.half_duplex:
+            node.clock += random.Random(uid).uniform(-SIM_BUS_CLOCK_SKEW, SIM_BUS_CLOCK_SKEW)
+        line.nodes.append(node)
+    return line
+
+def simulated_session_write(port, baudrate, image, window=None):
+    """
+    Flash image to the simulated bootloader of port through a write session, window frames
+    in flight from the start when given instead of what BL_GET_HELP allows. Returns (ret, node).
+    """
+    host.ser = open_serial_port(port, baudrate, timeout=2)
+    host.app_image = image
+    host.decode_menu_command_code(8)
+    host.apply_transfer_mode(host.device_caps)
+    if window:
+        host.pipeline_window = window
+    ret = host.decode_menu_command_code(6, image.base, len(image.data), 0)
+    if ret == 0:
+        ret = host.decode_menu_command_code(4, image.base)
+    if ret == 0:
+        ret = host.decode_menu_command_code(7)
+    host.ser.close()
+    return ret, host.ser.nodes[0]
+
+def simulated_update(port, baudrate, image, erase=None, flags=0, sparse=1, flash=b''):
+    """
+    Flash image to the simulated bootloader of port as automate_process_flow does: BL_FLASH_ERASE
+    of the (first sector, count) in erase and then MEM_WRITE, or a write session with flags
+    when erase is None. flash is what the flash holds from APP_BASE_ADDRESS on beforehand.
+    Returns (ret, node, seconds, bytes the host sent) from the first erase or session request on.
+    """
+    host.ser = open_serial_port(port, baudrate, timeout=2)
+    node = host.ser.nodes[0]
+    offset = APP_BASE_ADDRESS - FLASH_SECTOR_BASE[0]
+    node.flash[offset:offset + len(flash)] = flash
+    host.app_image = image
+    host.use_write_session, host.session_flags, host.sparse_upload = int(erase is None), flags, sparse
+    host.decode_menu_command_code(8)
+    host.apply_transfer_mode(host.device_caps)
+    start, bytes_before = time.perf_counter(), host.ser.bytes_written
+    if erase:
+        ret = host.decode_menu_command_code(3, *erase)
+        if ret == 0:
+            ret = host.decode_menu_command_code(4, image.base)
+    else:
+        ret = host.decode_menu_command_code(6, image.base, len(image.data), host.session_flags)
+        if ret == 0:
+            ret = host.decode_menu_command_code(4, image.base)
+        if ret == 0:
+            ret = host.decode_menu_command_code(7)
+        while ret == 0 and host.session_restart_address is not None:
+            ret = host.decode_menu_command_code(4, image.base, host.session_restart_address - image.base)
+            if ret == 0:
+                ret = host.decode_menu_command_code(7)
+    elapsed = time.perf_counter() - start
+    host.ser.close()
+    return ret, node, elapsed, host.ser.bytes_written - bytes_before
+
+def image_intact(node, image):
+    """True when the simulated flash of node holds image."""
+    offset = image.base - FLASH_SECTOR_BASE[0]
+    return node.flash[offset:offset + len(image.data)] == image.data
+
+def bus_selftest(node_count=8, lossy=2):
+    """
+    Flash a random image into node_count simulated nodes on one bus with run_bus_update, the
+    last lossy of them with bit errors on what they receive. Every node must end up with the
+    image and started, the lossy ones through the blocks resent to them alone.
+    """
+    data = random.Random(node_count).randbytes(BUS_SELFTEST_IMAGE_LEN)
+    host.app_image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, len(data))], APP_BASE_ADDRESS | 1)
+    host.ser = open_serial_port('sim:bus,nodes={0}'.format(node_count), BL_BAUD_RATE, timeout=2)
+    nodes = host.ser.nodes
+    for node in nodes[len(nodes) - lossy:]:
+        node.ber = BUS_SELFTEST_LOSSY_BER
+    host.verbose_mode = 0
+    start = time.perf_counter()
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        host.run_bus_update([node.uid.hex() for node in nodes])
+        sys.stdout = sys.__stdout__
+    elapsed = time.perf_counter() - start
+    host.ser.close()
+
+    print("\n   Bus update, {0} byte image to {1} nodes at {2} baud, {3} of them at BER {4:g}".format(
+        len(data), len(nodes), BL_BAUD_RATE, lossy, BUS_SELFTEST_LOSSY_BER))
+    offset = APP_BASE_ADDRESS - FLASH_SECTOR_BASE[0]
+    failed = 0
+    for address, node in enumerate(nodes, 1):
+        intact = node.flash[offset:offset + len(data)] == data
+        resent = host.bus_resent.get(address, 0)
+        ok = intact and node.started and node.address == address and (resent > 0) == (node.ber > 0)
+        failed += not ok
+        print("   node {0:<3} {1:<24} BER {2:<6g} image {3:<8} {4:<11} {5:7} bytes resent  {6}".format(
+            address, node.uid.hex(), node.ber, "OK" if intact else "DIFFERS", "started" if node.started else "not started",
+            resent, "ok" if ok else "FAIL"))
+    print("\n   Bus update: {0} of {1} nodes as expected in {2:.2f} s".format(len(nodes) - failed, len(nodes), elapsed))
+    return -1 if failed else 0
+
+def enum_selftest(node_counts=ENUM_SELFTEST_NODES, trials=ENUM_SELFTEST_TRIALS):
+    """
+    Enumerate simulated buses of each node count with bus_enumerate, trials times over UIDs
+    of another lot. Every node must be found once and hold the address its UID got.
+    """
+    host.verbose_mode = 0
+    failed = 0
+    print("\n   Bus enumeration at {0} baud, clocks within {1:g} %".format(BL_BAUD_RATE, SIM_BUS_CLOCK_SKEW * 100))
+    for node_count in node_counts:
+        for trial in range(trials):
+            host.ser = open_serial_port('sim:lot{0},nodes={1}'.format(trial, node_count), BL_BAUD_RATE, timeout=2)
+            start = time.perf_counter()
+            with open(os.devnull, 'w') as quiet:
+                sys.stdout = quiet
+                uids = host.bus_enumerate()
+                sys.stdout = sys.__stdout__
+            elapsed = time.perf_counter() - start
+            host.ser.close()
+            # every node got each BL_NODE_ENUM request, nothing else was sent
+            rounds = host.ser.nodes[0].frames_rx
+            addresses = {node.uid.hex(): node.address for node in host.ser.nodes}
+            ok = (len(uids) == node_count and set(uids) == set(addresses) and
+                  all(addresses[uid] == address for address, uid in enumerate(uids, 1)))
+            failed += not ok
+            print("   {0:>3} nodes, lot {1}: {2:>3} found in {3:4.0f} ms, {4:>2} rounds  {5}".format(
+                node_count, trial, len(uids), elapsed * 1000, rounds, "ok" if ok else "FAIL"))
+    runs = len(node_counts) * trials
+    print("\n   Bus enumeration: {0} of {1} runs as expected".format(runs - failed, runs))
+    return -1 if failed else 0
+
+# name, port, frames in flight, overruns expected
+CREDIT_SELFTEST_CASES = [
+    ("credits, flash x1",          "sim:credit",                 None, False),
+    ("credits, flash x4",          "sim:credit,flash=4",         None, False),
+    ("fixed 16 frames, flash x4",  "sim:credit,flash=4,nocredit", 16,  True),
+]
+
+def credit_selftest(image_len=256 * 1024, baudrate=921600):
+    """
+    Flash a random image through a write session to a simulated bootloader whose flash is
+    slowed down, once with receive credits and once with a fixed window as before them. The
+    credits must keep its receive ring from overrunning while a sector erase fills the queue.
+    """
+    data = random.Random(image_len).randbytes(image_len)
+    image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+    results = []
+    host.verbose_mode = 0
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for name, port, window, overrun_expected in CREDIT_SELFTEST_CASES:
+            start = time.perf_counter()
+            ret, node = simulated_session_write(port, baudrate, image, window)
+            offset = APP_BASE_ADDRESS - FLASH_SECTOR_BASE[0]
+            intact = ret == 0 and node.flash[offset:offset + image_len] == data
+            results.append((name, ret, intact, node, time.perf_counter() - start, overrun_expected))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Receive credits, {0} byte image at {1} baud".format(image_len, baudrate))
+    failed = 0
+    for name, ret, intact, node, elapsed, overrun_expected in results:
+        ok = (node.overruns > 0) == overrun_expected and (intact or overrun_expected)
+        failed += not ok
+        print("   {0:<26} {1:>6} bytes overrun  ring peak {2:>3}  {3:6.2f} s  image {4:<8} {5}".format(
+            name, node.overruns, node.ring_peak, elapsed, "OK" if intact else "FAILED", "ok" if ok else "FAIL"))
+    print("\n   Receive credits: {0} of {1} cases as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# name, entry of the stub header, flash address, length, (status, stub return) expected
+STUB_SELFTEST_CASES = [
+    ("blank sector",       0x11, 0x08060000, 0x20000, (BL_STUB_OK, 0)),
+    ("programmed range",   0x11, APP_BASE_ADDRESS, 0x4000, (BL_STUB_OK, 1)),
+    ("unaligned range",    0x11, APP_BASE_ADDRESS + 2, 0x100, (BL_STUB_OK, 2)),
+    ("entry in the header", 0x01, APP_BASE_ADDRESS, 0x100, (BL_STUB_BAD_HEADER, 0)),
+]
+
+def stub_selftest():
+    """
+    Run --exec-stub (run_stub) against a simulated bootloader that answers as the blank check
+    stub, on flash that is partly programmed. The BL_EXEC_STUB reply the host parsed must hold
+    what the stub returns for that flash.
+    """
+    pattern = random.Random(0).randbytes(0x1000)
+    results = []
+    host.verbose_mode = 0
+    host.ser = open_serial_port('sim:stub', BL_BAUD_RATE, timeout=2)
+    node = host.ser.nodes[0]
+    offset = APP_BASE_ADDRESS - FLASH_SECTOR_BASE[0] + 0x800
+    node.flash[offset:offset + len(pattern)] = pattern
+    for name, entry, base, length, expected in STUB_SELFTEST_CASES:
+        # Header and body of a stub image, the body is never run
+        stub = BL_STUB_HEADER_FORMAT.pack(BL_STUB_MAGIC, BL_STUB_ABI_VERSION, entry, 0x100) + bytes(0x100 - 16)
+        with tempfile.NamedTemporaryFile(suffix='.bin', delete=False) as stub_file:
+            stub_file.write(stub)
+        host.stub_result = None
+        with open(os.devnull, 'w') as quiet:
+            sys.stdout = quiet
+            ret = host.run_stub(stub_file.name, [base, length])
+            sys.stdout = sys.__stdout__
+        os.unlink(stub_file.name)
+        results.append((name, base, length, expected, ret, host.stub_result, node.blank_check(base, length)))
+    host.ser.close()
+
+    print("\n   BL_EXEC_STUB with the blank check stub at {0} baud".format(BL_BAUD_RATE))
+    failed = 0
+    for name, base, length, expected, ret, reply, (stub_status, result, _) in results:
+        ok = reply is not None and (reply.status, reply.stub_status) == expected
+        if ok and reply.status == BL_STUB_OK:
+            ok = reply.result == result and ret == 0 and reply.cycles > 0
+        failed += not ok
+        print("   {0:<20} {1:#010x} {2:>6} bytes  status {3:<11} returned {4}  first {5:#010x}  {6:>4} words  {7}".format(
+            name, base, length, host.BL_STUB_STATUS.get(reply.status, hex(reply.status)) if reply else "none",
+            reply.stub_status if reply else "-", reply.result[0] if reply else 0, reply.result[1] if reply else 0,
+            "ok" if ok else "FAIL"))
+    print("\n   BL_EXEC_STUB: {0} of {1} cases as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# scratch sector of each BL_BENCH run, the first is a bootloader sector execute_bench skips
+BENCH_SELFTEST_SECTORS = [1, 7, BL_SECTOR_NONE]
+
+def bench_selftest():
+    """
+    Run --bench (run_bench) against a simulated bootloader once per BENCH_SELFTEST_SECTORS into
+    a new archive, then print it with --bench-report (print_bench_archive). The archive must
+    hold the bl_bench_t the simulator sent, and its report must match the live one.
+    """
+    with tempfile.NamedTemporaryFile(suffix='.jsonl', delete=False) as archive_file:
+        archive_path = archive_file.name
+    host.verbose_mode = 0
+    host.ser = open_serial_port('sim:bench', BL_BAUD_RATE, timeout=2)
+    node = host.ser.nodes[0]
+    live = []
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for sector in BENCH_SELFTEST_SECTORS:
+            host.bench_result = None
+            ret = host.run_bench(sector, archive_path)
+            live.append((ret, host.bench_result))
+        sys.stdout = sys.__stdout__
+    host.ser.close()
+    report = io.StringIO()
+    sys.stdout = report
+    host.print_bench_archive(archive_path)
+    sys.stdout = sys.__stdout__
+    with open(archive_path) as archive:
+        records = [json.loads(line) for line in archive if line.strip()]
+    os.unlink(archive_path)
+
+    print("\n   BL_BENCH on a simulated bootloader at {0} baud".format(BL_BAUD_RATE))
+    failed = 0
+    for sector, (ret, bench), record in zip(BENCH_SELFTEST_SECTORS, live, records + [None] * len(live)):
+        flash_tested = sector in range(len(FLASH_SECTOR_BASE) - 1) and FLASH_SECTOR_BASE[sector] >= SIM_APP_BASE
+        ok = (ret == 0 and bench is not None and record is not None and
+              all(record[field] == value for field, value in bench._asdict().items()) and
+              record['uid'] == node.uid.hex() and bench.uart_rtt_cycles > 0 and bench.crc_word_cycles > 0 and
+              (bench.erase_cycles > 0) == flash_tested)
+        failed += not ok
+        print("   sector {0:<4} erase {1:>9} cycles  word program {2:>7} cycles  round trip {3:>7} cycles  {4}".format(
+            "none" if sector == BL_SECTOR_NONE else sector, bench.erase_cycles if bench else 0,
+            bench.program_word_cycles if bench else 0, bench.uart_rtt_cycles if bench else 0, "ok" if ok else "FAIL"))
+    expected = "".join("\n" + "\n".join(host.format_bench_report(bench)) + "\n" for _, bench in live if bench)
+    # the report heads each run with its time, board and port, the rest is the live report
+    headers = tuple("   " + record['time'] for record in records)
+    reported = "".join(line + "\n" for line in report.getvalue().splitlines() if not line.startswith(headers))
+    same = len(records) == len(live) and reported == expected
+    failed += not same
+    print("   archive of {0} runs, report {1}".format(len(records), "matches the live runs" if same else "DIFFERS"))
+    print("\n   BL_BENCH: {0} of {1} checks as expected".format(len(live) + 1 - failed, len(live) + 1))
+    return -1 if failed else 0
+
+# name, port, overruns expected
+ERASE_RX_SELFTEST_CASES = [
+    ("parser in SRAM",   "sim:erase_rx",             False),
+    ("parser in flash",  "sim:erase_rx,flashparser", True),
+]
+
+def erase_rx_selftest(image_len=256 * 1024, baudrate=921600):
+    """
+    Flash a random image through a write session while the bootloader erases its sectors in
+    the background, with the parser in SRAM as bsp.c places it and with a parser that stops
+    while the flash is busy. Bytes received during an erase must reach the parser without
+    an overrun of the receive ring only in the first case.
+    """
+    data = random.Random(image_len).randbytes(image_len)
+    image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+    results = []
+    host.verbose_mode = 0
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for name, port, overrun_expected in ERASE_RX_SELFTEST_CASES:
+            start = time.perf_counter()
+            ret, node = simulated_session_write(port, baudrate, image)
+            offset = APP_BASE_ADDRESS - FLASH_SECTOR_BASE[0]
+            intact = ret == 0 and node.flash[offset:offset + image_len] == data
+            results.append((name, intact, node, time.perf_counter() - start, overrun_expected))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Reception during sector erases, {0} byte image at {1} baud".format(image_len, baudrate))
+    failed = 0
+    for name, intact, node, elapsed, overrun_expected in results:
+        ok = (node.overruns > 0) == overrun_expected and (intact or overrun_expected)
+        failed += not ok
+        print("   {0:<16} {1:>2} erases  {2:>7} bytes arrived during them  {3:>6} bytes overrun  {4:6.2f} s  "
+              "image {5:<8} {6}".format(name, node.sector_erases, node.erase_rx, node.overruns, elapsed,
+                                        "OK" if intact else "FAILED", "ok" if ok else "FAIL"))
+    print("\n   Reception during erases: {0} of {1} cases as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# baud rates of the session comparison, the image covers sectors 2 to 4
+SESSION_SELFTEST_BAUDRATES = (BL_BAUD_RATE, 921600)
+SESSION_SELFTEST_IMAGE_LEN = 96 * 1024
+
+def session_selftest(baudrates=SESSION_SELFTEST_BAUDRATES, image_len=SESSION_SELFTEST_IMAGE_LEN):
+    """
+    Flash a random image over the three sectors from APP_BASE_ADDRESS on at each baud rate,
+    once with BL_FLASH_ERASE then MEM_WRITE and once through a write session that erases
+    while it receives. The session must be the faster of the two.
+    """
+    data = random.Random(image_len).randbytes(image_len)
+    image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+    sectors = host.get_sector_range(APP_BASE_ADDRESS, image_len)
+    host.verbose_mode = 0
+    results = []
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for baudrate in baudrates:
+            serial_run = simulated_update('sim:session', baudrate, image, erase=sectors)
+            session_run = simulated_update('sim:session', baudrate, image)
+            results.append((baudrate, serial_run, session_run))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Update of a {0} byte image over sectors {1} to {2}".format(image_len, sectors[0], sum(sectors) - 1))
+    failed = 0
+    for baudrate, serial_run, session_run in results:
+        ok = (all(ret == 0 and image_intact(node, image) for ret, node, _, _ in (serial_run, session_run)) and
+              session_run[2] < serial_run[2])
+        failed += not ok
+        print("   {0:>7} baud  erase then write {1:6.2f} s  write session {2:6.2f} s  saved {3:5.2f} s ({4:4.1f} %)  {5}".format(
+            baudrate, serial_run[2], session_run[2], serial_run[2] - session_run[2],
+            100.0 * (serial_run[2] - session_run[2]) / serial_run[2], "ok" if ok else "FAIL"))
+    print("\n   Write sessions: {0} of {1} baud rates as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# name, length of the image from APP_BASE_ADDRESS on
+LAZY_SELFTEST_IMAGES = [
+    ("small",  4 * 1024),
+    ("large",  352 * 1024),
+]
+# name, BL_FLASH_ERASE (first sector, count), 'image' for the sectors the image covers or None
+# for a lazy write session. The sectors 2 to 4 are the ones the host used to erase whatever the image
+LAZY_SELFTEST_MODES = [
+    ("fixed sectors 2-4", (2, 3)),
+    ("image sectors",     'image'),
+    ("lazy session",      None),
+]
+
+def lazy_selftest(baudrate=921600):
+    """
+    Flash a small and a large random image over flash that holds older data everywhere, with
+    the fixed erase of sectors 2 to 4, with BL_FLASH_ERASE of the sectors the image covers and
+    through a lazy write session. The lazy session must erase exactly the sectors the image
+    covers and leave the image intact; the fixed erase wastes sectors on the small image and
+    misses some under the large one.
+    """
+    old = random.Random(0).randbytes(FLASH_SECTOR_BASE[-1] - APP_BASE_ADDRESS)
+    host.verbose_mode = 0
+    results = []
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for image_name, image_len in LAZY_SELFTEST_IMAGES:
+            data = random.Random(image_len).randbytes(image_len)
+            image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+            sectors = host.get_sector_range(APP_BASE_ADDRESS, image_len)
+            for mode_name, erase in LAZY_SELFTEST_MODES:
+                erase = sectors if erase == 'image' else erase
+                flags = 0 if erase else BL_SESSION_LAZY_ERASE
+                ret, node, elapsed, _ = simulated_update('sim:lazy', baudrate, image, erase, flags, flash=old)
+                results.append((image_name, image, sectors, mode_name, erase, ret, node, elapsed))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Sector erases at {0} baud over flash that holds older data".format(baudrate))
+    failed = 0
+    for image_name, image, sectors, mode_name, erase, ret, node, elapsed in results:
+        intact = ret == 0 and image_intact(node, image)
+        if erase and erase != sectors:
+            # what the fixed erase leaves behind: too many erases, or a broken image past its range
+            ok = node.sector_erases > sectors[1] if intact else sum(sectors) > sum(erase)
+        else:
+            ok = intact and node.sector_erases == sectors[1]
+        failed += not ok
+        print("   {0:<5} {1:>6} bytes, {2} sectors  {3:<17} {4} erases  {5:6.2f} s  image {6:<8} {7}".format(
+            image_name, len(image.data), sectors[1], mode_name, node.sector_erases, elapsed,
+            "OK" if intact else "DIFFERS", "ok" if ok else "FAIL"))
+    print("\n   Sector erases: {0} of {1} cases as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+COMPARE_SELFTEST_IMAGE_LEN = 128 * 1024     # sectors 2 to 5 from APP_BASE_ADDRESS on
+COMPARE_SELFTEST_CODE_LEN = 80 * 1024       # the rest of the image is 0xFF padding
+
+def compare_selftest_pairs():
+    """
+    (name, old image data, new image data, erases the compare session may need) of updates
+    as they come: the same build again, a version word that only clears bits, code that grew
+    into the padding and a change in the middle of the code.
+    """
+    code = random.Random(COMPARE_SELFTEST_CODE_LEN).randbytes(COMPARE_SELFTEST_CODE_LEN)
+    padding = b'\xff' * (COMPARE_SELFTEST_IMAGE_LEN - len(code))
+    old = code + padding
+    version = bytearray(old)
+    version[0x200:0x204] = struct.pack('<I', struct.unpack_from('<I', old, 0x200)[0] & 0xFFFF00FF)
+    grown = code + random.Random(1).randbytes(6 * 1024) + padding[6 * 1024:]
+    rebuilt = bytearray(old)
+    rebuilt[0x5000:0x5400] = random.Random(2).randbytes(0x400)
+    return [
+        ("same build",          old, old,             0),
+        ("version word 1->0",   old, bytes(version),  0),
+        ("grown into padding",  old, grown,           0),
+        ("code changed",        old, bytes(rebuilt),  1),
+    ]
+
+def compare_selftest(baudrate=921600):
+    """
+    Update a simulated bootloader holding the old image of each compare_selftest_pairs pair
+    to the new one, through a write session that erases the whole range and through one with
+    BL_SESSION_COMPARE. The compare session must need no more erases than expected and leave
+    the new image intact.
+    """
+    host.verbose_mode = 0
+    results = []
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for name, old, new, erases_expected in compare_selftest_pairs():
+            image = AppImage('bin', APP_BASE_ADDRESS, new, [(0, len(new))], APP_BASE_ADDRESS | 1)
+            full_run = simulated_update('sim:compare', baudrate, image, flash=old)
+            compare_run = simulated_update('sim:compare', baudrate, image, flags=BL_SESSION_COMPARE, flash=old)
+            results.append((name, image, erases_expected, full_run, compare_run))
+        sys.stdout = sys.__stdout__
+
+    sectors = host.get_sector_range(APP_BASE_ADDRESS, COMPARE_SELFTEST_IMAGE_LEN)
+    print("\n   Erase avoidance, {0} byte images over {1} sectors at {2} baud".format(
+        COMPARE_SELFTEST_IMAGE_LEN, sectors[1], baudrate))
+    failed = 0
+    for name, image, erases_expected, full_run, compare_run in results:
+        ok = (all(ret == 0 and image_intact(node, image) for ret, node, _, _ in (full_run, compare_run)) and
+              compare_run[1].sector_erases <= erases_expected)
+        failed += not ok
+        print("   {0:<19} full: {1} erases {2:5.2f} s   compare: {3} erases {4:5.2f} s   saved {5} erases {6:5.2f} s  {7}".format(
+            name, full_run[1].sector_erases, full_run[2], compare_run[1].sector_erases, compare_run[2],
+            full_run[1].sector_erases - compare_run[1].sector_erases, full_run[2] - compare_run[2], "ok" if ok else "FAIL"))
+    print("\n   Erase avoidance: {0} of {1} image pairs as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+def sparse_selftest_images():
+    """
+    (name, image data) of sample images: code alone, code padded to a sector boundary, code
+    and a calibration block at the end of a padded range, and code with short alignment gaps.
+    """
+    code = random.Random(3).randbytes(40 * 1024)
+    aligned = bytearray(random.Random(4).randbytes(64 * 1024))
+    for table in range(0x800, len(aligned), 0x800):
+        aligned[table - 0x60:table] = b'\xff' * 0x60   # linker fill before every 2 KB aligned table
+    return [
+        ("code only",           code),
+        ("padded to 128 KB",    code + b'\xff' * (88 * 1024)),
+        ("calibration at end",  code + b'\xff' * (84 * 1024) + random.Random(5).randbytes(4 * 1024)),
+        ("alignment gaps",      bytes(aligned)),
+    ]
+
+def sparse_selftest(baudrate=BL_BAUD_RATE):
+    """
+    Flash each sparse_selftest_images image through a write session that erases the whole
+    range, once sending every byte and once with sparse upload. Sparse upload must send fewer
+    bytes whenever the image holds 0xFF runs it can skip and leave every image intact.
+    """
+    host.verbose_mode = 0
+    results = []
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for name, data in sparse_selftest_images():
+            image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, len(data))], APP_BASE_ADDRESS | 1)
+            skipped = len(data) - sum(length for _, length in host.get_image_extents(data))
+            full_run = simulated_update('sim:sparse', baudrate, image, sparse=0)
+            sparse_run = simulated_update('sim:sparse', baudrate, image, sparse=1)
+            results.append((name, image, skipped, full_run, sparse_run))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Sparse upload at {0} baud, bytes on the line from BL_SESSION_BEGIN to BL_SESSION_END".format(baudrate))
+    failed = 0
+    for name, image, skipped, full_run, sparse_run in results:
+        ok = (all(ret == 0 and image_intact(node, image) for ret, node, _, _ in (full_run, sparse_run)) and
+              (sparse_run[3] < full_run[3] if skipped else sparse_run[3] == full_run[3]))
+        failed += not ok
+        print("   {0:<19} {1:>6} bytes, {2:>5} of them 0xFF runs   full {3:>6} bytes {4:5.2f} s   sparse {5:>6} bytes "
+              "{6:5.2f} s  {7:4.1f} % sent  {8}".format(
+                  name, len(image.data), skipped, full_run[3], full_run[2], sparse_run[3], sparse_run[2],
+                  100.0 * sparse_run[3] / full_run[3], "ok" if ok else "FAIL"))
+    print("\n   Sparse upload: {0} of {1} images as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# name, port, image fraction after which the link is cut once or None
+STREAM_SELFTEST_CASES = [
+    ("stream",                 'sim:stream',         None),
+    ("stream, flash x4",       'sim:stream,flash=4', None),
+    ("link cut, then restart", 'sim:stream',         0.4),
+]
+
+def stream_selftest(image_len=256 * 1024, baudrate=921600):
+    """
+    Flash a random image with BL_STREAM as automate_process_flow does, at the typical flash
+    times and with them four times slower, and once with the link cut partway through. After
+    the cut the host waits until the device has given up on the stream and streams the whole
+    image again. The receive ring must never overrun and the image must end up in flash.
+    """
+    data = random.Random(image_len).randbytes(image_len)
+    image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+    results = []
+    host.verbose_mode = 0
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for name, port, cut in STREAM_SELFTEST_CASES:
+            host.ser = open_serial_port(port, baudrate, timeout=2)
+            host.app_image = image
+            host.decode_menu_command_code(8)
+            host.apply_transfer_mode(host.device_caps)
+            start = time.perf_counter()
+            cut_ret = None
+            if cut is not None:
+                host.link_drop_at = int(image_len * cut)
+                cut_ret = host.decode_menu_command_code(13, host.stream_block_len, 0)
+                host.link_drop_at = None
+                # the device gives up on the stream after BL_STREAM_TIMEOUT_MS of silence
+                time.sleep(BL_STREAM_TIMEOUT_MS / 1000.0 + 2 * BL_STREAM_GAP_MS / 1000.0)
+                host.purge_serial_port()
+            ret = host.decode_menu_command_code(13, host.stream_block_len, 0)
+            if ret == 0:
+                ret = host.decode_menu_command_code(7)
+            elapsed = time.perf_counter() - start
+            host.ser.close()
+            node = host.ser.nodes[0]
+            results.append((name, cut_ret, ret == 0 and image_intact(node, image), node, elapsed))
+        sys.stdout = sys.__stdout__
+
+    print("\n   BL_STREAM, {0} byte image at {1} baud, checkpoint every {2} bytes".format(
+        image_len, baudrate, host.stream_block_len))
+    failed = 0
+    for name, cut_ret, intact, node, elapsed in results:
+        ok = intact and node.overruns == 0 and cut_ret in (None, -2)
+        failed += not ok
+        print("   {0:<24} {1:>2} erases  {2:>6} bytes overrun  {3:6.2f} s  image {4:<8} {5}".format(
+            name, node.sector_erases, node.overruns, elapsed, "OK" if intact else "FAILED", "ok" if ok else "FAIL"))
+    print("\n   BL_STREAM: {0} of {1} cases as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# name, what happens between the cut and the next stream: None, 'image' streams another image
+# and 'session' opens and ends a write session elsewhere, True when the stream must resume, and
+# how often every sector of the image is erased in all
+RESUME_SELFTEST_CASES = [
+    ("resume",                None,      True,  1),
+    ("another image",         'image',   False, 3),
+    ("after a write session", 'session', False, 2),
+]
+
+def resume_selftest(image_len=256 * 1024, baudrate=921600, cut=0.4):
+    """
+    Cut the BL_STREAM link once after cut of a random image and stream it again as
+    automate_process_flow does, from the offset find_resume_offset gets out of the device
+    journal. With nothing in between it must resume within the data sent before the cut and
+    erase no sector twice. Another image or a write session in between clears the journal and the
+    image is streamed whole. A resume offset the journal does not cover must be refused.
+    """
+    data = random.Random(image_len).randbytes(image_len)
+    image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+    other = AppImage('bin', APP_BASE_ADDRESS, data[::-1], [(0, image_len)], APP_BASE_ADDRESS | 1)
+    sectors = host.get_sector_range(APP_BASE_ADDRESS, image_len)
+    # the link is cut before the first block that starts at or past the cut
+    cut_at = -(-int(image_len * cut) // host.stream_block_len) * host.stream_block_len
+    results = []
+    host.verbose_mode = 0
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for name, between, resume_expected, passes in RESUME_SELFTEST_CASES:
+            host.ser = open_serial_port('sim:resume', baudrate, timeout=2)
+            host.app_image = image
+            host.decode_menu_command_code(8)
+            host.apply_transfer_mode(host.device_caps)
+            host.link_drop_at = int(image_len * cut)
+            cut_ret = host.decode_menu_command_code(13, host.stream_block_len, 0)
+            host.link_drop_at = None
+            # the device gives up on the stream after BL_STREAM_TIMEOUT_MS of silence
+            time.sleep(BL_STREAM_TIMEOUT_MS / 1000.0 + 2 * BL_STREAM_GAP_MS / 1000.0)
+            host.purge_serial_port()
+            node = host.ser.nodes[0]
+            if between == 'image':
+                host.app_image = other
+                host.decode_menu_command_code(13, host.stream_block_len, 0)
+                host.decode_menu_command_code(7)
+                host.app_image = image
+            elif between == 'session':
+                host.decode_menu_command_code(6, FLASH_SECTOR_BASE[-2], 4, BL_SESSION_LAZY_ERASE)
+                host.decode_menu_command_code(7)
+            refused = (host.decode_menu_command_code(13, host.stream_block_len, 0, 0, SIM_JOURNAL_BLOCK_LEN // 2) < 0 and
+                       host.stream_checkpoint is not None and host.stream_checkpoint[0] == BL_JOURNAL_MISMATCH)
+            host.purge_serial_port()
+            start = time.perf_counter()
+            offset = host.find_resume_offset()
+            ret = host.decode_menu_command_code(13, host.stream_block_len, 0, 0, offset)
+            if ret == 0:
+                ret = host.decode_menu_command_code(7)
+            elapsed = time.perf_counter() - start
+            host.ser.close()
+            results.append((name, resume_expected, passes, cut_ret, refused, offset, node.sector_erases,
+                            ret == 0 and image_intact(node, image), elapsed))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Resume after a cut link at offset {0} of a {1} byte image at {2} baud".format(
+        cut_at, image_len, baudrate))
+    failed = 0
+    for name, resume_expected, passes, cut_ret, refused, offset, erases, intact, elapsed in results:
+        resumed_ok = 0 < offset <= cut_at if resume_expected else offset == 0
+        ok = cut_ret == -2 and refused and resumed_ok and erases == passes * sectors[1] and intact
+        failed += not ok
+        print("   {0:<22} from offset {1:>6}  {2:>2} erases  {3:6.2f} s  bad offset {4:<8}  image {5:<8} {6}".format(
+            name, offset, erases, elapsed, "refused" if refused else "ACCEPTED", "OK" if intact else "FAILED",
+            "ok" if ok else "FAIL"))
+    print("\n   Stream resume: {0} of {1} cases as expected".format(len(results) - failed, len(results)))
+    return -1 if failed else 0
+
+# parity bytes per codeword of the decoder check and of the stream over a noisy link
+FEC_SELFTEST_PARITIES = (2, 16, FEC_PARITY_MAX)
+FEC_SELFTEST_STREAM_PARITY = 16
+
+def fec_selftest(codewords=100, image_len=128 * 1024, baudrate=921600, ber=3e-5):
+    """
+    Code random codewords with fec_encode, corrupt up to parity // 2 bytes of each and repair
+    them with fec_decode, the decoder of bsp.c. Then stream a random image over the link
+    emulator at ber, plain and with Reed-Solomon parity. Both must end up in flash, the plain
+    stream through rollbacks and the coded one through repairs alone.
+    """
+    rng = random.Random(codewords)
+    decoded = []
+    for parity in FEC_SELFTEST_PARITIES:
+        repaired = 0
+        for _ in range(codewords):
+            data = rng.randbytes(rng.randint(1, FEC_CODEWORD_LEN - parity))
+            coded = fec_encode(data, parity)
+            received = bytearray(coded)
+            errors = rng.randint(0, parity // 2)
+            for position in rng.sample(range(len(received)), errors):
+                received[position] ^= rng.randint(1, 255)
+            repaired += fec_decode(received, parity) == errors and received == coded
+        decoded.append((parity, repaired))
+
+    data = random.Random(image_len).randbytes(image_len)
+    image = AppImage('bin', APP_BASE_ADDRESS, data, [(0, image_len)], APP_BASE_ADDRESS | 1)
+    streams = []
+    host.verbose_mode = 0
+    with open(os.devnull, 'w') as quiet:
+        sys.stdout = quiet
+        for parity in (0, FEC_SELFTEST_STREAM_PARITY):
+            host.ser = open_serial_port('sim:fec', baudrate, timeout=2)
+            host.app_image = image
+            host.decode_menu_command_code(8)
+            host.apply_transfer_mode(host.device_caps)
+            # the same bit errors for both
+            random.seed(image_len)
+            host.link_ber = ber
+            start = time.perf_counter()
+            try:
+                ret = host.decode_menu_command_code(13, host.stream_block_len, 0, parity)
+            finally:
+                host.link_ber = 0.0
+            if ret == 0:
+                ret = host.decode_menu_command_code(7)
+            elapsed = time.perf_counter() - start
+            host.ser.close()
+            node = host.ser.nodes[0]
+            streams.append((parity, host.stream_rollbacks, node, ret == 0 and image_intact(node, image), elapsed))
+        sys.stdout = sys.__stdout__
+
+    print("\n   Reed-Solomon decoder, {0} random codewords per parity".format(codewords))
+    failed = 0
+    for parity, repaired in decoded:
+        ok = repaired == codewords
+        failed += not ok
+        print("   parity {0:>2}  up to {1:>2} bytes wrong  {2:>4} of {3} repaired  {4}".format(
+            parity, parity // 2, repaired, codewords, "ok" if ok else "FAIL"))
+    print("\n   BL_STREAM of a {0} byte image at {1} baud, bit error rate {2:.0e}".format(image_len, baudrate, ber))
+    for parity, rollbacks, node, intact, elapsed in streams:
+        ok = intact and ((rollbacks > 0) if not parity else (rollbacks == 0 and node.fec_corrected > 0))
+        failed += not ok
+        print("   parity {0:>2}  {1:>3} rollbacks  {2:>4} bytes repaired in {3:>3} codewords  {4:6.2f} s  image {5:<8} {6}".format(
+            parity, rollbacks, node.fec_corrected, node.fec_codewords, elapsed, "OK" if intact else "FAILED",
+            "ok" if ok else "FAIL"))
+    checks = len(decoded) + len(streams)
+    print("\n   Forward error correction: {0} of {1} checks as expected".format(checks - failed, checks))
+    return -1 if failed else 0
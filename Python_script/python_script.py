@@ -3,6 +3,21 @@ import struct
 import os
 import sys
 import glob
+import time
+import re
+import argparse
+import collections
+import zlib
+import threading
+import queue
+import concurrent.futures
+import json
+import math
+import random
+
+# bl_sim imports this file by name, it must get this instance whether it runs as the main script
+# or in a station worker
+sys.modules.setdefault('python_script', sys.modules[__name__])
 
 # Status codes
 Flash_HAL_OK = 0x00
@@ -10,75 +25,651 @@ Flash_HAL_ERROR = 0x01
 Flash_HAL_BUSY = 0x02
 Flash_HAL_TIMEOUT = 0x03
 Flash_HAL_INV_ADDR = 0x04
-
-# BL Commands
-COMMAND_BL_GET_VER = 0x80
-COMMAND_BL_GO_TO_ADDR = 0x83
-COMMAND_BL_FLASH_ERASE = 0x81
-COMMAND_BL_MEM_WRITE = 0x82
+BL_SESSION_RESTART = 0x05   # followed by the 4 byte address to resend from
+BL_COMMIT_BAD_CRC = 0x06    # the staged slice does not match the digest sent with BL_COMMIT
+BL_STREAM_ROLLBACK = 0x08   # a BL_STREAM block failed its CRC, resend from the offset that follows
+BL_JOURNAL_MISMATCH = 0x09  # BL_SESSION_RESUME refused, the journal is for another image or range
+BL_JOURNAL_EMPTY = 0x0A     # BL_JOURNAL: nothing journaled
+
+# Reply start bytes
+BL_ACK = 0xA5               # followed by the length and the data
+BL_NACK = 0x7F
+BL_REPLY = 0xA6             # framed reply: length, payload and the CRC of all of it
+
+# BL Commands (must match the BL_* codes in Core/Inc/bsp.h)
+COMMAND_BL_GET_VER = 0x51
+COMMAND_BL_GET_HELP = 0x52
+COMMAND_BL_GET_CID = 0x53
+COMMAND_BL_GO_TO_ADDR = 0x55
+COMMAND_BL_FLASH_ERASE = 0x56
+COMMAND_BL_MEM_WRITE = 0x57
+COMMAND_BL_GET_STATS = 0x5D
+COMMAND_BL_SESSION_BEGIN = 0x5E
+COMMAND_BL_SESSION_END = 0x5F
+COMMAND_BL_COMMIT = 0x60
+COMMAND_BL_EXEC_STUB = 0x61
+COMMAND_BL_BENCH = 0x62
+COMMAND_BL_STREAM = 0x63
+COMMAND_BL_JOURNAL = 0x65
+COMMAND_BL_NODE = 0x66
 
 # Command lengths
 COMMAND_BL_GET_VER_LEN = 6
+COMMAND_BL_GET_HELP_LEN = 6
+COMMAND_BL_GET_CID_LEN = 14
 COMMAND_BL_GO_TO_ADDR_LEN = 10
 COMMAND_BL_FLASH_ERASE_LEN = 8
 COMMAND_BL_MEM_WRITE_LEN = 11
+COMMAND_BL_GET_STATS_LEN = 7
+COMMAND_BL_SESSION_BEGIN_LEN = 15
+COMMAND_BL_SESSION_END_LEN = 6
+COMMAND_BL_COMMIT_LEN = 18
+COMMAND_BL_EXEC_STUB_LEN = 26
+COMMAND_BL_BENCH_LEN = 7
+COMMAND_BL_STREAM_LEN = 22
+COMMAND_BL_JOURNAL_LEN = 8
+COMMAND_BL_NODE_LEN = 7     # operation byte only, its operand follows
+
+# MEM_WRITE frames in flight are bounded by the device receive ring (BL_RX_RING_LEN in bsp.h)
+BL_RX_RING_LEN = 512
+PIPELINE_WINDOW = BL_RX_RING_LEN // (COMMAND_BL_MEM_WRITE_LEN + 128)
+PIPELINE_MAX_WINDOW = 64    # frames in flight the device credits may allow at most
+FLASH_STALL_TIMEOUT = 5     # seconds a session may not answer while a sector erases with its queue full
+SESSION_END_TIMEOUT = 10    # seconds BL_SESSION_END may take: a full queue to program and one more erase
+SECTOR_ERASE_TIMEOUT = 2    # seconds BL_FLASH_ERASE may take per sector, the longest 128 KB erase
+PIPELINE_QUEUE_DEPTH = 64   # frames prepared ahead of the transmitter
+MEM_WRITE_RETRIES = 3       # resends after a NACK before the transfer is given up
+
+# Serial link
+BL_BAUD_RATE = 115200       # USART2 setting of the bootloader
+PROBE_TIMEOUT = 0.25        # seconds a port gets to answer the discovery BL_GET_VER
+PROBE_WORKERS = 64
+
+# Serial driver tuning
+SERIAL_BUFFER_SIZE = 65536
+TIOCGSERIAL = 0x541E
+TIOCSSERIAL = 0x541F
+ASYNC_LOW_LATENCY = 0x2000
+
+# BL_GET_STATS flags
+BL_STATS_CLEAR = 0x01
+
+# BL_SESSION_BEGIN flags
+BL_SESSION_LAZY_ERASE = 0x01
+BL_SESSION_COMPARE = 0x02   # skip equal words, program 1->0 changes in place, erase only for 0->1
+BL_SESSION_RESUME = 0x04    # BL_STREAM only: continue the image the device journal records
+
+# Layout of bl_stats_t in bsp.h (little endian)
+BL_STATS_FORMAT = struct.Struct('<8I5Q8I')
+
+# BL_GET_HELP: bl_help_t in bsp.h followed by the supported command codes
+BL_HELP_FORMAT = struct.Struct('<4B2H4I9I')
+BL_FEATURE_SESSION = 0x01
+BL_FEATURE_LAZY_ERASE = 0x02
+BL_FEATURE_COMPARE = 0x04
+BL_FEATURE_STATS = 0x08
+BL_FEATURE_STAGING = 0x10
+BL_FEATURE_STUBS = 0x20
+BL_FEATURE_BENCH = 0x40
+BL_FEATURE_STREAM = 0x80
+BL_FEATURE_CREDITS = 0x100  # session MEM_WRITE replies and BL_STREAM checkpoints carry a receive credit
+BL_FEATURE_FEC = 0x200      # BL_STREAM blocks may be Reed-Solomon coded
+BL_FEATURE_JOURNAL = 0x400  # BL_JOURNAL and BL_SESSION_RESUME
+BL_FEATURE_BUS = 0x800      # BL_NODE, several bootloaders on one multi-drop line
+BL_CRC_MODE_BYTE_WORD = 0x01
+# BL_GET_CID: bl_cid_t in bsp.h
+BL_CID_FORMAT = struct.Struct('<6I')
+DeviceCid = collections.namedtuple('DeviceCid', 'idcode uid digest_len digest')
+# BL_COMMIT: bl_commit_result_t in bsp.h
+BL_COMMIT_FORMAT = struct.Struct('<BBHII')
+CommitResult = collections.namedtuple('CommitResult', 'status sectors_erased crc cycles')
+# BL_EXEC_STUB: bl_stub_header_t and bl_stub_result_t in bl_stub.h
+BL_STUB_MAGIC = 0x42545342
+BL_STUB_ABI_VERSION = 1
+BL_STUB_HEADER_FORMAT = struct.Struct('<4I')
+BL_STUB_RESULT_FORMAT = struct.Struct('<B3x2I4I')
+BL_STUB_OK = 0x00
+BL_STUB_BAD_ADDRESS = 0x04
+BL_STUB_BAD_HEADER = 0x07
+BL_STUB_STATUS = {BL_STUB_OK: "OK", BL_STUB_BAD_ADDRESS: "BAD_ADDRESS", BL_STUB_BAD_HEADER: "BAD_HEADER"}
+StubResult = collections.namedtuple('StubResult', 'status stub_status cycles result')
+# BL_BENCH: ping bytes to echo, then bl_bench_t in bsp.h
+BL_BENCH_FORMAT = struct.Struct('<I2BH11I')
+BenchResult = collections.namedtuple('BenchResult', 'sysclk_hz scratch_sector status ping_len erase_cycles '
+                                                    'program_word_cycles program_byte_cycles crc_byte_cycles '
+                                                    'crc_word_cycles memcpy_cycles uart_rtt_cycles program_len '
+                                                    'byte_len crc_len copy_len')
+BL_SECTOR_NONE = 0xFF
+BENCH_TIMEOUT = 10          # seconds the flash tests of BL_BENCH may take
+
+# BL_STREAM checkpoint reply: status, the image offset the device expects next and the blocks
+# it can take beyond it
+BL_STREAM_FORMAT = struct.Struct('<BIH')
+BL_STREAM_BLOCK_MIN = 16
+BL_STREAM_BLOCK_MAX = 4096
+BL_STREAM_GAP_MS = 50       # the device drops input after a bad block until the line is idle this long
+BL_STREAM_TIMEOUT_MS = 1000 # a stream the host stopped feeding ends on the device after this long
+STREAM_ROLLBACK_LIMIT = 8   # rollbacks in a row without a new checkpoint before a stream is given up
+STREAM_MAX_IN_FLIGHT = 8192 # bytes a rollback may have to resend, whatever the credit allows
+STREAM_BENCH_BLOCKS = (64, 256, 1024, 4096)
+# BL_STREAM forward error correction (bsp.h): block and CRC cut into Reed-Solomon codewords over
+# GF(2^8) of up to FEC_CODEWORD_LEN - parity data bytes, each followed by its parity bytes
+FEC_POLY = 0x11D
+FEC_CODEWORD_LEN = 255
+FEC_PARITY_MIN = 2
+FEC_PARITY_MAX = 32
+FEC_DEFAULT_PARITY = 16
+FEC_BENCH_BER = (0, 1e-5, 1e-4, 3e-4, 1e-3)
+# BL_JOURNAL: bl_journal_reply_t in bsp.h followed by crc_count block CRCs
+BL_JOURNAL_FORMAT = struct.Struct('<BBH4IHH')
+Journal = collections.namedtuple('Journal', 'status erased_mask block_len image_id base length verified block_crcs')
+RESUME_BENCH_FRACTION = 0.9
+
+# BL_NODE operations. On a bus every other request goes inside a BL_NODE_FOR, only the node it
+# addresses alone answers it
+BL_NODE_FOR = 0x01
+BL_NODE_GROUP = 0x02
+BL_NODE_ASSIGN = 0x03
+BL_NODE_STATUS = 0x04
+BL_NODE_DIGEST = 0x05
+BL_NODE_ENUM = 0x06
+BL_NODE_ENUM_RESET = 0x01   # BL_NODE_ENUM flag, the nodes forget their address first
+BL_NODE_ENUM_REPLY_LEN = 18 # BL_REPLY frame of a 12 byte UID, one per slot
+BL_NODE_ENUM_SLOTS_MAX = 64 # slots of a round, one bit each in the mask of the next
+BL_NODE_BARE_OPS = (BL_NODE_FOR, BL_NODE_GROUP, BL_NODE_ASSIGN, BL_NODE_ENUM)   # go on the bus as they are
+BL_NODE_UNASSIGNED = 0x00
+BL_NODE_TO_GROUP = 0xFE
+BL_NODE_BROADCAST = 0xFF
+BL_NODE_FOR_LEN = 8         # bytes BL_NODE_FOR adds around a request
+BL_NODE_GROUP_LEN = 32
+BL_NODE_DIGESTS_MAX = 48
+BL_NODE_GAP_MS = 5          # nodes find the frame sync again on this much idle line, the host leaves twice that
+# BL_NODE_STATUS: bl_node_status_t in bsp.h
+BL_NODE_STATUS_FORMAT = struct.Struct('<4B2I3I')
+NodeStatus = collections.namedtuple('NodeStatus', 'address session_active session_status erased_mask slots_queued '
+                                                  'crc_failures uid')
+BUS_DIGEST_BLOCK = 2048     # bytes per block digest when looking for what a node missed
+BUS_RESEND_ROUNDS = 3       # selective resends to one node before it is given up
+BUS_ERASE_POLL = 0.05       # seconds between BL_NODE_STATUS polls while the nodes erase
+BUS_SYNC_FRAMES = 16        # broadcast frames between two idle gaps, a node that lost the frame sync misses at most these
+BUS_REPLY_TIMEOUT = 0.25    # seconds to a MEM_WRITE reply on a bus, a frame the noise hit is dropped and never NACKed
+BUS_ENUM_FIRST_SLOTS = 32   # BL_NODE_ENUM slots of the first round, later rounds size themselves on the collisions
+BUS_ENUM_GUARD = 2          # byte times between two slots for the transceiver turnaround
+BUS_ENUM_ROUNDS_MAX = 32
+BUS_ENUM_SILENT_ROUNDS = 2  # silent BL_NODE_ENUM rounds in a row that end the enumeration
+
+DeviceCaps = collections.namedtuple('DeviceCaps', 'version crc_modes max_frame_len rx_ring_len features '
+                                                  'baud_rate work_buffer_addr work_buffer_len sector_base commands')
+
+# STM32F446 flash sector start addresses, the last entry is the end of the flash
+FLASH_SECTOR_BASE = [0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+                     0x08010000, 0x08020000, 0x08040000, 0x08060000, 0x08080000]
+APP_BASE_ADDRESS = 0x08008000
 
 # Global variables
 verbose_mode = 1
-mem_write_active = 0
+PROGRESS_INTERVAL = 0.25    # seconds between MEM_WRITE progress lines
+use_streaming = 1       # 1: BL_STREAM the image with a CRC checkpoint every stream_block_len bytes, when supported
+stream_block_len = 1024
+stream_fec_parity = 0   # Reed-Solomon parity bytes per BL_STREAM codeword, 0 for none
+link_ber = 0.0          # link emulator: bit error rate injected into the BL_STREAM data sent
+link_drop_at = None     # link emulator: image offset at which the BL_STREAM link is cut once
+use_resume = 1          # 1: continue an interrupted BL_STREAM from the device journal, when supported
+use_staging = 1         # 1: stream slices into the device work buffer and BL_COMMIT each, when supported
+use_write_session = 1   # 1: erase-while-receive write session, 0: BL_FLASH_ERASE then BL_MEM_WRITE
+session_flags = 0       # BL_SESSION_LAZY_ERASE: erase only the sectors the image actually touches
+                        # BL_SESSION_COMPARE: avoid erases when the image only clears bits of the current one
+session_restart_address = None
+device_caps = None      # DeviceCaps from BL_GET_HELP, None for a bootloader without it
+device_cid = None       # DeviceCid from the last BL_GET_CID
+commit_result = None    # CommitResult from the last BL_COMMIT
+stub_result = None      # StubResult from the last BL_EXEC_STUB
+bench_result = None     # BenchResult from the last BL_BENCH
+stream_checkpoint = None    # (status, offset) of the last BL_STREAM reply
+stream_rollbacks = 0    # rollbacks of the last BL_STREAM
+journal_state = None    # Journal from the last BL_JOURNAL, block_crcs from its first_block
+bus_address = None      # BL_NODE_FOR address of every request, None off a bus
+line_idle_at = 0.0      # perf_counter time the line has sent everything written, the adapter buffers
+node_op = 0             # BL_NODE operation of the last request, its reply depends on it
+node_status = None      # NodeStatus from the last BL_NODE_STATUS
+node_digests = None     # block digests from the last BL_NODE_DIGEST
+node_address = None     # address the last BL_NODE_ASSIGN reply confirmed
+node_enum = None        # (UIDs, garbled bytes) the last BL_NODE_ENUM round brought
+bus_resent = {}         # bytes resent to each node address by the last run_bus_update
+reply_pending = b''     # checked payload of a framed reply, served by read_serial_port
+flash_if_different = 1  # skip the update when the device digest of every segment matches the image
+image_already_present = 0
+mem_write_chunk = 128   # MEM_WRITE payload bytes per frame
+pipeline_window = PIPELINE_WINDOW
+pipeline_peak = 0       # most frames (or BL_STREAM blocks) in flight during the last transfer
+sparse_upload = 1       # skip 0xFF runs of the image, they are already erased on the device
+SPARSE_MIN_GAP = 32     # shorter 0xFF runs cost less to send than the extra frame header
 ser = None
-bin_file = None
+app_image = None
+serial_writes = 0       # ser.write calls, one per frame
+frames_sent = 0
+
+# Every request frame is built in place here: [len][command][payload][crc32]
+frame_buf = bytearray(256)
+frame_view = memoryview(frame_buf)
 
 # ----------------------------- File Operations -----------------------------
 
 # ----------------------------- File Operations -----------------------------
 
-def get_sector_count(file_size):
+def get_sector_range(base_address, length):
     """
-    Calculate the number of sectors to erase based on the file size.
-    Assuming each sector is 128 KB (131072 bytes).
+    Return (first_sector, number_of_sectors) covering [base_address, base_address + length)
+    using the real F446 sector layout (4 x 16 KB, 64 KB, 3 x 128 KB).
     """
-    sector_size = 131072  # 128 KB
-    return (file_size + sector_size - 1) // sector_size  # Round up to the nearest sector
-
-def calc_file_len():
-    return os.path.getsize("user_app.bin")
+    end_address = base_address + max(length, 1) - 1
+    sectors = [n for n in range(len(FLASH_SECTOR_BASE) - 1)
+               if FLASH_SECTOR_BASE[n] <= end_address and base_address < FLASH_SECTOR_BASE[n + 1]]
+    if not sectors:
+        return 0, 0
+    return sectors[0], len(sectors)
+
+def get_image_extents(image, min_gap=SPARSE_MIN_GAP):
+    """
+    Split the image into (offset, length) extents that skip every run of at least
+    min_gap 0xFF bytes. Gap edges are kept word aligned for the device word programming.
+    """
+    extents = []
+    offset = 0
+    for gap in re.finditer(b'\xff{%d,}' % min_gap, image):
+        gap_start = (gap.start() + 3) & ~3
+        gap_end = gap.end() & ~3
+        if gap_end - gap_start < min_gap:
+            continue
+        if gap_start > offset:
+            extents.append((offset, gap_start - offset))
+        offset = gap_end
+    if offset < len(image):
+        extents.append((offset, len(image) - offset))
+    return extents
+
+# Flat image of everything the input file loads into flash.
+# segments: (offset, length) ranges of data that the file actually defines, gaps between them are not sent
+# entry: go address with the thumb bit cleared, the bootloader sets it before jumping
+AppImage = collections.namedtuple('AppImage', 'format base data segments entry')
+
+# Address field length per S-record type, data records S1-S3, start address records S7-S9
+SREC_ADDRESS_LEN = {b'1': 2, b'2': 3, b'3': 4, b'7': 4, b'8': 3, b'9': 2}
+
+def parse_elf_image(raw):
+    """
+    Return (chunks, entry) of a 32-bit little endian ELF file. Every PT_LOAD segment with file
+    data becomes a chunk at its load (physical) address, so .data initialisers land in flash.
+    """
+    if raw[4] != 1 or raw[5] != 1:
+        raise ValueError("only 32-bit little endian ELF files are supported")
+    entry, phoff = struct.unpack_from('<2I', raw, 24)
+    phentsize, phnum = struct.unpack_from('<2H', raw, 42)
+    chunks = []
+    for n in range(phnum):
+        p_type, p_offset, p_vaddr, p_paddr, p_filesz = struct.unpack_from('<5I', raw, phoff + n * phentsize)
+        if p_type == 1 and p_filesz:    # PT_LOAD
+            chunks.append((p_paddr, raw[p_offset:p_offset + p_filesz]))
+    return chunks, entry
+
+def parse_ihex_image(raw):
+    """
+    Return (chunks, entry) of an Intel HEX file. Handles data, end of file, extended segment /
+    linear address and start linear address records.
+    """
+    chunks = []
+    entry = None
+    upper_address = 0
+    for line_no, line in enumerate(raw.split(), 1):
+        if line[:1] != b':':
+            raise ValueError("line {0}: not an Intel HEX record".format(line_no))
+        record = bytes.fromhex(line[1:].decode('ascii'))
+        if sum(record) & 0xFF:
+            raise ValueError("line {0}: checksum mismatch".format(line_no))
+        count, address, record_type = record[0], (record[1] << 8) | record[2], record[3]
+        data = record[4:4 + count]
+        if record_type == 0x00:
+            chunks.append((upper_address + address, data))
+        elif record_type == 0x01:
+            break
+        elif record_type == 0x02:
+            upper_address = int.from_bytes(data, 'big') << 4
+        elif record_type == 0x04:
+            upper_address = int.from_bytes(data, 'big') << 16
+        elif record_type == 0x05:
+            entry = int.from_bytes(data, 'big')
+    return chunks, entry
+
+def parse_srec_image(raw):
+    """
+    Return (chunks, entry) of a Motorola S-record file. S0 headers and S5/S6 counts are skipped.
+    """
+    chunks = []
+    entry = None
+    for line_no, line in enumerate(raw.split(), 1):
+        if line[:1] != b'S':
+            raise ValueError("line {0}: not an S-record".format(line_no))
+        record = bytes.fromhex(line[2:].decode('ascii'))
+        if (sum(record) & 0xFF) != 0xFF:
+            raise ValueError("line {0}: checksum mismatch".format(line_no))
+        address_len = SREC_ADDRESS_LEN.get(line[1:2])
+        if address_len is None:
+            continue
+        address = int.from_bytes(record[1:1 + address_len], 'big')
+        if line[1:2] in b'123':
+            chunks.append((address, record[1 + address_len:-1]))
+        else:
+            entry = address
+    return chunks, entry
 
-def open_the_file():
-    global bin_file
-    bin_file = open('user_app.bin', 'rb')
+def merge_image_chunks(chunks):
+    """
+    Place the chunks into one 0xFF filled buffer starting at the lowest address and return
+    (base, data, segments) where segments are the merged (offset, length) ranges the chunks cover.
+    """
+    chunks = sorted(chunk for chunk in chunks if chunk[1])
+    if not chunks:
+        raise ValueError("the image has no data to load into flash")
+    base = chunks[0][0]
+    end = max(address + len(chunk) for address, chunk in chunks)
+    data = bytearray(b'\xff') * (end - base)
+    segments = []
+    for address, chunk in chunks:
+        offset = address - base
+        data[offset:offset + len(chunk)] = chunk
+        if segments and offset <= segments[-1][0] + segments[-1][1]:
+            seg_offset, seg_len = segments[-1]
+            segments[-1] = (seg_offset, max(seg_len, offset + len(chunk) - seg_offset))
+        else:
+            segments.append((offset, len(chunk)))
+    return base, bytes(data), segments
 
-def close_the_file():
-    if bin_file:
-        bin_file.close()
+def parse_image(raw, bin_base_address=APP_BASE_ADDRESS):
+    """
+    Detect the format of raw from its first bytes and return an AppImage. Raw binaries are
+    linked at bin_base_address. Without an entry point in the file, the reset vector of the
+    image vector table is used.
+    """
+    if raw[:4] == b'\x7fELF':
+        image_format = 'elf'
+        chunks, entry = parse_elf_image(raw)
+    elif raw[:1] == b':':
+        image_format = 'ihex'
+        chunks, entry = parse_ihex_image(raw)
+    elif raw[:1] == b'S' and raw[1:2].isdigit():
+        image_format = 'srec'
+        chunks, entry = parse_srec_image(raw)
+    else:
+        image_format = 'bin'
+        chunks, entry = [(bin_base_address, raw)], None
+
+    # Only flash is programmed, RAM only segments (.bss, stack, heap) are dropped
+    flash_chunks = [(address, chunk) for address, chunk in chunks
+                    if FLASH_SECTOR_BASE[0] <= address and address + len(chunk) <= FLASH_SECTOR_BASE[-1]]
+    if len(flash_chunks) != len(chunks):
+        print("\n   Skipped {0} segments outside the flash".format(len(chunks) - len(flash_chunks)))
+    base, data, segments = merge_image_chunks(flash_chunks)
+
+    if entry is None and len(data) >= 8:
+        entry = struct.unpack_from('<I', data, 4)[0]    # reset vector
+    if entry is None or not (base <= entry < base + len(data)):
+        raise ValueError("no entry point inside the image, got {0}".format(hex(entry) if entry is not None else None))
+    return AppImage(image_format, base, data, segments, entry & ~1)
+
+def load_image(path):
+    start = time.perf_counter()
+    with open(path, 'rb') as image_file:
+        raw = image_file.read()
+    image = parse_image(raw)
+    print("\n   Loaded {0} ({1}, {2} bytes) in {3:.1f} ms".format(path, image.format, len(raw),
+                                                              (time.perf_counter() - start) * 1000))
+    print("   Base: {0:#010x}  Size: {1}  Segments: {2}  Entry: {3:#010x}".format(
+        image.base, len(image.data), len(image.segments), image.entry))
+    return image
+
+def benchmark_image_parsers(size=512 * 1024):
+    """
+    Time parse_image on a size byte random image in every supported format.
+    """
+    base = FLASH_SECTOR_BASE[0]
+    entry = base + 0x1C1
+    data = bytearray(os.urandom(size))
+    struct.pack_into('<I', data, 4, entry)    # reset vector for the formats without an entry record
+    data = bytes(data)
+
+    ihex = []
+    for offset in range(0, size, 16):
+        address = base + offset
+        if offset % 0x10000 == 0:
+            record = bytes([2, 0, 0, 4]) + (address >> 16).to_bytes(2, 'big')
+            ihex.append(b':' + (record + bytes([-sum(record) & 0xFF])).hex().upper().encode())
+        record = bytes([16, (address >> 8) & 0xFF, address & 0xFF, 0]) + data[offset:offset + 16]
+        ihex.append(b':' + (record + bytes([-sum(record) & 0xFF])).hex().upper().encode())
+    ihex.append(b':00000001FF')
+
+    srec = []
+    for offset in range(0, size, 32):
+        record = bytes([37]) + (base + offset).to_bytes(4, 'big') + data[offset:offset + 32]
+        srec.append(b'S3' + (record + bytes([~sum(record) & 0xFF])).hex().upper().encode())
+    record = bytes([5]) + entry.to_bytes(4, 'big')
+    srec.append(b'S7' + (record + bytes([~sum(record) & 0xFF])).hex().upper().encode())
+
+    elf = bytearray(52 + 32)
+    elf[0:6] = b'\x7fELF\x01\x01'
+    struct.pack_into('<2I', elf, 24, entry, 52)
+    struct.pack_into('<2H', elf, 42, 32, 1)
+    struct.pack_into('<6I', elf, 52, 1, len(elf), base, base, size, size)
+    elf += data
+
+    for image_format, raw in (('bin', data), ('ihex', b'\n'.join(ihex)),
+                              ('srec', b'\n'.join(srec)), ('elf', bytes(elf))):
+        start = time.perf_counter()
+        image = parse_image(raw, base)
+        elapsed = time.perf_counter() - start
+        assert image.data == data and image.format == image_format
+        print("   {0:<5} {1:>8} bytes  {2:8.1f} ms".format(image_format, len(raw), elapsed * 1000))
 
 # ----------------------------- Utilities -----------------------------
 
 def word_to_byte(addr, index, lowerfirst):
     return (addr >> (8 * (index - 1))) & 0x000000FF
 
+def seal_frame(command, payload_len, buf=frame_buf):
+    """
+    Complete the frame whose payload is already in buf[2:] with its length, command and
+    CRC, and return a view of it. No bytes are copied.
+    """
+    frame_len = payload_len + 6
+    buf[0] = frame_len - 1
+    buf[1] = command
+    struct.pack_into('<I', buf, frame_len - 4, get_crc(buf, frame_len - 4))
+    return (frame_view if buf is frame_buf else memoryview(buf))[:frame_len]
+
+def encode_frame(command, payload=b''):
+    frame_buf[2:2 + len(payload)] = payload
+    return seal_frame(command, len(payload))
+
+def parse_device_caps(reply):
+    if len(reply) < BL_HELP_FORMAT.size:
+        return None
+    fields = BL_HELP_FORMAT.unpack_from(reply)
+    (version, crc_modes, sector_count, command_count, max_frame_len, rx_ring_len,
+     features, baud_rate, work_buffer_addr, work_buffer_len) = fields[:10]
+    sector_base = list(fields[10:10 + sector_count + 1])
+    commands = list(reply[BL_HELP_FORMAT.size:BL_HELP_FORMAT.size + command_count])
+    return DeviceCaps(version, crc_modes, max_frame_len, rx_ring_len, features,
+                      baud_rate, work_buffer_addr, work_buffer_len, sector_base, commands)
+
+def select_transfer_mode(caps, want_session, want_flags):
+    """
+    Return (use_write_session, session_flags, chunk_len, window) for the device capabilities.
+    The MEM_WRITE payload is the largest word multiple the device frame allows while two frames
+    still fit in its receive ring, the window is what the ring then holds. A write session and
+    its flags are used when wanted and supported. A bootloader without BL_GET_HELP gets the
+    lock-step 128 byte erase then write path that every version handles.
+    """
+    if caps is None:
+        return 0, 0, 128, 1
+    supported_flags = 0
+    if caps.features & BL_FEATURE_LAZY_ERASE:
+        supported_flags |= BL_SESSION_LAZY_ERASE
+    if caps.features & BL_FEATURE_COMPARE:
+        supported_flags |= BL_SESSION_COMPARE
+    use_session = 1 if want_session and (caps.features & BL_FEATURE_SESSION) else 0
+
+    chunk_len = min(255, caps.max_frame_len - COMMAND_BL_MEM_WRITE_LEN) & ~3
+    two_frames = (caps.rx_ring_len // 2 - COMMAND_BL_MEM_WRITE_LEN) & ~3
+    if two_frames > 0:
+        chunk_len = min(chunk_len, two_frames)
+    window = max(1, caps.rx_ring_len // (chunk_len + COMMAND_BL_MEM_WRITE_LEN))
+    return use_session, (want_flags & supported_flags) if use_session else 0, chunk_len, window
+
+def select_transfer_path(caps, want_stream, want_staging, use_session):
+    """
+    Return how automate_process_flow sends the image: 'stream' or 'staged' when wanted and
+    supported, BL_STREAM first, otherwise 'session' or 'erase' as select_transfer_mode chose.
+    """
+    if want_stream and caps and (caps.features & BL_FEATURE_STREAM):
+        return 'stream'
+    if want_staging and caps and (caps.features & BL_FEATURE_STAGING):
+        return 'staged'
+    return 'session' if use_session else 'erase'
+
+def apply_transfer_mode(caps):
+    global use_write_session, session_flags, mem_write_chunk, pipeline_window
+    use_write_session, session_flags, mem_write_chunk, pipeline_window = select_transfer_mode(
+        caps, use_write_session, session_flags)
+    path = select_transfer_path(caps, use_streaming, use_staging, use_write_session)
+    if path == 'stream':
+        mode = "stream, checkpoint every {0} bytes".format(stream_block_len)
+        if stream_fec_parity and (caps.features & BL_FEATURE_FEC):
+            mode += ", {0} parity bytes per codeword".format(stream_fec_parity)
+    elif path == 'staged':
+        mode = "staged commit, {0} byte slices".format(caps.work_buffer_len)
+    else:
+        mode = "write session" if use_write_session else "erase then write"
+    credits = " until the device grants credits" if caps and (caps.features & BL_FEATURE_CREDITS) else ""
+    print("\n   Transfer mode: {0}, flags {1:#04x}, {2} byte frames, {3} in flight{4}".format(
+        mode, session_flags, mem_write_chunk, pipeline_window, credits))
+
+# Every byte value with its bits in reverse order, zlib.crc32 is the reflected form of the STM32 CRC
+CRC_BIT_REVERSE = bytes(int('{:08b}'.format(i)[::-1], 2) for i in range(256))
+
 def get_crc(buff, length):
-    crc = 0xFFFFFFFF
-    for data in buff[0:length]:
-        crc ^= data
-        for _ in range(32):
-            if crc & 0x80000000:
-                crc = (crc << 1) ^ 0x04C11DB7
-            else:
-                crc <<= 1
-    return crc
+    """
+    CRC of the STM32 CRC peripheral (poly 0x04C11DB7, init 0xFFFFFFFF) with every byte written
+    as one 32-bit word, as bootloader_verify_crc does. Each byte is the word 0x000000bb, so the
+    stream is fed to zlib as 00 00 00 bb with the bits of every byte and of the result reversed.
+    """
+    words = bytearray(4 * length)
+    words[3::4] = bytes(buff[0:length]).translate(CRC_BIT_REVERSE)
+    crc = zlib.crc32(words) ^ 0xFFFFFFFF
+    return int('{:032b}'.format(crc)[::-1], 2)
+
+def get_flash_digest(data):
+    """
+    Digest bootloader_flash_digest computes over the same bytes: the CRC unit fed with little
+    endian words, so each word enters most significant byte first. data is padded to whole
+    words with erased flash.
+    """
+    data = bytes(data) + b'\xff' * (-len(data) % 4)
+    words = bytearray(len(data))
+    for n in range(4):
+        words[n::4] = data[3 - n::4]
+    crc = zlib.crc32(words.translate(CRC_BIT_REVERSE)) ^ 0xFFFFFFFF
+    return int('{:032b}'.format(crc)[::-1], 2)
+
+# GF(2^8) of FEC_POLY, the exponent table doubled so a product of two logs needs no modulo
+FEC_GF_EXP = bytearray(2 * FEC_CODEWORD_LEN)
+FEC_GF_LOG = bytearray(FEC_CODEWORD_LEN + 1)
+_x = 1
+for _i in range(FEC_CODEWORD_LEN):
+    FEC_GF_EXP[_i] = FEC_GF_EXP[_i + FEC_CODEWORD_LEN] = _x
+    FEC_GF_LOG[_x] = _i
+    _x <<= 1
+    if _x & 0x100:
+        _x ^= FEC_POLY
+
+def gf_mul(a, b):
+    return FEC_GF_EXP[FEC_GF_LOG[a] + FEC_GF_LOG[b]] if a and b else 0
+
+fec_encoders = {}
+
+def fec_encoder(parity):
+    """
+    Feedback table of the systematic Reed-Solomon encoder with parity check bytes: entry f is
+    f times the generator (x - alpha^0)..(x - alpha^(parity - 1)) without its leading term, as
+    one big endian integer so the shift register is a single int.
+    """
+    if parity not in fec_encoders:
+        generator = [1]
+        for root in range(parity):
+            generator = [c ^ gf_mul(n, FEC_GF_EXP[root]) for c, n in zip(generator + [0], [0] + generator)]
+        fec_encoders[parity] = [int.from_bytes(bytes(gf_mul(f, g) for g in generator[1:]), 'big') for f in range(256)]
+    return fec_encoders[parity]
+
+def fec_encode(data, parity):
+    """
+    data cut into codewords of up to FEC_CODEWORD_LEN - parity bytes, each followed by its
+    parity bytes, the layout bootloader_stream_read_block expects.
+    """
+    table = fec_encoder(parity)
+    shift = 8 * (parity - 1)
+    mask = (1 << (8 * parity)) - 1
+    step = FEC_CODEWORD_LEN - parity
+    coded = bytearray()
+    for start in range(0, len(data), step):
+        chunk = data[start:start + step]
+        remainder = 0
+        for byte in chunk:
+            remainder = ((remainder << 8) & mask) ^ table[byte ^ (remainder >> shift)]
+        coded += chunk
+        coded += remainder.to_bytes(parity, 'big')
+    return bytes(coded)
+
+def stream_wire_len(block_len, parity):
+    """Bytes a block takes on the line, BL_STREAM_WIRE_LEN in bsp.h."""
+    return block_len + 4 + (parity * -(-(block_len + 4) // (FEC_CODEWORD_LEN - parity)) if parity else 0)
+
+def inject_bit_errors(data, ber):
+    """
+    Link emulator: every bit of data flipped with probability ber, the gaps between errors
+    drawn from the geometric distribution so clean stretches cost nothing.
+    """
+    if not ber:
+        return data
+    data = bytearray(data)
+    bit = -1
+    while True:
+        bit += 1 + int(math.log(1.0 - random.random()) / math.log(1.0 - ber))
+        if bit >= 8 * len(data):
+            return bytes(data)
+        data[bit >> 3] ^= 1 << (bit & 7)
 
 # ----------------------------- Serial Port -----------------------------
 
-def serial_ports():
+def open_serial_port(port, baudrate, **settings):
+    """serial.Serial for port, the simulated bootloader of bl_sim for a sim: port name."""
+    if port.startswith('sim:'):
+        import bl_sim
+        return bl_sim.open_simulated_port(port, baudrate, **settings)
+    return serial.Serial(port, baudrate, **settings)
+
+def serial_port_candidates():
     if sys.platform.startswith('win'):
-        ports = ['COM%s' % (i + 1) for i in range(256)]
+        # The driver knows the ports that exist, no need to try all 256 COM names
+        import serial.tools.list_ports
+        ports = [info.device for info in serial.tools.list_ports.comports()]
     elif sys.platform.startswith('linux') or sys.platform.startswith('cygwin'):
         ports = glob.glob('/dev/tty[A-Za-z]*')
     elif sys.platform.startswith('darwin'):
         ports = glob.glob('/dev/tty.*')
     else:
         raise EnvironmentError('Unsupported platform')
+    return ports
+
+def serial_ports():
+    ports = serial_port_candidates()
 
     result = []
     for port in ports:
@@ -93,7 +684,7 @@ def serial_ports():
 def Serial_Port_Configuration(port):
     global ser
     try:
-        ser = serial.Serial(port, 115200, timeout=2)
+        ser = open_serial_port(port, BL_BAUD_RATE, timeout=2)
     except:
         print("\n   Oops! That was not a valid port")
         port = serial_ports()
@@ -105,13 +696,120 @@ def Serial_Port_Configuration(port):
         return -1
     if ser.is_open:
         print("\n   Port Open Success")
+        if not port.startswith('sim:'):
+            configure_serial_low_latency(ser)
     else:
         print("\n   Port Open Failed")
     return 0
 
+def probe_bootloader(port):
+    """
+    Open port for a moment and send BL_GET_VER, then BL_GET_HELP. Returns (port, version, caps)
+    when a bootloader answers within PROBE_TIMEOUT, caps is None when it has no BL_GET_HELP.
+    None for anything else.
+    """
+    get_ver = bytearray(COMMAND_BL_GET_VER_LEN)
+    seal_frame(COMMAND_BL_GET_VER, 0, get_ver)
+    get_help = bytearray(COMMAND_BL_GET_HELP_LEN)
+    seal_frame(COMMAND_BL_GET_HELP, 0, get_help)
+    try:
+        with open_serial_port(port, BL_BAUD_RATE, timeout=PROBE_TIMEOUT, write_timeout=PROBE_TIMEOUT) as probe:
+            probe.reset_input_buffer()
+            probe.write(get_ver)
+            header = probe.read(2)
+            if len(header) != 2 or header[0] not in (BL_ACK, BL_REPLY) or header[1] != 1:
+                return None
+            version = read_framed_payload(probe.read, 1) if header[0] == BL_REPLY else probe.read(1)
+            if not version:
+                return None
+            probe.write(get_help)
+            header = probe.read(2)
+            caps = None
+            if len(header) == 2 and header[0] == BL_REPLY:
+                help_reply = read_framed_payload(probe.read, header[1])
+                caps = parse_device_caps(help_reply) if help_reply else None
+            elif len(header) == 2 and header[0] == BL_ACK:
+                caps = parse_device_caps(probe.read(header[1]))
+    except (OSError, ValueError, TimeoutError, serial.SerialException):
+        return None
+    return port, version[0], caps
+
+def discover_bootloaders(candidates=None):
+    """
+    Probe all candidate ports in parallel and return [(port, version, caps)] of the ones with
+    a live bootloader. Dead ports cost PROBE_TIMEOUT each, but all at the same time.
+    """
+    if candidates is None:
+        candidates = serial_port_candidates()
+    start = time.perf_counter()
+    with concurrent.futures.ThreadPoolExecutor(max_workers=max(1, min(PROBE_WORKERS, len(candidates)))) as pool:
+        found = [result for result in pool.map(probe_bootloader, candidates) if result]
+    print("\n   Discovery: {0} bootloaders on {1} ports in {2:.0f} ms".format(
+        len(found), len(candidates), (time.perf_counter() - start) * 1000))
+    for port, version, caps in found:
+        print("   {0:<16} Bootloader Ver. : {1:#04x}  {2}".format(port, version,
+              "features {0:#04x}, {1} byte frames".format(caps.features, caps.max_frame_len) if caps else "no BL_GET_HELP"))
+    return found
+
+def configure_serial_low_latency(port):
+    """
+    Large driver buffers on Windows, ASYNC_LOW_LATENCY on Linux so received bytes are handed
+    over at once instead of on the driver timer. Drivers without support are left as they are.
+    """
+    try:
+        if sys.platform.startswith('win'):
+            port.set_buffer_size(rx_size=SERIAL_BUFFER_SIZE, tx_size=SERIAL_BUFFER_SIZE)
+        elif sys.platform.startswith('linux'):
+            import fcntl
+            serial_struct = bytearray(128)
+            fcntl.ioctl(port.fileno(), TIOCGSERIAL, serial_struct)
+            flags = struct.unpack_from('i', serial_struct, 16)[0]
+            struct.pack_into('i', serial_struct, 16, flags | ASYNC_LOW_LATENCY)
+            fcntl.ioctl(port.fileno(), TIOCSSERIAL, serial_struct)
+    except (OSError, AttributeError, ValueError):
+        print("\n   Low latency settings are not supported by this port")
+
 def read_serial_port(length):
+    global reply_pending
+    if reply_pending:
+        data, reply_pending = reply_pending[:length], reply_pending[length:]
+        return data + (ser.read(length - len(data)) if len(data) < length else b'')
     return ser.read(length)
 
+def read_framed_payload(read, length):
+    """
+    Rest of a BL_REPLY frame whose length byte was length. Returns the payload, None when the
+    CRC does not match, and raises TimeoutError when the frame is cut short.
+    """
+    rest = read(length + 4)
+    if len(rest) < length + 4:
+        raise TimeoutError
+    frame = bytes([BL_REPLY, length]) + rest[:length]
+    if get_crc(frame, len(frame)) != struct.unpack_from('<I', rest, length)[0]:
+        return None
+    return rest[:length]
+
+def read_reply_frame():
+    """
+    Read one reply. Returns the data following an ACK or the payload of a framed reply,
+    None for a NACK, an unexpected byte or a framed reply with a bad CRC, and raises
+    TimeoutError when the device does not answer.
+    """
+    ack = ser.read(1)
+    if not ack:
+        raise TimeoutError
+    if ack[0] not in (BL_ACK, BL_REPLY):
+        return None
+    follow_len = ser.read(1)
+    if not follow_len:
+        raise TimeoutError
+    if ack[0] == BL_REPLY:
+        return read_framed_payload(ser.read, follow_len[0])
+    reply = ser.read(follow_len[0])
+    if len(reply) < follow_len[0]:
+        raise TimeoutError
+    return reply
+
 def Close_serial_port():
     if ser:
         ser.close()
@@ -119,14 +817,229 @@ def Close_serial_port():
 def purge_serial_port():
     ser.reset_input_buffer()
 
-def Write_to_serial_port(value, *length):
-    data = struct.pack('>B', value)
+def Write_to_serial_port(frame):
+    global serial_writes, frames_sent, line_idle_at
+    if bus_address is not None and not (frame[1] == COMMAND_BL_NODE and frame[2] in BL_NODE_BARE_OPS):
+        frame = encode_frame(COMMAND_BL_NODE, bytes([BL_NODE_FOR, bus_address]) + bytes(frame))
     if verbose_mode:
-        value = bytearray(data)
-        print("   0x{:02x}".format(value[0]), end=' ')
-    if mem_write_active and (not verbose_mode):
-        print("#", end=' ')
-    ser.write(data)
+        print("   " + frame.hex(' '))
+    ser.write(frame)
+    line_idle_at = max(line_idle_at, time.perf_counter()) + len(frame) * 10.0 / ser.baudrate
+    serial_writes += 1
+    frames_sent += 1
+
+# ----------------------------- Pipelined Transfer -----------------------------
+
+class CreditWindow:
+    """
+    Frames the host may have sent without a reply. It starts at what the device receive ring
+    alone holds, every reply that carries a credit moves the limit to that credit (capped at
+    limit_max). The device computes the credit from its free buffers, so the host neither
+    overruns it while it erases nor waits on a fixed window while it has room.
+    """
+    def __init__(self, initial, limit_max):
+        self.condition = threading.Condition()
+        self.limit = initial
+        self.limit_max = limit_max
+        self.in_flight = 0
+        self.peak = 0
+
+    def acquire(self):
+        with self.condition:
+            while self.in_flight >= self.limit:
+                self.condition.wait()
+            self.in_flight += 1
+            self.peak = max(self.peak, self.in_flight)
+
+    def release(self, credit=None):
+        with self.condition:
+            self.in_flight -= 1
+            if credit is not None:
+                self.limit = max(1, min(credit, self.limit_max))
+            self.condition.notify_all()
+
+def reply_credit(reply):
+    """Receive credit of a session MEM_WRITE reply, None when the reply has none."""
+    if reply and len(reply) == 3 and reply[0] == Flash_HAL_OK:
+        return struct.unpack_from('<H', reply, 1)[0]
+    return None
+
+def run_mem_write_pass(start_mem_address, extents, offset, progress):
+    """
+    Send the extents of app_image from offset on as MEM_WRITE frames. Framing (slice, CRC),
+    transmit and reply parsing run as separate stages joined by bounded queues. At most
+    pipeline_window frames wait for their reply until the device grants credits. The device
+    answers in order, so every reply belongs to the oldest frame in flight.
+    Returns (status, resume_offset, bytes_acked), status one of 'done', 'restart', 'nack',
+    'error' and 'timeout'. After 'restart' and 'nack' the caller sends again from resume_offset,
+    after 'timeout' it is the frame that got no reply.
+    """
+    global session_restart_address
+    frames = queue.Queue(PIPELINE_QUEUE_DEPTH)
+    in_flight = queue.Queue()
+    global pipeline_peak
+    # A two wire bus is half duplex, the next frame waits for the reply
+    limit_max = 1 if bus_address is not None else PIPELINE_MAX_WINDOW
+    window = CreditWindow(min(pipeline_window, limit_max), limit_max)
+    stop = threading.Event()
+
+    def frame_stage():
+        image = memoryview(app_image.data)
+        for start, length in extents:
+            chunk_offset = max(offset, start)
+            while chunk_offset < start + length and not stop.is_set():
+                chunk_len = min(mem_write_chunk, start + length - chunk_offset)
+                chunk_len = bus_chunk_len(chunk_len)
+                frame = bytearray(COMMAND_BL_MEM_WRITE_LEN + chunk_len)
+                struct.pack_into('<IB', frame, 2, start_mem_address + chunk_offset, chunk_len)
+                frame[7:7 + chunk_len] = image[chunk_offset:chunk_offset + chunk_len]
+                frames.put((chunk_offset, chunk_len, seal_frame(COMMAND_BL_MEM_WRITE, 5 + chunk_len, frame)))
+                chunk_offset += chunk_len
+        frames.put(None)
+
+    def transmit_stage():
+        while True:
+            item = frames.get()
+            if item is None:
+                break
+            if stop.is_set():
+                continue    # keep draining so the frame stage can finish
+            window.acquire()
+            if stop.is_set():
+                window.release()
+                continue
+            Write_to_serial_port(item[2])
+            in_flight.put(item)
+        in_flight.put(None)
+
+    stages = [threading.Thread(target=frame_stage, daemon=True),
+              threading.Thread(target=transmit_stage, daemon=True)]
+    for stage in stages:
+        stage.start()
+
+    status, resume_offset, bytes_acked = 'done', None, 0
+    device_alive = True
+    while True:
+        item = in_flight.get()
+        if item is None:
+            break
+        chunk_offset, chunk_len, _ = item
+        reply = b''
+        if device_alive:
+            try:
+                reply = read_reply_frame()
+            except TimeoutError:
+                device_alive = False
+                status, resume_offset = 'timeout', chunk_offset
+                stop.set()
+        window.release(reply_credit(reply))
+        if not device_alive:
+            continue
+
+        if reply is None:
+            # NACK, the frame was corrupted on the way
+            rewind, reason = chunk_offset, 'nack'
+        elif check_session_restart(reply):
+            # The device had to erase a sector it programmed in place, resend from its start
+            rewind, reason = session_restart_address - start_mem_address, 'restart'
+            session_restart_address = None
+        elif reply[0] != Flash_HAL_OK:
+            print("\n   Write_status: {0:#04x} at {1:#010x}".format(reply[0], start_mem_address + chunk_offset))
+            stop.set()
+            status = 'error'
+            continue
+        else:
+            bytes_acked += chunk_len
+            progress(chunk_offset + chunk_len, chunk_len)
+            continue
+
+        # Frames already in flight are still answered, the resend starts at the lowest rewind point
+        stop.set()
+        if status in ('done', 'restart', 'nack'):
+            if resume_offset is None or rewind < resume_offset:
+                resume_offset = rewind
+            if status == 'done' or reason == 'nack':
+                status = reason
+
+    for stage in stages:
+        stage.join()
+    pipeline_peak = max(pipeline_peak, window.peak)
+    if not device_alive:
+        purge_serial_port()
+    return status, resume_offset, bytes_acked
+
+def run_stream_write(base, data, block_len, flags, progress, parity=0, image_id=0):
+    """
+    BL_STREAM data to base: one header frame, then raw blocks of block_len bytes each followed
+    by its CRC, Reed-Solomon coded when parity is set. The device answers once per block with
+    the offset it has checked so far and the blocks it can take beyond it, the host keeps that
+    many (at most STREAM_MAX_IN_FLIGHT bytes) in flight. After a rollback the device drops input
+    until the line is idle, so the blocks in flight are discarded and sent again from the
+    checkpoint it reports. image_id names the image in the device journal. Returns
+    (ret, rollbacks), ret 0 or the negative error.
+    """
+    global serial_writes, pipeline_peak, link_drop_at
+    Write_to_serial_port(encode_frame(COMMAND_BL_STREAM, struct.pack('<IIHBBI', base, len(data), block_len, flags, parity, image_id)))
+    ret = read_bootloader_reply(COMMAND_BL_STREAM)
+    if ret < 0:
+        return ret, 0
+    if stream_checkpoint is None or stream_checkpoint[0] != Flash_HAL_OK:
+        return -1, 0
+
+    max_blocks = max(1, STREAM_MAX_IN_FLIGHT // block_len)
+    window = min(stream_checkpoint[2], max_blocks)
+    image = memoryview(data)
+    in_flight = collections.deque()
+    sent = acked = rollbacks = stalled = 0
+    while acked < len(data):
+        while len(in_flight) < window and sent < len(data):
+            if link_drop_at is not None and sent >= link_drop_at:
+                print("\n   Link emulator: link cut at offset {0}".format(sent))
+                link_drop_at = None
+                # the blocks already handed to the adapter still reach the device
+                ser.flush()
+                time.sleep(len(in_flight) * stream_wire_len(block_len, parity) * 10.0 / ser.baudrate)
+                return -2, rollbacks
+            block = bytes(image[sent:sent + block_len])
+            block += struct.pack('<I', get_crc(block, len(block)))
+            ser.write(inject_bit_errors(fec_encode(block, parity) if parity else block, link_ber))
+            serial_writes += 1
+            sent += len(block) - 4
+            in_flight.append(sent)
+            pipeline_peak = max(pipeline_peak, len(in_flight))
+        try:
+            reply = read_reply_frame()
+        except TimeoutError:
+            print("\n   Timeout: no checkpoint after image offset {0}".format(acked))
+            return -2, rollbacks
+        if reply is None or len(reply) < BL_STREAM_FORMAT.size:
+            print("\n   Checkpoint reply corrupted after image offset {0}".format(acked))
+            return -1, rollbacks
+        status, offset, credit = BL_STREAM_FORMAT.unpack_from(reply)
+        window = min(max(credit, 1), max_blocks)
+        if status == Flash_HAL_OK and offset == in_flight[0]:
+            progress(offset, offset - acked)
+            acked = in_flight.popleft()
+            stalled = 0
+        elif status == BL_STREAM_ROLLBACK:
+            rollbacks += 1
+            stalled += 1
+            if stalled > STREAM_ROLLBACK_LIMIT:
+                print("\n   Stream: giving up after {0} rollbacks at image offset {1}".format(STREAM_ROLLBACK_LIMIT, offset))
+                return -1, rollbacks
+            print("\n   Stream: block CRC FAIL, resending from image offset {0}".format(offset))
+            # flush only hands the blocks still in flight to the adapter, the device discards
+            # them as they arrive and then needs BL_STREAM_GAP_MS of silence
+            ser.flush()
+            time.sleep(len(in_flight) * stream_wire_len(block_len, parity) * 10.0 / ser.baudrate +
+                       2 * BL_STREAM_GAP_MS / 1000.0)
+            purge_serial_port()
+            in_flight.clear()
+            sent = acked = offset
+        else:
+            print("\n   Stream status: {0:#04x} at image offset {1}".format(status, offset))
+            return -1, rollbacks
+    return 0, rollbacks
 
 # ----------------------------- Command Processing -----------------------------
 
@@ -135,6 +1048,179 @@ def process_COMMAND_BL_GET_VER(length):
     value = bytearray(ver)
     print("\n   Bootloader Ver. : ", hex(value[0]))
 
+def process_COMMAND_BL_GET_HELP(length):
+    global device_caps
+    reply = read_serial_port(length)
+    device_caps = parse_device_caps(reply)
+    if device_caps is None:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    caps = device_caps
+    print("\n   Bootloader Ver. : ", hex(caps.version))
+    print("   Commands        : " + " ".join("{0:#04x}".format(code) for code in caps.commands))
+    print("   Max frame       : {0} bytes, receive ring {1} bytes".format(caps.max_frame_len, caps.rx_ring_len))
+    print("   Features        : {0:#04x}  CRC modes: {1:#04x}  Baud: {2}".format(caps.features, caps.crc_modes, caps.baud_rate))
+    print("   Work buffer     : {0} bytes at {1:#010x}".format(caps.work_buffer_len, caps.work_buffer_addr))
+    print("   Flash sectors   : " + " ".join("{0:#010x}".format(base) for base in caps.sector_base))
+
+def process_COMMAND_BL_GET_CID(length):
+    global device_cid
+    reply = read_serial_port(length)
+    if len(reply) < BL_CID_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    idcode, uid0, uid1, uid2, digest_len, digest = BL_CID_FORMAT.unpack_from(reply)
+    device_cid = DeviceCid(idcode, struct.pack('<3I', uid0, uid1, uid2).hex(), digest_len, digest)
+    print("\n   Chip ID : {0:#05x} rev {1:#06x}  UID : {2}".format(idcode & 0xFFF, idcode >> 16, device_cid.uid))
+    if digest_len:
+        print("   Digest  : {0:#010x} over {1} bytes".format(digest, digest_len))
+
+def process_COMMAND_BL_COMMIT(length):
+    global commit_result
+    reply = read_serial_port(length)
+    if len(reply) < BL_COMMIT_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    status, sectors_erased, _, crc, cycles = BL_COMMIT_FORMAT.unpack_from(reply)
+    commit_result = CommitResult(status, sectors_erased, crc, cycles)
+    print("\n   Commit status: {0:#04x}  sectors erased: {1}  crc: {2:#010x}  cycles: {3}".format(
+        status, sectors_erased, crc, cycles))
+
+def process_COMMAND_BL_STREAM(length):
+    global stream_checkpoint
+    reply = read_serial_port(length)
+    if len(reply) < BL_STREAM_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    stream_checkpoint = BL_STREAM_FORMAT.unpack_from(reply)
+    print("\n   Stream status: {0:#04x}  offset: {1}  credit: {2} blocks".format(*stream_checkpoint))
+
+def process_COMMAND_BL_JOURNAL(length):
+    global journal_state
+    reply = read_serial_port(length)
+    if len(reply) < BL_JOURNAL_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    status, erased_mask, block_len, image_id, base, length, verified, first_block, crc_count = BL_JOURNAL_FORMAT.unpack_from(reply)
+    block_crcs = list(struct.unpack_from('<{0}I'.format(crc_count), reply, BL_JOURNAL_FORMAT.size))
+    journal_state = Journal(status, erased_mask, block_len, image_id, base, length, verified, block_crcs)
+    if status == BL_JOURNAL_EMPTY:
+        print("\n   Journal: empty")
+        return
+    print("\n   Journal: image {0:#010x}, {1} of {2} bytes at {3:#010x} verified, erased sectors {4:#04x}".format(
+        image_id, verified, length, base, erased_mask))
+
+def process_COMMAND_BL_NODE(length):
+    global node_status, node_digests, node_address
+    reply = read_serial_port(length)
+    if not reply:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    if node_op == BL_NODE_ASSIGN and len(reply) >= 2:
+        if reply[0] == Flash_HAL_OK:
+            node_address = reply[1]
+        print("\n   Node address: {0}{1}".format(reply[1], "" if reply[0] == Flash_HAL_OK else " (refused)"))
+    elif node_op == BL_NODE_STATUS and len(reply) >= BL_NODE_STATUS_FORMAT.size:
+        fields = BL_NODE_STATUS_FORMAT.unpack_from(reply)
+        node_status = NodeStatus(*fields[:6], struct.pack('<3I', *fields[6:]).hex())
+        print("\n   Node {0}: UID {1}, session {2}, status {3:#04x}, erased sectors {4:#04x}, {5} chunks queued, "
+              "{6} CRC failures".format(node_status.address, node_status.uid, "open" if node_status.session_active else "closed",
+                                        node_status.session_status, node_status.erased_mask, node_status.slots_queued,
+                                        node_status.crc_failures))
+    elif node_op == BL_NODE_DIGEST:
+        if reply[0] != Flash_HAL_OK:
+            print("\n   Digest: invalid range")
+            return
+        node_digests = list(struct.unpack_from('<{0}I'.format((len(reply) - 1) // 4), reply, 1))
+        print("\n   Digests: {0} blocks".format(len(node_digests)))
+    else:
+        print("\n   Timeout: Bootloader is not responding")
+
+def read_node_enum(slot_time):
+    """
+    Collect the BL_NODE_ENUM answers once the slot_time seconds of slots are over, and the line
+    stayed idle long enough for the nodes that lost the frame sync in a collision. Returns the
+    UIDs (hex) of the replies that came through and the number of bytes that belong to none,
+    what collisions leave on the line.
+    """
+    time.sleep(max(0.0, line_idle_at + slot_time + 2 * BL_NODE_GAP_MS / 1000.0 - time.perf_counter()))
+    data = read_serial_port(ser.in_waiting)
+    uids, garbled, index = [], 0, 0
+    while index < len(data):
+        frame = data[index:index + BL_NODE_ENUM_REPLY_LEN]
+        if (len(frame) == BL_NODE_ENUM_REPLY_LEN and frame[0] == BL_REPLY and frame[1] == 12 and
+                get_crc(frame, 14) == struct.unpack_from('<I', frame, 14)[0]):
+            uids.append(frame[2:14].hex())
+            index += BL_NODE_ENUM_REPLY_LEN
+        else:
+            garbled += 1
+            index += 1
+    return uids, garbled
+
+def process_COMMAND_BL_EXEC_STUB(length):
+    global stub_result
+    reply = read_serial_port(length)
+    if len(reply) < BL_STUB_RESULT_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    fields = BL_STUB_RESULT_FORMAT.unpack_from(reply)
+    stub_result = StubResult(fields[0], fields[1], fields[2], list(fields[3:]))
+    print("\n   Stub status: {0}  returned: {1:#x}  cycles: {2}".format(
+        BL_STUB_STATUS.get(stub_result.status, hex(stub_result.status)), stub_result.stub_status, stub_result.cycles))
+    print("   Results    : " + " ".join("{0:#010x}".format(value) for value in stub_result.result))
+
+def format_bench_report(bench):
+    """
+    Lines of the BL_BENCH report for a BenchResult, used for live runs and for archived ones.
+    """
+    hz = float(bench.sysclk_hz or 1)
+
+    def rate(length, cycles):
+        return "{0:10.2f} MB/s".format(length * hz / cycles / 1e6) if cycles else "   skipped     "
+
+    def per_unit(cycles, count, unit):
+        return "{0:8.2f} us/{1}  ({2:.0f} cycles)".format(cycles * 1e6 / hz / count, unit, cycles / count) if cycles else ""
+
+    lines = ["   ---------------- Bootloader benchmark ----------------",
+             "   SYSCLK              : {0:.1f} MHz".format(bench.sysclk_hz / 1e6)]
+    if bench.scratch_sector == BL_SECTOR_NONE:
+        lines.append("   Flash tests         : skipped, no scratch sector")
+    else:
+        lines.append("   Flash tests         : sector {0}, status {1:#04x}".format(bench.scratch_sector, bench.status))
+        lines.append("   Sector erase        : " + ("{0:10.2f} ms".format(bench.erase_cycles * 1e3 / hz)
+                                                      if bench.erase_cycles else "   skipped"))
+        lines.append("   Word program        : {0} {1}".format(rate(bench.program_len, bench.program_word_cycles),
+                                                                per_unit(bench.program_word_cycles, bench.program_len // 4, "word")))
+        lines.append("   Byte program        : {0} {1}".format(rate(bench.byte_len, bench.program_byte_cycles),
+                                                                per_unit(bench.program_byte_cycles, bench.byte_len, "byte")))
+    lines.append("   CRC byte mode       : {0}".format(rate(bench.crc_len, bench.crc_byte_cycles)))
+    lines.append("   CRC word mode       : {0}".format(rate(bench.crc_len, bench.crc_word_cycles)))
+    lines.append("   SRAM memcpy         : {0}".format(rate(bench.copy_len, bench.memcpy_cycles)))
+    lines.append("   UART round trip     : " + ("{0:10.1f} us for {1} bytes".format(bench.uart_rtt_cycles * 1e6 / hz, bench.ping_len)
+                                                if bench.uart_rtt_cycles else "   no echo"))
+    return lines
+
+def process_COMMAND_BL_BENCH(length):
+    global bench_result
+    ping_len = length - BL_BENCH_FORMAT.size
+    ping = read_serial_port(ping_len) if ping_len > 0 else b''
+    if len(ping) != max(ping_len, 0):
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    # Echo right away, the device times the round trip
+    ser.write(ping)
+    saved_timeout = ser.timeout
+    ser.timeout = BENCH_TIMEOUT
+    try:
+        reply = read_serial_port(BL_BENCH_FORMAT.size)
+    finally:
+        ser.timeout = saved_timeout
+    if len(reply) < BL_BENCH_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    bench_result = BenchResult(*BL_BENCH_FORMAT.unpack_from(reply))
+    print("\n" + "\n".join(format_bench_report(bench_result)))
+
 def process_COMMAND_BL_GO_TO_ADDR(length):
     addr_status = read_serial_port(length)
     addr_status = bytearray(addr_status)
@@ -159,9 +1245,19 @@ def process_COMMAND_BL_FLASH_ERASE(length):
     else:
         print("Timeout: Bootloader is not responding")
 
+def check_session_restart(reply):
+    global session_restart_address
+    if len(reply) >= 5 and reply[0] == BL_SESSION_RESTART:
+        session_restart_address = struct.unpack_from('<I', reply, 1)[0]
+        print("\n   Session restart: resending from {0:#010x}".format(session_restart_address))
+        return True
+    return False
+
 def process_COMMAND_BL_MEM_WRITE(length):
     write_status = read_serial_port(length)
     write_status = bytearray(write_status)
+    if check_session_restart(write_status):
+        return
     if write_status[0] == Flash_HAL_OK:
         print("\n   Write_status: FLASH_HAL_OK")
     elif write_status[0] == Flash_HAL_ERROR:
@@ -176,110 +1272,305 @@ def process_COMMAND_BL_MEM_WRITE(length):
         print("\n   Write_status: UNKNOWN_ERROR")
     print("\n")
 
+def process_COMMAND_BL_GET_STATS(length):
+    stats = read_serial_port(length)
+    if len(stats) < BL_STATS_FORMAT.size:
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    (frames_rx, bytes_programmed, crc_failures, nacks_sent, uart_overrun, uart_framing,
+     sysclk_hz, session_ms, cycles_rx, cycles_crc, cycles_program, cycles_erase,
+     cycles_log, sector_erases, words_skipped, bytes_copied, cycles_ram_copy,
+     fec_codewords, fec_corrected, fec_failures, cycles_fec) = BL_STATS_FORMAT.unpack_from(stats)
+
+    print("\n   ---------------- Bootloader session profile ----------------")
+    print("   Frames received     : {0}".format(frames_rx))
+    print("   Bytes programmed    : {0}".format(bytes_programmed))
+    print("   CRC failures        : {0}".format(crc_failures))
+    print("   NACKs sent          : {0}".format(nacks_sent))
+    print("   UART overrun errors : {0}".format(uart_overrun))
+    print("   UART framing errors : {0}".format(uart_framing))
+    print("   Sector erases       : {0}".format(sector_erases))
+    print("   Words skipped       : {0}".format(words_skipped))
+    print("   Bytes copied to RAM : {0}".format(bytes_copied))
+    if fec_codewords or fec_failures:
+        print("   FEC repaired        : {0} bytes in {1} codewords, {2} beyond repair".format(
+            fec_corrected, fec_codewords, fec_failures))
+    print("   Session time        : {0} ms".format(session_ms))
+    if not sysclk_hz:
+        return
+    phases = [("receive", cycles_rx), ("crc", cycles_crc), ("flash program", cycles_program),
+              ("flash erase", cycles_erase), ("ram copy", cycles_ram_copy), ("fec decode", cycles_fec),
+              ("logging", cycles_log)]
+    for name, cycles in phases:
+        ms = cycles * 1000.0 / sysclk_hz
+        share = (100.0 * ms / session_ms) if session_ms else 0.0
+        print("   {0:<20}: {1:10.1f} ms  ({2:5.1f} %)".format(name, ms, share))
+    if session_ms and bytes_programmed:
+        print("   Programming rate    : {0:.1f} bytes/s".format(bytes_programmed * 1000.0 / session_ms))
+    if bytes_copied:
+        print("   RAM copy cost       : {0:.2f} cycles/byte".format(cycles_ram_copy / bytes_copied))
+    if bytes_programmed:
+        print("   Flash program cost  : {0:.2f} cycles/byte".format(cycles_program / bytes_programmed))
+    print("   Dominant phase      : {0}".format(max(phases, key=lambda p: p[1])[0]))
+
+def process_COMMAND_BL_SESSION(length):
+    session_status = read_serial_port(length)
+    if not len(session_status):
+        print("\n   Timeout: Bootloader is not responding")
+        return
+    session_status = bytearray(session_status)
+    if check_session_restart(session_status):
+        return
+    if session_status[0] == Flash_HAL_OK:
+        print("\n   Session status: FLASH_HAL_OK")
+    elif session_status[0] == Flash_HAL_ERROR:
+        print("\n   Session status: FLASH_HAL_ERROR")
+    elif session_status[0] == Flash_HAL_BUSY:
+        print("\n   Session status: FLASH_HAL_BUSY")
+    elif session_status[0] == Flash_HAL_TIMEOUT:
+        print("\n   Session status: FLASH_HAL_TIMEOUT")
+    elif session_status[0] == Flash_HAL_INV_ADDR:
+        print("\n   Session status: FLASH_HAL_INV_ADDR")
+    else:
+        print("\n   Session status: UNKNOWN_ERROR")
+
 # ----------------------------- Command Decoding -----------------------------
 def decode_menu_command_code(command, *args):
     ret_value = 0
-    data_buf = [0] * 255
 
     if command == 0:
         print("\n   Exiting...!")
         raise SystemExit
     elif command == 1:
         print("\n   Command == > BL_GET_VER")
-        data_buf[0] = COMMAND_BL_GET_VER_LEN - 1
-        data_buf[1] = COMMAND_BL_GET_VER
-        crc32 = get_crc(data_buf, COMMAND_BL_GET_VER_LEN - 4)
-        crc32 &= 0xFFFFFFFF
-        data_buf[2:6] = [word_to_byte(crc32, i, 1) for i in range(1, 5)]
-
-        Write_to_serial_port(data_buf[0], 1)
-        for i in data_buf[1:COMMAND_BL_GET_VER_LEN]:
-            Write_to_serial_port(i, COMMAND_BL_GET_VER_LEN - 1)
-
-        ret_value = read_bootloader_reply(data_buf[1])
+        Write_to_serial_port(encode_frame(COMMAND_BL_GET_VER))
+        ret_value = read_bootloader_reply(COMMAND_BL_GET_VER)
+
+    elif command == 8:
+        print("\n   Command == > BL_GET_HELP")
+        global device_caps
+        device_caps = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_GET_HELP))
+        ret_value = read_bootloader_reply(COMMAND_BL_GET_HELP)
+
+    elif command == 9:
+        print("\n   Command == > BL_GET_CID")
+        digest_base = args[0] if args else int(input("\n   Enter the digest base address here (0 for none):"), 16)
+        digest_len = args[1] if args else int(input("\n   Enter the digest length in bytes here:"))
+        global device_cid
+        device_cid = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_GET_CID, struct.pack('<II', digest_base, digest_len)))
+        ret_value = read_bootloader_reply(COMMAND_BL_GET_CID)
 
     elif command == 2:
         print("\n   Command == > BL_GO_TO_ADDR")
         go_address = args[0] if args else int(input("\n   Please enter 4 bytes go address in hex:"), 16)
-        data_buf[0] = COMMAND_BL_GO_TO_ADDR_LEN - 1
-        data_buf[1] = COMMAND_BL_GO_TO_ADDR
-        data_buf[2:6] = [word_to_byte(go_address, i, 1) for i in range(1, 5)]
-        crc32 = get_crc(data_buf, COMMAND_BL_GO_TO_ADDR_LEN - 4)
-        data_buf[6:10] = [word_to_byte(crc32, i, 1) for i in range(1, 5)]
-
-        Write_to_serial_port(data_buf[0], 1)
-        for i in data_buf[1:COMMAND_BL_GO_TO_ADDR_LEN]:
-            Write_to_serial_port(i, COMMAND_BL_GO_TO_ADDR_LEN - 1)
-
-        ret_value = read_bootloader_reply(data_buf[1])
+        Write_to_serial_port(encode_frame(COMMAND_BL_GO_TO_ADDR, struct.pack('<I', go_address)))
+        ret_value = read_bootloader_reply(COMMAND_BL_GO_TO_ADDR)
 
     elif command == 3:
         print("\n   Command == > BL_FLASH_ERASE")
         sector_num = args[0] if args else int(input("\n   Enter sector number(0-7 or 0xFF) here:"), 16)
         nsec = args[1] if args else int(input("\n   Enter number of sectors to erase(max 8) here:"))
-
-        data_buf[0] = COMMAND_BL_FLASH_ERASE_LEN - 1
-        data_buf[1] = COMMAND_BL_FLASH_ERASE
-        data_buf[2] = sector_num
-        data_buf[3] = nsec
-        crc32 = get_crc(data_buf, COMMAND_BL_FLASH_ERASE_LEN - 4)
-        data_buf[4:8] = [word_to_byte(crc32, i, 1) for i in range(1, 5)]
-
-        Write_to_serial_port(data_buf[0], 1)
-        for i in data_buf[1:COMMAND_BL_FLASH_ERASE_LEN]:
-            Write_to_serial_port(i, COMMAND_BL_FLASH_ERASE_LEN - 1)
-
-        ret_value = read_bootloader_reply(data_buf[1])
+        Write_to_serial_port(encode_frame(COMMAND_BL_FLASH_ERASE, bytes([sector_num, nsec])))
+        # The device answers once every sector is erased
+        saved_timeout = ser.timeout
+        ser.timeout = max(saved_timeout, SECTOR_ERASE_TIMEOUT * (len(FLASH_SECTOR_BASE) - 1 if sector_num == 0xFF else nsec))
+        try:
+            ret_value = read_bootloader_reply(COMMAND_BL_FLASH_ERASE)
+        finally:
+            ser.timeout = saved_timeout
 
     elif command == 4:
         print("\n   Command == > BL_MEM_WRITE")
-        bytes_remaining = 0
-        t_len_of_file = 0
+        if args:
+            start_mem_address = args[0]
+        elif app_image.format != 'bin':
+            start_mem_address = app_image.base
+        else:
+            start_mem_address = int(input("\n   Enter the memory write address here:"), 16)
+        offset = args[1] if len(args) > 1 else 0
         bytes_so_far_sent = 0
-        len_to_read = 0
-        base_mem_address = args[0] if args else int(input("\n   Enter the memory write address here:"), 16)
-
-        data_buf[1] = COMMAND_BL_MEM_WRITE
-
-        t_len_of_file = calc_file_len()
-        open_the_file()
 
-        bytes_remaining = t_len_of_file - bytes_so_far_sent
-        global mem_write_active
-        mem_write_active = 1
-
-        while bytes_remaining:
-            if bytes_remaining >= 128:  # Changed from 128 to 10
-                len_to_read = 128  # Changed from 128 to 10
-            else:
-                len_to_read = bytes_remaining
+        t_len_of_file = len(app_image.data)
 
-            for x in range(len_to_read):
-                file_read_value = bin_file.read(1)
-                file_read_value = bytearray(file_read_value)
-                data_buf[7 + x] = int(file_read_value[0])
-
-            data_buf[2:6] = [word_to_byte(base_mem_address, i, 1) for i in range(1, 5)]
-            data_buf[6] = len_to_read
-
-            mem_write_cmd_total_len = COMMAND_BL_MEM_WRITE_LEN + len_to_read
-            data_buf[0] = mem_write_cmd_total_len - 1
-
-            crc32 = get_crc(data_buf, mem_write_cmd_total_len - 4)
-            data_buf[7 + len_to_read:11 + len_to_read] = [word_to_byte(crc32, i, 1) for i in range(1, 5)]
-
-            Write_to_serial_port(data_buf[0], 1)
-            for i in data_buf[1:mem_write_cmd_total_len]:
-                Write_to_serial_port(i, mem_write_cmd_total_len - 1)
-
-            base_mem_address += len_to_read
-            bytes_so_far_sent += len_to_read
-            bytes_remaining = t_len_of_file - bytes_so_far_sent
-            print("\n   bytes_so_far_sent:{0} -- bytes_remaining:{1}\n".format(bytes_so_far_sent, bytes_remaining))
-
-            ret_value = read_bootloader_reply(data_buf[1])
-
-        mem_write_active = 0
+        # Gaps between segments are not part of the image and are never sent.
+        # Sparse upload needs the whole range erased by the device, which lazy and compare sessions do not do
+        sparse = sparse_upload and not (use_write_session and (session_flags & (BL_SESSION_LAZY_ERASE | BL_SESSION_COMPARE)))
+        if sparse:
+            extents = [(seg_offset + start, length) for seg_offset, seg_len in app_image.segments
+                       for start, length in get_image_extents(app_image.data[seg_offset:seg_offset + seg_len])]
+            print("\n   Sparse upload: {0} extents, {1} of {2} bytes".format(
+                len(extents), sum(length for _, length in extents), t_len_of_file))
+        else:
+            extents = app_image.segments
+
+        global session_restart_address, serial_writes, frames_sent, pipeline_peak
+        session_restart_address = None
+        serial_writes = frames_sent = pipeline_peak = 0
+        write_start = time.perf_counter()
+        cpu_start = time.process_time()
+        last_progress = write_start
+
+        def progress(image_offset, chunk_len):
+            nonlocal bytes_so_far_sent, last_progress
+            bytes_so_far_sent += chunk_len
+            now = time.perf_counter()
+            if now - last_progress >= PROGRESS_INTERVAL:
+                last_progress = now
+                print("\n   bytes_so_far_sent:{0} -- image offset:{1} of {2}\n".format(bytes_so_far_sent, image_offset, t_len_of_file))
+
+        # A session stops answering while its queue is full and a sector erases, the credits
+        # keep the host from overrunning it meanwhile
+        saved_timeout = ser.timeout
+        if use_write_session:
+            ser.timeout = max(saved_timeout, FLASH_STALL_TIMEOUT)
+        retries = 0
+        while offset is not None:
+            status, offset, _ = run_mem_write_pass(start_mem_address, extents, offset, progress)
+            if status == 'nack':
+                retries += 1
+                if retries > MEM_WRITE_RETRIES:
+                    print("\n   CRC: FAIL, giving up after {0} resends".format(MEM_WRITE_RETRIES))
+                    ret_value = -1
+                    break
+                print("\n   CRC: FAIL, resending from image offset {0}".format(offset))
+            elif status == 'timeout':
+                ret_value = -2
+                break
+            elif status == 'error':
+                ret_value = -1
+                break
+        ser.timeout = saved_timeout
+
+        elapsed = time.perf_counter() - write_start
+        cpu_time = time.process_time() - cpu_start
+        print("\n   Bytes sent: {0} for a {1} byte image".format(bytes_so_far_sent, t_len_of_file))
+        if frames_sent and elapsed:
+            # Time the frames need on the wire at 10 bits per byte, the rest of the wall time the link idles
+            wire_time = (bytes_so_far_sent + frames_sent * COMMAND_BL_MEM_WRITE_LEN) * 10.0 / ser.baudrate
+            megabytes = max(bytes_so_far_sent, 1) / 1e6
+            print("   Frames: {0}  serial writes/frame: {1:.2f}  link busy: {2:.1f} % of {3:.2f} s".format(
+                frames_sent, serial_writes / frames_sent, 100.0 * wire_time / elapsed, elapsed))
+            print("   Host CPU: {0:.2f} s/MB  link idle: {1:.2f} s/MB  window: {2} frames, {3} at most".format(
+                cpu_time / megabytes, max(elapsed - wire_time, 0.0) / megabytes, pipeline_window, pipeline_peak))
+
+    elif command == 5:
+        print("\n   Command == > BL_GET_STATS")
+        flags = args[0] if args else BL_STATS_CLEAR
+        Write_to_serial_port(encode_frame(COMMAND_BL_GET_STATS, bytes([flags])))
+        ret_value = read_bootloader_reply(COMMAND_BL_GET_STATS)
+
+    elif command == 6:
+        print("\n   Command == > BL_SESSION_BEGIN")
+        base_mem_address = args[0] if args else int(input("\n   Enter the session base address here:"), 16)
+        session_len = args[1] if args else int(input("\n   Enter the session length in bytes here:"))
+        flags = args[2] if len(args) > 2 else 0
+        Write_to_serial_port(encode_frame(COMMAND_BL_SESSION_BEGIN, struct.pack('<IIB', base_mem_address, session_len, flags)))
+        ret_value = read_bootloader_reply(COMMAND_BL_SESSION_BEGIN)
+
+    elif command == 7:
+        print("\n   Command == > BL_SESSION_END")
+        Write_to_serial_port(encode_frame(COMMAND_BL_SESSION_END))
+        # The device answers once the queue is programmed
+        saved_timeout = ser.timeout
+        ser.timeout = max(saved_timeout, SESSION_END_TIMEOUT)
+        try:
+            ret_value = read_bootloader_reply(COMMAND_BL_SESSION_END)
+        finally:
+            ser.timeout = saved_timeout
+
+    elif command == 10:
+        print("\n   Command == > BL_COMMIT")
+        commit_address = args[0] if args else int(input("\n   Enter the flash address to commit to here:"), 16)
+        commit_len = args[1] if args else int(input("\n   Enter the staged length in bytes here:"))
+        staged_crc = args[2] if len(args) > 2 else int(input("\n   Enter the digest of the staged data here:"), 16)
+        global commit_result
+        commit_result = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_COMMIT, struct.pack('<III', commit_address, commit_len, staged_crc)))
+        ret_value = read_bootloader_reply(COMMAND_BL_COMMIT)
+
+    elif command == 11:
+        print("\n   Command == > BL_EXEC_STUB")
+        stub_base = args[0] if args else int(input("\n   Enter the stub image address here:"), 16)
+        stub_args = (list(args[1:]) if args else
+                     [int(value, 0) for value in input("\n   Enter up to 4 stub arguments here:").split()])
+        stub_args = (stub_args + [0] * 4)[:4]
+        global stub_result
+        stub_result = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_EXEC_STUB, struct.pack('<5I', stub_base, *stub_args)))
+        ret_value = read_bootloader_reply(COMMAND_BL_EXEC_STUB)
+
+    elif command == 12:
+        print("\n   Command == > BL_BENCH")
+        scratch_sector = args[0] if args else int(input("\n   Enter the scratch sector to erase (2-7, 0xFF for none) here:"), 16)
+        global bench_result
+        bench_result = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_BENCH, bytes([scratch_sector])))
+        ret_value = read_bootloader_reply(COMMAND_BL_BENCH)
+
+    elif command == 13:
+        print("\n   Command == > BL_STREAM")
+        block_len = args[0] if args else int(input("\n   Enter the checkpoint interval in bytes here:"))
+        flags = args[1] if len(args) > 1 else 0
+        parity = args[2] if len(args) > 2 else 0
+        resume_offset = args[3] if len(args) > 3 else 0
+        global stream_checkpoint, stream_rollbacks
+        stream_checkpoint = None
+        pipeline_peak = 0
+        image_len = len(app_image.data) - resume_offset
+        bytes_so_far_sent = 0
+        stream_start = time.perf_counter()
+        last_progress = stream_start
+
+        def progress(image_offset, block_bytes):
+            nonlocal bytes_so_far_sent, last_progress
+            bytes_so_far_sent += block_bytes
+            now = time.perf_counter()
+            if now - last_progress >= PROGRESS_INTERVAL:
+                last_progress = now
+                print("\n   bytes_so_far_sent:{0} -- image offset:{1} of {2}\n".format(
+                    bytes_so_far_sent, resume_offset + image_offset, len(app_image.data)))
+
+        saved_timeout = ser.timeout
+        ser.timeout = max(saved_timeout, FLASH_STALL_TIMEOUT)
+        try:
+            ret_value, stream_rollbacks = run_stream_write(
+                app_image.base + resume_offset, app_image.data[resume_offset:], block_len,
+                flags | (BL_SESSION_RESUME if resume_offset else 0), progress, parity, image_journal_id(app_image))
+        finally:
+            ser.timeout = saved_timeout
+        elapsed = time.perf_counter() - stream_start
+        rollbacks = stream_rollbacks
+        if ret_value == 0 and elapsed:
+            # Every block carries a 4 byte CRC and its parity, the checkpoint replies travel the other way
+            blocks = -(-image_len // block_len)
+            wire_time = (COMMAND_BL_STREAM_LEN + image_len + (stream_wire_len(block_len, parity) - block_len) * blocks) * 10.0 / ser.baudrate
+            print("\n   Streamed {0} bytes in {1:.2f} s ({2:.0f} bytes/s), {3} checkpoints, {4} rollbacks, link busy: {5:.1f} %".format(
+                image_len, elapsed, image_len / elapsed, blocks, rollbacks, 100.0 * wire_time / elapsed))
+            print("   Blocks in flight: {0} at most".format(pipeline_peak))
+
+    elif command == 14:
+        print("\n   Command == > BL_JOURNAL")
+        first_block = args[0] if args else 0
+        global journal_state
+        journal_state = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_JOURNAL, struct.pack('<H', first_block)))
+        ret_value = read_bootloader_reply(COMMAND_BL_JOURNAL)
+
+    elif command == 15:
+        print("\n   Command == > BL_NODE")
+        op = args[0] if args else int(input("\n   Enter the BL_NODE operation (2-6) here:"), 16)
+        operand = args[1] if len(args) > 1 else bytes.fromhex(input("\n   Enter its operand bytes in hex here:"))
+        global node_op, node_status, node_digests, node_address, node_enum
+        node_op = op
+        node_status = node_digests = node_address = node_enum = None
+        Write_to_serial_port(encode_frame(COMMAND_BL_NODE, bytes([op]) + operand))
+        if op == BL_NODE_ENUM:
+            node_enum = read_node_enum(operand[0] * operand[2] * 10.0 / ser.baudrate)
+            print("\n   Enumeration: {0} UIDs, {1} garbled bytes".format(len(node_enum[0]), node_enum[1]))
+        elif op != BL_NODE_GROUP:
+            ret_value = read_bootloader_reply(COMMAND_BL_NODE)
 
     else:
         print("\n   Please input valid command code\n")
@@ -288,7 +1579,7 @@ def decode_menu_command_code(command, *args):
     if ret_value == -2:
         print("\n   TimeOut : No response from the bootloader")
         print("\n   Reset the board and Try Again !")
-        return
+    return ret_value
 """
 def decode_menu_command_code(command, *args):
     ret_value = 0
@@ -407,53 +1698,858 @@ def read_bootloader_reply(command_code):
     len_to_follow = 0
     ret = -2
 
+    global reply_pending
+    reply_pending = b''
     ack = read_serial_port(2)
     if len(ack):
         a_array = bytearray(ack)
-        if a_array[0] == 0xA5:
+        if a_array[0] == BL_REPLY and len(a_array) == 2:
+            # The whole frame is checked first, the process functions then read the payload
+            try:
+                payload = read_framed_payload(ser.read, a_array[1])
+            except TimeoutError:
+                print("\n   Timeout : Bootloader not responding")
+                return ret
+            if payload is None:
+                print("\n   Reply CRC: FAIL \n")
+                return -1
+            reply_pending = payload
+        if a_array[0] in (BL_ACK, BL_REPLY):
             len_to_follow = a_array[1]
             print("\n   CRC : SUCCESS Len :", len_to_follow)
             if command_code == COMMAND_BL_GET_VER:
                 process_COMMAND_BL_GET_VER(len_to_follow)
+            elif command_code == COMMAND_BL_GET_HELP:
+                process_COMMAND_BL_GET_HELP(len_to_follow)
+            elif command_code == COMMAND_BL_GET_CID:
+                process_COMMAND_BL_GET_CID(len_to_follow)
             elif command_code == COMMAND_BL_GO_TO_ADDR:
                 process_COMMAND_BL_GO_TO_ADDR(len_to_follow)
             elif command_code == COMMAND_BL_FLASH_ERASE:
                 process_COMMAND_BL_FLASH_ERASE(len_to_follow)
             elif command_code == COMMAND_BL_MEM_WRITE:
                 process_COMMAND_BL_MEM_WRITE(len_to_follow)
+            elif command_code == COMMAND_BL_GET_STATS:
+                process_COMMAND_BL_GET_STATS(len_to_follow)
+            elif command_code == COMMAND_BL_COMMIT:
+                process_COMMAND_BL_COMMIT(len_to_follow)
+            elif command_code == COMMAND_BL_EXEC_STUB:
+                process_COMMAND_BL_EXEC_STUB(len_to_follow)
+            elif command_code == COMMAND_BL_BENCH:
+                process_COMMAND_BL_BENCH(len_to_follow)
+            elif command_code == COMMAND_BL_STREAM:
+                process_COMMAND_BL_STREAM(len_to_follow)
+            elif command_code == COMMAND_BL_JOURNAL:
+                process_COMMAND_BL_JOURNAL(len_to_follow)
+            elif command_code == COMMAND_BL_NODE:
+                process_COMMAND_BL_NODE(len_to_follow)
+            elif command_code in (COMMAND_BL_SESSION_BEGIN, COMMAND_BL_SESSION_END):
+                process_COMMAND_BL_SESSION(len_to_follow)
             else:
                 print("\n   Invalid command code\n")
             ret = 0
-        elif a_array[0] == 0x7F:
+        elif a_array[0] == BL_NACK:
             print("\n   CRC: FAIL \n")
             ret = -1
     else:
         print("\n   Timeout : Bootloader not responding")
+    reply_pending = b''
     return ret
 
 # ----------------------------- Automated Process Flow -----------------------------
+def image_on_device():
+    """
+    Ask the device for the digest of every image segment (word aligned) and compare it with
+    the image. Returns True only when all of them match.
+    """
+    for seg_offset, seg_len in app_image.segments:
+        start = (app_image.base + seg_offset) & ~3
+        end = (app_image.base + seg_offset + seg_len + 3) & ~3
+        expected = (b'\xff' * (app_image.base + seg_offset - start) + app_image.data[seg_offset:seg_offset + seg_len])
+        if decode_menu_command_code(9, start, end - start) < 0 or device_cid is None:
+            return False
+        if device_cid.digest_len != end - start or device_cid.digest != get_flash_digest(expected):
+            return False
+    return True
+
+def image_journal_id(image):
+    """ID of image in the device journal: its digest, the range is checked on its own."""
+    return get_flash_digest(image.data)
+
+def find_resume_offset():
+    """
+    Read the device journal and return the image offset a BL_STREAM of app_image can resume
+    from: the end of the journal blocks whose CRC matches the image, confirmed by the device
+    digest of everything before it. 0 when nothing can be kept.
+    """
+    if decode_menu_command_code(14, 0) < 0 or journal_state is None or journal_state.status != Flash_HAL_OK:
+        return 0
+    journal = journal_state
+    if (journal.image_id != image_journal_id(app_image) or journal.base != app_image.base or
+            journal.length != len(app_image.data)):
+        print("\n   Journal is for another image, starting over")
+        return 0
+    block_crcs = list(journal.block_crcs)
+    verified_blocks = journal.verified // journal.block_len
+    while len(block_crcs) < verified_blocks:
+        if decode_menu_command_code(14, len(block_crcs)) < 0 or not journal_state or not journal_state.block_crcs:
+            return 0
+        block_crcs += journal_state.block_crcs
+    offset = 0
+    for block_crc in block_crcs[:verified_blocks]:
+        if block_crc != get_flash_digest(app_image.data[offset:offset + journal.block_len]):
+            break
+        offset += journal.block_len
+    # The journal only says what was programmed, the flash may have changed since
+    if offset and (decode_menu_command_code(9, app_image.base, offset) < 0 or device_cid is None or
+                   device_cid.digest != get_flash_digest(app_image.data[:offset])):
+        print("\n   Flash no longer holds the journaled data, starting over")
+        return 0
+    return offset
+
+def upload_to_ram(address, data):
+    """
+    MEM_WRITE every byte of data to a RAM address. RAM is not erased, so 0xFF runs are sent
+    like everything else. Returns 0 or the negative error.
+    """
+    global app_image, sparse_upload
+    saved_image, saved_sparse = app_image, sparse_upload
+    app_image = AppImage('bin', address, bytes(data), [(0, len(data))], address | 1)
+    sparse_upload = 0
+    try:
+        return decode_menu_command_code(4, address)
+    finally:
+        app_image, sparse_upload = saved_image, saved_sparse
+
+def benchmark_ram_write(address, length):
+    """
+    Send length random bytes to a RAM address with MEM_WRITE and print the device side
+    copy cost next to the host side transfer time. Returns 0 or the negative error.
+    """
+    decode_menu_command_code(5, BL_STATS_CLEAR)
+    start = time.perf_counter()
+    ret = upload_to_ram(address, os.urandom(length))
+    elapsed = time.perf_counter() - start
+    if ret < 0:
+        return ret
+    print("\n   RAM write of {0} bytes at {1:#010x}: {2:.3f} s, {3:.1f} bytes/s".format(
+        length, address, elapsed, length / elapsed if elapsed else 0.0))
+    return decode_menu_command_code(5, BL_STATS_CLEAR)
+
+def measure_command_latency(count=200):
+    """
+    Time count request/reply round trips of BL_GET_VER and of BL_GET_STATS (88 byte reply,
+    counters kept) and print the mean, median and 99th percentile. The reply format, ACK
+    then data or one framed reply, is reported with them. Returns 0 or the negative error.
+    """
+    # encode_frame reuses one buffer, keep copies
+    commands = [("BL_GET_VER", bytes(encode_frame(COMMAND_BL_GET_VER))),
+                ("BL_GET_STATS", bytes(encode_frame(COMMAND_BL_GET_STATS, bytes([0]))))]
+    for name, frame in commands:
+        samples = []
+        framed = False
+        for _ in range(count):
+            start = time.perf_counter()
+            Write_to_serial_port(frame)
+            try:
+                header = ser.read(2)
+                if len(header) < 2:
+                    raise TimeoutError
+                framed = header[0] == BL_REPLY
+                reply = read_framed_payload(ser.read, header[1]) if framed else ser.read(header[1])
+            except TimeoutError:
+                print("\n   {0}: no reply".format(name))
+                return -2
+            samples.append(time.perf_counter() - start)
+            if reply is None:
+                print("\n   {0}: reply CRC failed".format(name))
+                return -1
+        samples.sort()
+        print("   {0:<13}: mean {1:6.2f} ms  median {2:6.2f} ms  p99 {3:6.2f} ms  ({4}, {5} runs)".format(
+            name, 1000 * sum(samples) / count, 1000 * samples[count // 2],
+            1000 * samples[min(count - 1, int(count * 0.99))], "framed reply" if framed else "ACK then data", count))
+    return 0
+
+def run_bench(scratch_sector, archive_path):
+    """
+    Run BL_BENCH and append the result, with the board UID and bootloader version, to the
+    JSON lines archive. Returns 0 or the negative error.
+    """
+    decode_menu_command_code(8)
+    if device_caps is None or not (device_caps.features & BL_FEATURE_BENCH):
+        print("\n   The bootloader has no BL_BENCH")
+        return -1
+    uid = None
+    if COMMAND_BL_GET_CID in device_caps.commands and decode_menu_command_code(9, 0, 0) == 0 and device_cid:
+        uid = device_cid.uid
+    ret = decode_menu_command_code(12, scratch_sector)
+    if ret < 0 or bench_result is None:
+        return ret if ret < 0 else -2
+    record = dict(bench_result._asdict(), time=time.strftime('%Y-%m-%dT%H:%M:%S'), port=ser.port,
+                  uid=uid, version=device_caps.version)
+    with open(archive_path, 'a') as archive:
+        archive.write(json.dumps(record) + "\n")
+    print("\n   Archived to {0}".format(archive_path))
+    return 0
+
+def run_stream_benchmark(block_lens):
+    """
+    Flash app_image once per checkpoint interval in block_lens with BL_STREAM and print the
+    throughput of each next to the share of the line the CRCs leave for data. Returns 0 or
+    the first negative error.
+    """
+    global verbose_mode
+    if not (device_caps and (device_caps.features & BL_FEATURE_STREAM)):
+        print("\n   The bootloader does not support BL_STREAM")
+        return -1
+    image_len = len(app_image.data)
+    results = []
+    verbose_mode = 0
+    for block_len in block_lens:
+        start = time.perf_counter()
+        ret = decode_menu_command_code(13, block_len, 0)
+        if ret == 0:
+            ret = decode_menu_command_code(7)
+        if ret < 0:
+            return ret
+        results.append((block_len, time.perf_counter() - start))
+
+    print("\n   Stream throughput, {0} byte image at {1} baud".format(image_len, ser.baudrate))
+    print("   {0:>10} {1:>10} {2:>12} {3:>12}".format("interval", "time s", "bytes/s", "line data %"))
+    for block_len, elapsed in results:
+        blocks = -(-image_len // block_len)
+        print("   {0:>10} {1:>10.2f} {2:>12.0f} {3:>12.1f}".format(
+            block_len, elapsed, image_len / elapsed, 100.0 * image_len / (image_len + 4 * blocks)))
+    return 0
+
+def run_fec_benchmark(bit_error_rates, parity):
+    """
+    Flash app_image with BL_STREAM through the link emulator at each bit error rate, once
+    plain and once with parity bytes per codeword, and print the goodput of each. Returns 0,
+    or -1 when the device cannot decode.
+    """
+    global verbose_mode, link_ber
+    if not (device_caps and (device_caps.features & BL_FEATURE_FEC)):
+        print("\n   The bootloader does not support BL_STREAM forward error correction")
+        return -1
+    image_len = len(app_image.data)
+    results = []
+    verbose_mode = 0
+    try:
+        for ber in bit_error_rates:
+            for fec in (0, parity):
+                link_ber = ber
+                start = time.perf_counter()
+                ret = decode_menu_command_code(13, stream_block_len, 0, fec)
+                elapsed = time.perf_counter() - start
+                link_ber = 0.0
+                end = decode_menu_command_code(7)
+                results.append((ber, fec, ret if ret < 0 else end, elapsed, stream_rollbacks))
+    finally:
+        link_ber = 0.0
+
+    print("\n   Goodput against bit error rate, {0} byte image, {1} byte blocks at {2} baud".format(
+        image_len, stream_block_len, ser.baudrate))
+    print("   {0:>10} {1:>7} {2:>10} {3:>12} {4:>10}".format("BER", "parity", "time s", "bytes/s", "rollbacks"))
+    for ber, fec, ret, elapsed, rollbacks in results:
+        goodput = "{0:>12.0f}".format(image_len / elapsed) if ret == 0 else "{0:>12}".format("failed")
+        print("   {0:>10.0e} {1:>7} {2:>10.2f} {3} {4:>10}".format(ber, fec, elapsed, goodput, rollbacks))
+    return 0
+
+def run_resume_benchmark(fraction):
+    """
+    Cut the BL_STREAM link once after fraction of app_image, resume from the device journal and
+    compare the time of the resumed transfer with streaming the whole image again. Returns 0
+    or the first negative error.
+    """
+    global verbose_mode, link_drop_at
+    if not (device_caps and (device_caps.features & BL_FEATURE_JOURNAL)):
+        print("\n   The bootloader does not keep a journal")
+        return -1
+    image_len = len(app_image.data)
+    verbose_mode = 0
+
+    link_drop_at = int(image_len * fraction)
+    start = time.perf_counter()
+    ret = decode_menu_command_code(13, stream_block_len, 0)
+    aborted = time.perf_counter() - start
+    link_drop_at = None
+    if ret == 0:
+        print("\n   The link was not cut")
+        return -1
+    # The device gives up on the stream after BL_STREAM_TIMEOUT_MS of silence
+    time.sleep(BL_STREAM_TIMEOUT_MS / 1000.0 + 2 * BL_STREAM_GAP_MS / 1000.0)
+    purge_serial_port()
+
+    start = time.perf_counter()
+    offset = find_resume_offset()
+    ret = decode_menu_command_code(13, stream_block_len, 0, 0, offset)
+    if ret == 0:
+        ret = decode_menu_command_code(7)
+    resumed = time.perf_counter() - start
+    if ret < 0:
+        return ret
+    intact = image_on_device()
+
+    start = time.perf_counter()
+    ret = decode_menu_command_code(13, stream_block_len, 0)
+    if ret == 0:
+        ret = decode_menu_command_code(7)
+    full = time.perf_counter() - start
+    if ret < 0:
+        return ret
+
+    print("\n   Resume after a cut link, {0} byte image at {1} baud".format(image_len, ser.baudrate))
+    print("   Cut at offset       : {0} ({1:.2f} s in)".format(int(image_len * fraction), aborted))
+    print("   Resumed from offset : {0}, image {1}".format(offset, "intact" if intact else "DIFFERS"))
+    print("   Resumed transfer    : {0:.2f} s".format(resumed))
+    print("   Full restart        : {0:.2f} s".format(full))
+    print("   Time saved          : {0:.2f} s ({1:.0f} %)".format(full - resumed, 100.0 * (full - resumed) / full))
+    return 0 if intact else -1
+
+def print_bench_archive(archive_path):
+    """
+    Print every run of a BL_BENCH archive through the same report as a live run.
+    """
+    with open(archive_path) as archive:
+        for line in archive:
+            if not line.strip():
+                continue
+            record = json.loads(line)
+            print("\n   {0}  board {1}  bootloader {2:#04x}  port {3}".format(
+                record['time'], record['uid'], record['version'], record['port']))
+            print("\n".join(format_bench_report(BenchResult(*(record[field] for field in BenchResult._fields)))))
+
+def run_stub(stub_path, stub_args):
+    """
+    Upload a RAM loader stub (bl_stub.h) into the device work buffer, run it with BL_EXEC_STUB
+    and print what it returned. Returns 0 or the negative error.
+    """
+    with open(stub_path, 'rb') as stub_file:
+        stub = stub_file.read()
+    if len(stub) < BL_STUB_HEADER_FORMAT.size:
+        print("\n   {0}: too short for a stub header".format(stub_path))
+        return -1
+    magic, abi_version, entry, image_len = BL_STUB_HEADER_FORMAT.unpack_from(stub)
+    if magic != BL_STUB_MAGIC or abi_version != BL_STUB_ABI_VERSION or image_len > len(stub):
+        print("\n   {0}: not a stub for ABI version {1}".format(stub_path, BL_STUB_ABI_VERSION))
+        return -1
+
+    decode_menu_command_code(8)
+    if device_caps is None or not (device_caps.features & BL_FEATURE_STUBS):
+        print("\n   The bootloader does not run stubs")
+        return -1
+    if image_len > device_caps.work_buffer_len:
+        print("\n   Stub of {0} bytes does not fit the {1} byte work buffer".format(image_len, device_caps.work_buffer_len))
+        return -1
+
+    upload_start = time.perf_counter()
+    ret = upload_to_ram(device_caps.work_buffer_addr, stub[:image_len])
+    if ret < 0:
+        return ret
+    exec_start = time.perf_counter()
+    ret = decode_menu_command_code(11, device_caps.work_buffer_addr, *stub_args)
+    if ret < 0 or stub_result is None:
+        return ret if ret < 0 else -2
+    print("\n   Stub {0}: {1} bytes uploaded in {2:.2f} s, ran for {3} cycles, round trip {4:.1f} ms".format(
+        os.path.basename(stub_path), image_len, exec_start - upload_start, stub_result.cycles,
+        (time.perf_counter() - exec_start) * 1000))
+    return 0 if stub_result.status == 0 else -1
+
+def run_staged_update():
+    """
+    Stream app_image into the device work buffer one slice at a time and let BL_COMMIT erase
+    and program each slice from SRAM. The UART then runs at line rate instead of waiting for
+    the flash after every frame. Returns 0 or the negative error.
+    """
+    image = app_image
+    # The device commits whole words, pad the image out to word boundaries with erased flash
+    base = image.base & ~3
+    data = b'\xff' * (image.base - base) + image.data
+    data += b'\xff' * (-len(data) % 4)
+    slice_len = device_caps.work_buffer_len & ~3
+    slice_offset = 0
+    restarts = 0
+    while slice_offset < len(data):
+        chunk = data[slice_offset:slice_offset + slice_len]
+        digest = get_flash_digest(chunk)
+
+        stream_start = time.perf_counter()
+        ret = upload_to_ram(device_caps.work_buffer_addr, chunk)
+        if ret < 0:
+            return ret
+        commit_start = time.perf_counter()
+        ret = decode_menu_command_code(10, base + slice_offset, len(chunk), digest)
+        if ret < 0:
+            return ret
+        if commit_result is None:
+            return -2
+        if commit_result.status == BL_SESSION_RESTART and restarts < len(FLASH_SECTOR_BASE):
+            # A sector holding earlier slices had to be erased, resend from its base. Nothing of
+            # this slice was programmed, the sector may start past it
+            restarts += 1
+            slice_offset = min(slice_offset, max(commit_result.crc - base, 0))
+            print("\n   Sector at {0:#010x} erased again, resending from image offset {1}".format(
+                commit_result.crc, slice_offset))
+            continue
+        if commit_result.status != Flash_HAL_OK or commit_result.crc != digest:
+            print("\n   Commit at {0:#010x} failed: status {1:#04x}, crc {2:#010x} expected {3:#010x}".format(
+                base + slice_offset, commit_result.status, commit_result.crc, digest))
+            return -1
+        print("\n   Slice: {0} bytes at {1:#010x}, stream {2:.2f} s, commit {3:.2f} s".format(
+            len(chunk), base + slice_offset, commit_start - stream_start, time.perf_counter() - commit_start))
+        slice_offset += len(chunk)
+
+    # Each commit checked its own slice, this checks that no later slice cost an earlier one
+    if COMMAND_BL_GET_CID in device_caps.commands:
+        print("\nExecuting BL_GET_CID...")
+        if not image_on_device():
+            print("\n   Image digest does not match after the last slice")
+            return -1
+    return 0
+
 def automate_process_flow():
-    # Step 1: Calculate the number of sectors to erase
-    file_size = calc_file_len()
-    sector_count = get_sector_count(file_size)
-    print(f"\nFile size: {file_size} bytes")
-    print(f"Number of sectors to erase: {sector_count}")
+    """
+    Flash app_image into the device on ser and start it. Returns 0, or the negative
+    result of the first step that failed.
+    """
+    # Step 1: Calculate the sectors the image covers
+    file_size = len(app_image.data)
+    first_sector, sector_count = get_sector_range(app_image.base, file_size)
+    print(f"\nImage size: {file_size} bytes at {app_image.base:#010x}")
+    print(f"Sectors covered: {first_sector} to {first_sector + sector_count - 1}")
 
     # Step 2: Execute BL_GET_VER
     print("\nExecuting BL_GET_VER...")
-    decode_menu_command_code(1)
+    ret = decode_menu_command_code(1)
+    if ret < 0:
+        return ret
+
+    # Step 3: Ask for the device capabilities and pick the fastest transfer mode they allow
+    print("\nExecuting BL_GET_HELP...")
+    decode_menu_command_code(8)
+    apply_transfer_mode(device_caps)
+
+    # Flash if different: a board that already holds the image only gets started
+    global image_already_present
+    image_already_present = 0
+    if flash_if_different and device_caps and COMMAND_BL_GET_CID in device_caps.commands:
+        check_start = time.perf_counter()
+        print("\nExecuting BL_GET_CID...")
+        if image_on_device():
+            image_already_present = 1
+            print("\nImage already present on {0}, update skipped ({1:.0f} ms)".format(
+                device_cid.uid, (time.perf_counter() - check_start) * 1000))
+            print("\nExecuting BL_GO_TO_ADDR...")
+            return decode_menu_command_code(2, app_image.entry)
+
+    update_start = time.perf_counter()
+    path = select_transfer_path(device_caps, use_streaming, use_staging, use_write_session)
+    streamed = path == 'stream'
+    staged = path == 'staged'
+    if streamed:
+        # Steps 4 and 5: Stream the image with a CRC checkpoint per block, sectors erase in the background
+        resume_offset = 0
+        if use_resume and (device_caps.features & BL_FEATURE_JOURNAL):
+            print("\nExecuting BL_JOURNAL...")
+            resume_offset = find_resume_offset()
+            if resume_offset:
+                print("\n   Resuming at image offset {0} of {1}".format(resume_offset, file_size))
+        print("\nExecuting BL_STREAM...")
+        parity = stream_fec_parity if device_caps.features & BL_FEATURE_FEC else 0
+        ret = decode_menu_command_code(13, stream_block_len, session_flags & BL_SESSION_LAZY_ERASE, parity, resume_offset)
+        if ret < 0 and resume_offset and stream_checkpoint and stream_checkpoint[0] == BL_JOURNAL_MISMATCH:
+            print("\n   Resume refused, streaming the whole image")
+            ret = decode_menu_command_code(13, stream_block_len, session_flags & BL_SESSION_LAZY_ERASE, parity)
+        if ret < 0:
+            return ret
+
+        print("\nExecuting BL_SESSION_END...")
+        ret = decode_menu_command_code(7)
+        if ret < 0:
+            return ret
+    elif staged:
+        # Steps 4 and 5: Stream slices into the device SRAM, BL_COMMIT programs each one
+        print("\nExecuting BL_MEM_WRITE to the staging buffer and BL_COMMIT...")
+        ret = run_staged_update()
+        if ret < 0:
+            return ret
+    elif use_write_session:
+        # Step 4: Open a write session, the device erases the range in the background
+        print("\nExecuting BL_SESSION_BEGIN...")
+        ret = decode_menu_command_code(6, app_image.base, file_size, session_flags)
+        if ret < 0:
+            return ret
+
+        # Step 5: Execute BL_MEM_WRITE, frames are queued while sectors erase
+        print("\nExecuting BL_MEM_WRITE...")
+        ret = decode_menu_command_code(4, app_image.base)
+        if ret < 0:
+            return ret
+
+        print("\nExecuting BL_SESSION_END...")
+        ret = decode_menu_command_code(7)
+        while ret == 0 and session_restart_address is not None:
+            ret = decode_menu_command_code(4, app_image.base, session_restart_address - app_image.base)
+            if ret == 0:
+                ret = decode_menu_command_code(7)
+        if ret < 0:
+            return ret
+    else:
+        # Step 4: Execute BL_FLASH_ERASE
+        print("\nExecuting BL_FLASH_ERASE...")
+        ret = decode_menu_command_code(3, first_sector, sector_count)
+        if ret < 0:
+            return ret
+
+        # Step 5: Execute BL_MEM_WRITE
+        print("\nExecuting BL_MEM_WRITE...")
+        ret = decode_menu_command_code(4, app_image.base)
+        if ret < 0:
+            return ret
+    mode = ("stream" if streamed else "staged commit" if staged else
+            "write session" if use_write_session else "erase then write")
+    print("\nUpdate time ({0}): {1:.2f} s".format(mode, time.perf_counter() - update_start))
+
+    # Step 6: Read (and clear) the device counters for this session
+    print("\nExecuting BL_GET_STATS...")
+    decode_menu_command_code(5, BL_STATS_CLEAR)
+
+    # Step 7: Execute BL_GO_TO_ADDR, jump to the image entry point
+    print("\nExecuting BL_GO_TO_ADDR...")
+    return decode_menu_command_code(2, app_image.entry)
 
-    # Step 3: Execute BL_FLASH_ERASE
-    print("\nExecuting BL_FLASH_ERASE...")
-    decode_menu_command_code(3, 2, 3)  # Start from sector 0, erase 'sector_count' sectors
+# ----------------------------- Station Mode -----------------------------
 
-    # Step 4: Execute BL_MEM_WRITE
-    print("\nExecuting BL_MEM_WRITE...")
-    ret = decode_menu_command_code(4, 0x08008000)  # base_mem_address = 0x08008000
+def station_worker(port, image_path, log_path):
+    """
+    Flash the board on port in a process of its own, with its output in log_path, so a slow
+    or hung board only holds up its own worker. Returns (ret, seconds, uid, skipped).
+    """
+    global app_image
+    start = time.perf_counter()
+    with open(log_path, 'w', buffering=1) as log:
+        sys.stdout = log
+        app_image = load_image(image_path)
+        ret = Serial_Port_Configuration(port)
+        if ret == 0:
+            ret = automate_process_flow()
+            Close_serial_port()
+        sys.stdout = sys.__stdout__
+    return ret, time.perf_counter() - start, device_cid.uid if device_cid else '', image_already_present
+
+def run_station(ports, image_path, log_dir):
+    """
+    Flash every port in parallel with one worker per port and print a per device report.
+    Returns the number of boards that failed.
+    """
+    if not ports:
+        print("\n   Station: no ports to flash")
+        return 1
+    os.makedirs(log_dir, exist_ok=True)
+    print("\n   Station: flashing {0} boards, logs in {1}".format(len(ports), log_dir))
+    results = {}
+    start = time.perf_counter()
+    with concurrent.futures.ProcessPoolExecutor(max_workers=len(ports)) as pool:
+        jobs = {}
+        for port in ports:
+            log_path = os.path.join(log_dir, re.sub(r'\W+', '_', port).strip('_') + '.log')
+            jobs[pool.submit(station_worker, port, image_path, log_path)] = port
+        for job in concurrent.futures.as_completed(jobs):
+            port = jobs[job]
+            try:
+                ret, seconds, uid, skipped = job.result()
+            except Exception as error:
+                ret, seconds, uid, skipped = repr(error), time.perf_counter() - start, '', 0
+            result = "FAIL" if ret != 0 else ("SAME" if skipped else "OK")
+            results[port] = (ret, seconds, uid, result)
+            print("   {0:<16} {1:<8} {2:7.2f} s".format(port, result, seconds))
+    wall = time.perf_counter() - start
+
+    passed = [seconds for ret, seconds, _, _ in results.values() if ret == 0]
+    print("\n   ---------------- Station report ----------------")
+    for port in ports:
+        ret, seconds, uid, result = results[port]
+        print("   {0:<16} {1:<8} {2:7.2f} s  {3:<24} {4}".format(port, result, seconds, uid,
+                                                                "" if ret == 0 else "result: {0}".format(ret)))
+    print("   Boards OK           : {0} of {1} ({2} already up to date)".format(
+        len(passed), len(ports), sum(1 for _, _, _, result in results.values() if result == "SAME")))
+    print("   Station time        : {0:.2f} s".format(wall))
+    if passed and wall:
+        image_size = len(app_image.data)
+        flashed = sum(1 for _, _, _, result in results.values() if result == "OK")
+        print("   Aggregate rate      : {0:.1f} bytes/s".format(flashed * image_size / wall))
+        # Serial time of the same boards over the parallel wall time
+        print("   Parallel speedup    : {0:.2f} x".format(sum(passed) / wall))
+    return len(ports) - len(passed)
+
+# ----------------------------- Bus Mode -----------------------------
+
+def bus_idle():
+    """
+    Wait until the line has sent everything written and stayed idle long enough for a node
+    that lost the frame sync (noise, other replies, stream data) to find it again.
+    """
+    ser.flush()
+    time.sleep(max(0.0, line_idle_at - time.perf_counter()) + 2 * BL_NODE_GAP_MS / 1000.0)
+
+def bus_address_to(address):
+    """
+    Send the requests that follow to one node (it answers), BL_NODE_TO_GROUP or
+    BL_NODE_BROADCAST (nobody answers).
+    """
+    global bus_address
+    bus_idle()
+    bus_address = address
+
+def bus_request(command, *args):
+    """decode_menu_command_code for the addressed node, once more when a lost frame timed it out."""
+    ret = decode_menu_command_code(command, *args)
+    if ret == -2:
+        bus_idle()
+        ret = decode_menu_command_code(command, *args)
+    return ret
+
+def bus_set_group(addresses):
+    """Make the nodes with these addresses the BL_NODE_TO_GROUP members and address them."""
+    mask = bytearray(BL_NODE_GROUP_LEN)
+    for address in addresses:
+        mask[address // 8] |= 1 << (address % 8)
+    bus_idle()
+    decode_menu_command_code(15, BL_NODE_GROUP, bytes(mask))
+    bus_address_to(BL_NODE_TO_GROUP)
+
+def bus_enum_slot(uid, seed, slots):
+    """BL_NODE_ENUM slot of the node with this UID (hex), as bootloader_node_slot picks it."""
+    value = ((seed + 1) * 0x9E3779B1) & 0xFFFFFFFF
+    for word in struct.unpack('<3I', bytes.fromhex(uid)):
+        value = ((value ^ word) * 0x85EBCA6B) & 0xFFFFFFFF
+        value ^= value >> 13
+    return value % slots
+
+def bus_enumerate():
+    """
+    Find every node on the bus in rounds of BL_NODE_ENUM. Each node without an address answers
+    its UID in a slot of its own choosing, the ones that collided try again next round. The
+    next request acknowledges the slots that came through clean, their nodes take the
+    addresses from first_address on in slot order and fall silent. Rounds that stay silent
+    end it. Returns the UIDs (hex) in address order.
+    """
+    addresses = {}
+    mask, first_address, next_address = 0, 1, 1
+    slots, flags, rounds, silent = BUS_ENUM_FIRST_SLOTS, BL_NODE_ENUM_RESET, 0, 0
+    slot_len = BL_NODE_ENUM_REPLY_LEN + BUS_ENUM_GUARD
+    start = time.perf_counter()
+    bus_idle()
+    while rounds < BUS_ENUM_ROUNDS_MAX:
+        # The nodes take the mask for the round whose seed is one below
+        seed = rounds & 0xFF
+        print("\nExecuting BL_NODE_ENUM, {0} slots...".format(slots))
+        decode_menu_command_code(15, BL_NODE_ENUM, struct.pack('<5BQ', slots, seed, slot_len, flags, first_address, mask))
+        found, garbled = node_enum
+        flags, rounds = 0, rounds + 1
+        # A node that missed its acknowledgement answers again and gets a new address
+        heard = sorted(dict.fromkeys(found), key=lambda uid: bus_enum_slot(uid, seed, slots))
+        # Addresses end below BL_NODE_TO_GROUP, the nodes past that are not acknowledged
+        heard = heard[:max(0, BL_NODE_TO_GROUP - next_address)]
+        mask, first_address = 0, next_address
+        for address, uid in enumerate(heard, first_address):
+            addresses[uid] = address
+            mask |= 1 << bus_enum_slot(uid, seed, slots)
+        next_address += len(heard)
+        # A request lost in noise leaves a round silent as well
+        silent = 0 if heard or garbled else silent + 1
+        if silent == BUS_ENUM_SILENT_ROUNDS:
+            break
+        # A garbled slot held two nodes or more, 2.39 on average
+        slots = max(1, min(BL_NODE_ENUM_SLOTS_MAX, round(2.39 * -(-garbled // BL_NODE_ENUM_REPLY_LEN))))
+    wall = time.perf_counter() - start
+    uids = sorted(addresses, key=addresses.get)
+    print("\n   Enumeration: {0} nodes in {1:.0f} ms, {2} rounds".format(len(uids), wall * 1000, rounds))
+    return uids
+
+def bus_chunk_len(chunk_len):
+    """MEM_WRITE payload length for chunk_len, on a bus the frame must not look like a reply."""
+    if bus_address is not None and chunk_len + COMMAND_BL_MEM_WRITE_LEN + BL_NODE_FOR_LEN - 1 == BL_REPLY:
+        return chunk_len - 4  # the other nodes would skip it as a reply
+    return chunk_len
+
+def bus_missing_blocks(block_len=BUS_DIGEST_BLOCK):
+    """
+    Compare the block digests of the addressed node with app_image. Returns the (offset, length)
+    of every block that differs, None when the node does not answer.
+    """
+    image = app_image.data + b'\xff' * (-len(app_image.data) % 4)
+    blocks = [(offset, min(block_len, len(image) - offset)) for offset in range(0, len(image), block_len)]
+    missing = []
+    index = 0
+    while index < len(blocks):
+        # Blocks of one length per request, the last one may be shorter
+        count = 1
+        while (index + count < len(blocks) and count < BL_NODE_DIGESTS_MAX and
+               blocks[index + count][1] == blocks[index][1]):
+            count += 1
+        offset, length = blocks[index]
+        ret = bus_request(15, BL_NODE_DIGEST, struct.pack('<IHB', app_image.base + offset, length, count))
+        if ret < 0 or node_digests is None or len(node_digests) != count:
+            return None
+        for (offset, length), digest in zip(blocks[index:index + count], node_digests):
+            if digest != get_flash_digest(image[offset:offset + length]):
+                missing.append((offset, min(length, len(app_image.data) - offset)))
+        index += count
+    return missing
+
+def bus_resend(extents):
+    """
+    Send the extents of app_image to the addressed node alone, in a BL_SESSION_COMPARE session:
+    blocks it holds are skipped and blocks it missed are programmed in place. Returns 0 or the
+    negative error.
+    """
+    ret = decode_menu_command_code(6, app_image.base, len(app_image.data), BL_SESSION_COMPARE)
+    if ret < 0:
+        return ret
+    offset, retries, nack_offset = 0, 0, None
+    saved_timeout = ser.timeout
+    # Missed blocks are still erased and programmed in place, nothing stalls the node for long
+    ser.timeout = BUS_REPLY_TIMEOUT
+    try:
+        while offset is not None:
+            status, offset, _ = run_mem_write_pass(app_image.base, extents, offset, lambda image_offset, chunk_len: None)
+            if status == 'restart':
+                # The sector was erased, everything of the image in it has to go again
+                extents = app_image.segments
+            elif status in ('nack', 'timeout'):
+                # A noisy line loses a frame now and then, only one that never gets through ends it
+                retries = retries + 1 if offset == nack_offset else 1
+                nack_offset = offset
+                if retries > MEM_WRITE_RETRIES:
+                    return -1 if status == 'nack' else -2
+                bus_idle()
+            elif status == 'error':
+                return -1
+    finally:
+        ser.timeout = saved_timeout
+    ret = decode_menu_command_code(7)
+    while ret == 0 and session_restart_address is not None:
+        ret = decode_menu_command_code(4, app_image.base, session_restart_address - app_image.base)
+        if ret == 0:
+            ret = decode_menu_command_code(7)
+    return ret
+
+def run_bus_update(uids):
+    """
+    Flash app_image into every node with these UIDs on the one bus of ser. The nodes get the
+    addresses 1, 2, ... and one write session together, the image goes over the line once
+    with nobody answering. Each node is then polled for its block digests and only the blocks
+    it missed are sent again, to it alone. Returns the number of nodes that failed.
+    """
+    global bus_address, mem_write_chunk, bus_resent
+    start = time.perf_counter()
+    nodes = []
+    bus_resent = {}
+    bus_idle()
+    for address, uid in enumerate(uids, 1):
+        print("\nExecuting BL_NODE_ASSIGN {0} to {1}...".format(address, uid))
+        if bus_request(15, BL_NODE_ASSIGN, bytes.fromhex(uid) + bytes([address])) == 0 and node_address == address:
+            nodes.append(address)
+        else:
+            print("\n   Node {0} does not answer".format(uid))
+    if not nodes:
+        return len(uids)
+
+    # All of them run the same bootloader
+    print("\nExecuting BL_GET_HELP...")
+    bus_address_to(nodes[0])
+    decode_menu_command_code(8)
+    if not (device_caps and (device_caps.features & BL_FEATURE_BUS)):
+        print("\n   The bootloader has no bus support")
+        bus_address = None
+        return len(uids)
+    apply_transfer_mode(device_caps)
+    mem_write_chunk = min(mem_write_chunk, (device_caps.max_frame_len - COMMAND_BL_MEM_WRITE_LEN - BL_NODE_FOR_LEN) & ~3)
+    base, image = app_image.base, app_image.data
+    first_sector, sector_count = get_sector_range(base, len(image))
+    range_mask = ((1 << sector_count) - 1) << first_sector
+    resent = bus_resent = dict.fromkeys(nodes, 0)
+    failed = set()
+
+    # Step 1: one write session on all nodes, each erases the range in the background
+    print("\nExecuting BL_SESSION_BEGIN on {0} nodes...".format(len(nodes)))
+    bus_set_group(nodes)
+    Write_to_serial_port(encode_frame(COMMAND_BL_SESSION_BEGIN, struct.pack('<IIB', base, len(image), 0)))
+
+    # Step 2: wait for the erase, a node only answers between two sector erases
+    for address in nodes:
+        bus_address_to(address)
+        deadline = time.perf_counter() + SESSION_END_TIMEOUT
+        while bus_request(15, BL_NODE_STATUS, b'') == 0 and node_status and node_status.session_active:
+            if (node_status.erased_mask & range_mask) == range_mask or time.perf_counter() > deadline:
+                break
+            time.sleep(BUS_ERASE_POLL)
+        if not (node_status and node_status.session_active):
+            print("\n   Node {0} missed the session, it gets the image on its own".format(address))
+    erased = time.perf_counter()
+
+    # Step 3: the image once for all of them, every frame CRC checked and unanswered
+    print("\nExecuting BL_MEM_WRITE to {0} nodes...".format(len(nodes)))
+    bus_set_group(nodes)
+    frames = 0
+    for seg_offset, seg_len in app_image.segments:
+        offset = seg_offset
+        while offset < seg_offset + seg_len:
+            chunk_len = bus_chunk_len(min(mem_write_chunk, seg_offset + seg_len - offset))
+            Write_to_serial_port(encode_frame(COMMAND_BL_MEM_WRITE, struct.pack('<IB', base + offset, chunk_len) +
+                                              image[offset:offset + chunk_len]))
+            offset += chunk_len
+            frames += 1
+            if frames % BUS_SYNC_FRAMES == 0:
+                bus_idle()
+    bus_idle()
+    broadcast = time.perf_counter()
+
+    # Step 4: each node programs what it got and is checked, what it missed is sent to it alone
+    for address in nodes:
+        print("\nChecking node {0}...".format(address))
+        bus_address_to(address)
+        # What is still queued counts as missing when the reply got lost
+        bus_request(7)
+        purge_serial_port()
+        missing = bus_missing_blocks()
+        rounds = 0
+        while missing and rounds < BUS_RESEND_ROUNDS:
+            rounds += 1
+            resent[address] += sum(length for _, length in missing)
+            print("\n   Node {0}: {1} blocks missing, resending them".format(address, len(missing)))
+            # Checked again even when the resend failed, the node resyncs on the idle line
+            bus_resend(missing)
+            missing = bus_missing_blocks()
+        if missing != []:
+            failed.add(address)
+    checked = time.perf_counter()
+
+    # Step 5: start the image on every node that holds it
+    good = [address for address in nodes if address not in failed]
+    if good:
+        print("\nExecuting BL_GO_TO_ADDR on {0} nodes...".format(len(good)))
+        bus_set_group(good)
+        Write_to_serial_port(encode_frame(COMMAND_BL_GO_TO_ADDR, struct.pack('<I', app_image.entry)))
+        ser.flush()
+    bus_address = None
+
+    wall = time.perf_counter() - start
+    frame_len = COMMAND_BL_MEM_WRITE_LEN + BL_NODE_FOR_LEN
+    line_time = (len(image) + -(-len(image) // mem_write_chunk) * frame_len) * 10.0 / ser.baudrate
+    print("\n   ---------------- Bus report ----------------")
+    for address, uid in enumerate(uids, 1):
+        result = "FAIL" if address in failed or address not in nodes else "OK"
+        print("   node {0:<3} {1:<24} {2:<5} {3:7} bytes resent".format(address, uid, result, resent.get(address, 0)))
+    print("   Nodes OK            : {0} of {1}".format(len(good), len(uids)))
+    print("   Erase wait          : {0:.2f} s".format(erased - start))
+    print("   Broadcast           : {0:.2f} s ({1:.2f} s of line time for the image)".format(broadcast - erased, line_time))
+    print("   Check and resend    : {0:.2f} s".format(checked - broadcast))
+    print("   Bus time            : {0:.2f} s for {1} nodes".format(wall, len(uids)))
+    return len(uids) - len(good)
 
-    # Step 5: Execute BL_GO_TO_ADDR
-    print("\nExecuting BL_GO_TO_ADDR...")
-    decode_menu_command_code(2, 0x08008848)  # go_address = 0x08008848
 '''
 def automate_process_flow():
     # Step 1: Execute BL_GET_VER
@@ -469,16 +2565,216 @@ def automate_process_flow():
 '''
 # ----------------------------- Main Execution -----------------------------
 
-name = input("Enter the Port Name of your device (Ex: COM3): ")
-ret = Serial_Port_Configuration(name)
-if ret < 0:
-    decode_menu_command_code(0)
-
-# Run the automated process flow
-automate_process_flow()
+# Station workers import this file, only the parent process runs the main flow
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Flash an application through the UART bootloader")
+    parser.add_argument('image', nargs='?', default='user_app.bin',
+                        help="ELF, Intel HEX, S-record or raw binary (linked at APP_BASE_ADDRESS)")
+    parser.add_argument('--port', help="serial port of the device, asked for when omitted")
+    parser.add_argument('--station', nargs='*', metavar='PORT',
+                        help="flash all given ports in parallel, every port with a bootloader when none are given")
+    parser.add_argument('--discover', nargs='*', metavar='PORT',
+                        help="list the ports with a live bootloader and exit, all serial ports when none given")
+    parser.add_argument('--log-dir', default='station_logs', help="per board logs of the station mode")
+    parser.add_argument('--bench-parse', action='store_true', help="time the image parsers on 512 KB inputs and exit")
+    parser.add_argument('--crc-selftest', action='store_true', help="check the CRC against the bitwise reference and exit")
+    parser.add_argument('--mode-selftest', action='store_true', help="check the transfer mode picked for a set of GET_HELP replies and exit")
+    parser.add_argument('--credit-selftest', action='store_true',
+                        help="flash a simulated bootloader with slow flash with and without receive credits and exit")
+    parser.add_argument('--session-selftest', action='store_true',
+                        help="time a simulated 3 sector update with and without a write session and exit")
+    parser.add_argument('--lazy-selftest', action='store_true',
+                        help="compare simulated updates with fixed, computed and lazy sector erases and exit")
+    parser.add_argument('--compare-selftest', action='store_true',
+                        help="count the erases simulated updates of sample image pairs need with and without compare and exit")
+    parser.add_argument('--sparse-selftest', action='store_true',
+                        help="count the bytes simulated updates of padded sample images send with and without sparse upload and exit")
+    parser.add_argument('--erase-rx-selftest', action='store_true',
+                        help="check that a simulated bootloader keeps receiving during sector erases and exit")
+    parser.add_argument('--bench-selftest', action='store_true',
+                        help="run --bench and --bench-report against a simulated bootloader and check the archive, then exit")
+    parser.add_argument('--stub-selftest', action='store_true',
+                        help="run --exec-stub against a simulated bootloader and check the parsed results, then exit")
+    parser.add_argument('--stream-selftest', action='store_true',
+                        help="flash an image with BL_STREAM to a simulated bootloader, once over a cut link, and exit")
+    parser.add_argument('--resume-selftest', action='store_true',
+                        help="cut a BL_STREAM to a simulated bootloader and resume it from the device journal, then exit")
+    parser.add_argument('--fec-selftest', action='store_true',
+                        help="check the Reed-Solomon coding and stream over a noisy link to a simulated bootloader, then exit")
+    parser.add_argument('--bus-selftest', nargs='?', const=8, type=int, metavar='NODES',
+                        help="flash NODES (default 8) simulated nodes on one bus, two of them lossy, and exit")
+    parser.add_argument('--enum-selftest', nargs='*', type=int, metavar='NODES',
+                        help="enumerate simulated buses of NODES nodes (default 32 and 64) and exit")
+    parser.add_argument('--transfer', choices=('auto', 'stream', 'staged', 'session', 'erase'), default='auto',
+                        help="stream: raw data with a CRC checkpoint per block, staged: SRAM slices plus BL_COMMIT, "
+                             "session: per frame with background erase, erase: erase then per frame write "
+                             "(default: fastest the device supports)")
+    parser.add_argument('--stream-block', type=int, default=stream_block_len, metavar='BYTES',
+                        help="BL_STREAM checkpoint interval ({0}-{1})".format(BL_STREAM_BLOCK_MIN, BL_STREAM_BLOCK_MAX))
+    parser.add_argument('--bench-stream', nargs='*', type=int, metavar='BYTES',
+                        help="flash the image with BL_STREAM at each checkpoint interval (default {0}), "
+                             "print the throughput and exit".format(' '.join(map(str, STREAM_BENCH_BLOCKS))))
+    parser.add_argument('--fec', type=int, default=0, metavar='PARITY',
+                        help="Reed-Solomon parity bytes per {0} byte BL_STREAM codeword ({1}-{2}, default 0: none)".format(
+                            FEC_CODEWORD_LEN, FEC_PARITY_MIN, FEC_PARITY_MAX))
+    parser.add_argument('--inject-ber', type=float, default=0.0, metavar='RATE',
+                        help="link emulator: flip bits of the BL_STREAM data sent at this bit error rate")
+    parser.add_argument('--bench-fec', nargs='*', type=float, metavar='BER',
+                        help="flash the image with BL_STREAM at each bit error rate (default {0}) with and without "
+                             "FEC, print the goodput and exit".format(' '.join(map(str, FEC_BENCH_BER))))
+    parser.add_argument('--no-resume', action='store_true',
+                        help="stream the whole image even when the device journal allows resuming")
+    parser.add_argument('--bench-resume', nargs='?', const=RESUME_BENCH_FRACTION, type=float, metavar='FRACTION',
+                        help="cut the stream link after FRACTION of the image (default {0}), resume from the device "
+                             "journal, compare with a full restart and exit".format(RESUME_BENCH_FRACTION))
+    parser.add_argument('--bus', nargs='*', metavar='UID',
+                        help="flash every node with these 96-bit UIDs (hex, as BL_GET_CID prints them) on the one "
+                             "multi-drop line of --port with a single broadcast, then resend what each node missed. "
+                             "Without UIDs the nodes on the line are enumerated first")
+    parser.add_argument('--exec-stub', nargs='+', metavar=('STUB', 'ARG'),
+                        help="upload a RAM loader stub (.bin) to the work buffer, run it with up to 4 arguments and exit")
+    parser.add_argument('--bench', nargs='?', const=BL_SECTOR_NONE, type=lambda value: int(value, 0), metavar='SECTOR',
+                        help="run BL_BENCH, erasing and programming SECTOR (its content is lost) when given, and exit")
+    parser.add_argument('--bench-archive', default='bench_archive.jsonl', help="file BL_BENCH results are appended to")
+    parser.add_argument('--bench-report', metavar='ARCHIVE', help="print the runs of a BL_BENCH archive and exit")
+    parser.add_argument('--bench-latency', nargs='?', const=200, type=int, metavar='COUNT',
+                        help="time COUNT round trips of short and long replies and exit")
+    parser.add_argument('--bench-ram', nargs='+', metavar=('ADDRESS', 'LEN'),
+                        help="MEM_WRITE random data to a RAM address (default 4096 bytes), print the cost and exit")
+    cli = parser.parse_args()
+
+    if cli.bench_parse:
+        benchmark_image_parsers()
+        raise SystemExit
+    if (cli.crc_selftest or cli.mode_selftest or cli.credit_selftest or cli.erase_rx_selftest or cli.session_selftest or
+            cli.lazy_selftest or cli.compare_selftest or cli.sparse_selftest or cli.stub_selftest or cli.bench_selftest or
+            cli.stream_selftest or cli.resume_selftest or cli.fec_selftest or cli.bus_selftest or cli.enum_selftest is not None):
+        # The self-tests and the simulated bootloader they run against live in bl_sim
+        import bl_sim
+        if cli.crc_selftest:
+            raise SystemExit(bl_sim.crc_selftest())
+        if cli.mode_selftest:
+            raise SystemExit(bl_sim.mode_selftest())
+        if cli.credit_selftest:
+            raise SystemExit(bl_sim.credit_selftest())
+        if cli.session_selftest:
+            raise SystemExit(bl_sim.session_selftest())
+        if cli.lazy_selftest:
+            raise SystemExit(bl_sim.lazy_selftest())
+        if cli.compare_selftest:
+            raise SystemExit(bl_sim.compare_selftest())
+        if cli.sparse_selftest:
+            raise SystemExit(bl_sim.sparse_selftest())
+        if cli.erase_rx_selftest:
+            raise SystemExit(bl_sim.erase_rx_selftest())
+        if cli.stub_selftest:
+            raise SystemExit(bl_sim.stub_selftest())
+        if cli.bench_selftest:
+            raise SystemExit(bl_sim.bench_selftest())
+        if cli.stream_selftest:
+            raise SystemExit(bl_sim.stream_selftest())
+        if cli.resume_selftest:
+            raise SystemExit(bl_sim.resume_selftest())
+        if cli.fec_selftest:
+            raise SystemExit(bl_sim.fec_selftest())
+        if cli.bus_selftest:
+            raise SystemExit(bl_sim.bus_selftest(cli.bus_selftest))
+        raise SystemExit(bl_sim.enum_selftest(cli.enum_selftest or bl_sim.ENUM_SELFTEST_NODES))
+
+    if not BL_STREAM_BLOCK_MIN <= cli.stream_block <= BL_STREAM_BLOCK_MAX:
+        parser.error("--stream-block must be {0} to {1}".format(BL_STREAM_BLOCK_MIN, BL_STREAM_BLOCK_MAX))
+    stream_block_len = cli.stream_block
+    if cli.fec and not FEC_PARITY_MIN <= cli.fec <= FEC_PARITY_MAX:
+        parser.error("--fec must be 0 or {0} to {1}".format(FEC_PARITY_MIN, FEC_PARITY_MAX))
+    stream_fec_parity = cli.fec
+    link_ber = cli.inject_ber
+    use_resume = 0 if cli.no_resume else 1
+    if cli.transfer != 'auto':
+        use_streaming = 1 if cli.transfer == 'stream' else 0
+        use_staging = 1 if cli.transfer == 'staged' else 0
+        use_write_session = 0 if cli.transfer == 'erase' else 1
+
+    if cli.bench_report:
+        print_bench_archive(cli.bench_report)
+        raise SystemExit
 
-# Close the serial port
-Close_serial_port()
+    if cli.bench is not None:
+        name = cli.port or input("Enter the Port Name of your device (Ex: COM3): ")
+        if Serial_Port_Configuration(name) < 0:
+            decode_menu_command_code(0)
+        ret = run_bench(cli.bench, cli.bench_archive)
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    if cli.bench_latency:
+        name = cli.port or input("Enter the Port Name of your device (Ex: COM3): ")
+        if Serial_Port_Configuration(name) < 0:
+            decode_menu_command_code(0)
+        ret = measure_command_latency(cli.bench_latency)
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    if cli.exec_stub:
+        name = cli.port or input("Enter the Port Name of your device (Ex: COM3): ")
+        if Serial_Port_Configuration(name) < 0:
+            decode_menu_command_code(0)
+        ret = run_stub(cli.exec_stub[0], [int(value, 0) for value in cli.exec_stub[1:5]])
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    if cli.bench_ram:
+        name = cli.port or input("Enter the Port Name of your device (Ex: COM3): ")
+        if Serial_Port_Configuration(name) < 0:
+            decode_menu_command_code(0)
+        ret = benchmark_ram_write(int(cli.bench_ram[0], 16), int(cli.bench_ram[1], 0) if len(cli.bench_ram) > 1 else 4096)
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    app_image = load_image(cli.image)
+
+    if cli.discover is not None:
+        raise SystemExit(0 if discover_bootloaders(cli.discover or None) else 1)
+    if cli.station is not None:
+        ports = cli.station or [port for port, _, _ in discover_bootloaders()]
+        raise SystemExit(run_station(ports, cli.image, cli.log_dir))
+    if cli.bus is not None:
+        name = cli.port or input("Enter the Port Name of the bus (Ex: COM3): ")
+        if Serial_Port_Configuration(name) < 0:
+            decode_menu_command_code(0)
+        uids = cli.bus or bus_enumerate()
+        ret = run_bus_update(uids) if uids else 1
+        Close_serial_port()
+        raise SystemExit(1 if ret else 0)
+
+    name = cli.port or input("Enter the Port Name of your device (Ex: COM3): ")
+    ret = Serial_Port_Configuration(name)
+    if ret < 0:
+        decode_menu_command_code(0)
+
+    if cli.bench_stream is not None:
+        decode_menu_command_code(8)
+        ret = run_stream_benchmark(cli.bench_stream or STREAM_BENCH_BLOCKS)
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    if cli.bench_resume is not None:
+        decode_menu_command_code(8)
+        ret = run_resume_benchmark(cli.bench_resume)
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    if cli.bench_fec is not None:
+        decode_menu_command_code(8)
+        ret = run_fec_benchmark(cli.bench_fec or FEC_BENCH_BER, stream_fec_parity or FEC_DEFAULT_PARITY)
+        Close_serial_port()
+        raise SystemExit(1 if ret < 0 else 0)
+
+    # Run the automated process flow
+    ret = automate_process_flow()
+
+    # Close the serial port
+    Close_serial_port()
+    raise SystemExit(1 if ret < 0 else 0)
 '''
 name = input("Enter the Port Name of your device(Ex: COM3):")
 ret = Serial_Port_Configuration(name)
@@ -0,0 +1,104 @@
+/*
+ * stub_blank_check.c
+ *
+ *  Sample RAM loader stub: checks that a flash range is erased and digests it with the
+ *  bootloader CRC routine. Build with
+ *
+ *  arm-none-eabi-gcc -mcpu=cortex-m4 -mthumb -Os -ffreestanding -nostdlib -fno-common \
+ *      -I../Core/Inc -T stub.ld stub_blank_check.c -o stub_blank_check.elf
+ *  arm-none-eabi-objcopy -O binary stub_blank_check.elf stub_blank_check.bin
+ *
+ *  and run it with python_script.py --exec-stub stub_blank_check.bin BASE LEN
+ *
+ *  arg[0]    : flash address, word aligned
+ *  arg[1]    : length in bytes, multiple of 4
+ *  result[0] : address of the first word that is not erased, 0xFFFFFFFF when blank
+ *  result[1] : number of words that are not erased
+ *  result[2] : bootloader digest of the range
+ *  result[3] : DWT cycles of the scan alone
+ *  return    : 0 blank, 1 not blank, 2 bad arguments
+ */
+
+/*******************************************************************************
+ *  HEADER FILE INCLUDES
+ *****************************************************************************/
+#include"bl_stub.h"
+/*******************************************************************************
+ *  MACRO DEFINITION
+ ******************************************************************************/
+#define DWT_CYCCNT   (*(volatile uint32_t *)0xE0001004U)
+/*******************************************************************************
+ *  STATIC FUNCTION PROTOTYPES
+ ******************************************************************************/
+uint32_t stub_blank_check(const bl_stub_api_t *api, bl_stub_params_t *params);
+extern uint32_t __stub_end;
+/*******************************************************************************
+ *  GLOBAL VARIABLES DEFINITION
+ ******************************************************************************/
+__attribute__((section(".stub_header"), used))
+const bl_stub_header_t stub_header = {
+                                BL_STUB_MAGIC,
+                                BL_STUB_ABI_VERSION,
+                                (uint32_t)&stub_blank_check,
+                                (uint32_t)&__stub_end,
+};
+
+/*******************************************************************************
+ *  FUNCTION DEFINITIONS
+ ******************************************************************************/
+/* -----------------------------------------------------------------------------
+*  FUNCTION DESCRIPTION
+*  -----------------------------------------------------------------------------
+*   Function Name : stub_blank_check
+*   Description   : Stub entry, scans four words per iteration and keeps going after the
+*                   first programmed word so the count covers the whole range
+*   Parameters    : p_args - const bl_stub_api_t *api, bl_stub_params_t *params
+*   Return Value  : uint32_t
+*  ---------------------------------------------------------------------------*/
+uint32_t stub_blank_check(const bl_stub_api_t *api, bl_stub_params_t *params)
+{
+	const volatile uint32_t *word = (const volatile uint32_t *)params->arg[0];
+	uint32_t count = params->arg[1] / 4;
+	uint32_t first = 0xFFFFFFFFU;
+	uint32_t dirty = 0;
+	uint32_t start;
+	uint32_t i = 0;
+
+	if((params->arg[0] & 3U) || (params->arg[1] & 3U) || (count == 0) ||
+	   (api->flash_get_sector(params->arg[0]) == 0xFF) ||
+	   (api->flash_get_sector(params->arg[0] + params->arg[1] - 1) == 0xFF))
+	{
+		return 2;
+	}
+
+	start = DWT_CYCCNT;
+	for( ; (i + 4) <= count ; i += 4)
+	{
+		if((word[i] & word[i + 1] & word[i + 2] & word[i + 3]) != 0xFFFFFFFFU)
+		{
+			for(uint32_t j = i ; j < i + 4 ; j++)
+			{
+				if(word[j] != 0xFFFFFFFFU)
+				{
+					first = (first == 0xFFFFFFFFU) ? (uint32_t)&word[j] : first;
+					dirty++;
+				}
+			}
+		}
+	}
+	for( ; i < count ; i++)
+	{
+		if(word[i] != 0xFFFFFFFFU)
+		{
+			first = (first == 0xFFFFFFFFU) ? (uint32_t)&word[i] : first;
+			dirty++;
+		}
+	}
+	params->result[3] = DWT_CYCCNT - start;
+
+	params->result[0] = first;
+	params->result[1] = dirty;
+	params->result[2] = api->flash_digest(params->arg[0], params->arg[1]);
+
+	return dirty ? 1 : 0;
+}